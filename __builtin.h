@@ -36,6 +36,38 @@ static inline int __builtin_clzl(unsigned long x) {
   return sizeof(x) == 8 ? __builtin_clzll(x) : __builtin_clz((uint32_t)x);
 }
 
+static inline int __builtin_popcountll(unsigned long long x) {
+  return (int)__popcnt64(x);
+}
+
+// atomic builtins used by the lock-free bitmap paths, memory order
+// is ignored as Interlocked* functions are full barriers
+#define __ATOMIC_ACQUIRE 2
+#define __ATOMIC_RELEASE 3
+#define __ATOMIC_ACQ_REL 4
+
+static inline unsigned long long __atomic_load_n(
+  const unsigned long long* p, int) {
+  return *(const volatile unsigned long long*)p;
+}
+
+static inline bool __atomic_compare_exchange_n(unsigned long long* p,
+  unsigned long long* expected, unsigned long long desired, bool, int, int) {
+  auto prev = (unsigned long long)_InterlockedCompareExchange64(
+    (volatile long long*)p, (long long)desired, (long long)*expected);
+  if (prev == *expected) {
+    return true;
+  }
+  *expected = prev;
+  return false;
+}
+
+static inline unsigned long long __atomic_fetch_or(unsigned long long* p,
+  unsigned long long v, int) {
+  return (unsigned long long)_InterlockedOr64((volatile long long*)p,
+    (long long)v);
+}
+
 #ifdef __cplusplus
 static inline int __builtin_ctzl(unsigned long long x) {
   return __builtin_ctzll(x);
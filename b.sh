@@ -1,3 +1,4 @@
 #!/bin/sh
 c++ -g -std=c++17  main.cc persistent_objects.cc fastbmap_allocator_impl.cc -I boost/include/ -lpthread -DNON_CEPH_BUILD
+c++ -O2 -std=c++17  fastbmap_allocator_bench.cc persistent_objects.cc fastbmap_allocator_impl.cc -I boost/include/ -lpthread -DNON_CEPH_BUILD -o fastbmap_allocator_bench
 
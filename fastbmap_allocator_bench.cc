@@ -0,0 +1,563 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Micro-benchmark for bitmap scan kernels: runs the same contiguous
+ * allocation sequence over a fragmented pool with scalar and SIMD
+ * kernels and verifies they produce identical results.
+ * Also compares L1 flavors in terms of memory and allocation speed
+ * and measures snapshot apply (i.e. restart) time for large pools.
+ * Then checks the cached longest free runs keep results intact while
+ * saving L0 scans and times paths dominated by level geometry math,
+ * the math itself is compared against virtual geometry dispatch.
+ * Measures L3 summary effect on single unit allocations from a full pool
+ * and times range marking as done by alloc log replay. Then compares
+ * scans over huge and regular page backed bitmaps.
+ * Times the whole pool restart, i.e. snapshot apply plus alloc log replay.
+ * Finally ages a pool with each placement policy and reports resulting
+ * fragmentation and allocation latency.
+ *
+ */
+
+#include "fastbmap_allocator_impl.h"
+#include "persistent_objects.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+
+using namespace std;
+
+template <class L1, class Policy = placement_default>
+class BenchAllocator : public AllocatorLevel02<L1, Policy>
+{
+  typedef AllocatorLevel02<L1, Policy> base_t;
+public:
+  using base_t::_init;
+  using base_t::_allocate_l2;
+  using base_t::_free_l2;
+  using base_t::_mark_allocated;
+  using base_t::_mark_free;
+  using base_t::_set_apply_threads;
+  using base_t::_get_fragmentation;
+  using base_t::_enable_run_cache;
+  using base_t::_enable_l3;
+
+  uint64_t get_l1_bytes() const {
+    return this->l1.get_l1_bytes();
+  }
+};
+
+static const uint64_t capacity = 64ull << 20;
+static const uint64_t unit = 16;
+
+// frees short runs of units scattered over the whole pool
+template <class A>
+static void fragment(A& a, unsigned seed)
+{
+  mt19937_64 rng(seed);
+  a._mark_allocated(0, capacity);
+  uint64_t pos = 0;
+  while (true) {
+    pos += unit * (1 + rng() % 24);
+    uint64_t len = unit * (1 + rng() % 12);
+    if (pos + len > capacity) {
+      break;
+    }
+    a._mark_free(pos, len);
+    pos += len;
+  }
+}
+
+template <class L1>
+static double run(size_t rounds, uint64_t length, uint64_t min_length,
+  interval_vector_t* res, uint64_t* l1_bytes = nullptr,
+  bool run_cache = false)
+{
+  BenchAllocator<L1> a;
+  a._init(capacity, unit);
+  a._enable_run_cache(run_cache);
+  fragment(a, 1);
+  if (l1_bytes) {
+    *l1_bytes = a.get_l1_bytes();
+  }
+
+  auto t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; i++) {
+    interval_vector_t v;
+    uint64_t allocated = 0;
+    a._allocate_l2(length, min_length, length, no_hint, &allocated, &v);
+    res->insert(res->end(), v.begin(), v.end());
+  }
+  auto t1 = chrono::steady_clock::now();
+  a._free_l2(*res);
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// restores compressed snapshot of a pool with free runs up to 16 MiB long
+// scattered over it, returns apply time
+template <class L1>
+static double run_apply(uint64_t pool, size_t threads, uint64_t* snapshot_bytes)
+{
+  const uint64_t pool_unit = 4096;
+  vector<uint8_t> buf;
+  bufferlist bl;
+  {
+    BenchAllocator<L1> a;
+    a._init(pool, pool_unit);
+    mt19937_64 rng(1);
+    a._mark_allocated(0, pool);
+    uint64_t pos = 0;
+    while (true) {
+      pos += pool_unit * (1 + rng() % 4096);
+      uint64_t len = pool_unit * (1 + rng() % 4096);
+      if (pos + len > pool) {
+	break;
+      }
+      a._mark_free(pos, len);
+      pos += len;
+    }
+    *snapshot_bytes = a.get_compressed_snapshot_size();
+    buf.resize(*snapshot_bytes);
+    bl.emplace_back(buf.data(), buf.size());
+    a.take_compressed_snapshot(bl);
+  }
+  BenchAllocator<L1> b;
+  b._set_apply_threads(threads);
+  b._init(pool, pool_unit);
+  auto t0 = chrono::steady_clock::now();
+  b.apply_compressed_snapshot(bl, 0);
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// restarts a pool fragmented by raw allocations and frees committed in
+// many transactions, returns TransactionRoot::restart() time
+static double run_restart(uint64_t pool, uint32_t pool_unit, size_t threads)
+{
+  using namespace PersistentObjects;
+  TransactionRoot* tr_ptr = TransactionRoot::create(pool);
+  TransactionRoot& tr = *tr_ptr;
+  tr.prepare(64 * 1024, 1024, 64 * 1024, pool, pool_unit);
+  tr.enable_parallel_restart(threads);
+  mt19937_64 rng(1);
+  vector<pair<uint64_t, size_t>> live;
+  for (size_t i = 0; i < 128; i++) {
+    tr.start_transaction();
+    for (size_t j = 0; j < 256; j++) {
+      size_t len = pool_unit * (1 + rng() % 16);
+      live.emplace_back(tr.alloc_persistent_raw(len), len);
+    }
+    for (size_t j = 0; j < 192; j++) {
+      size_t idx = rng() % live.size();
+      tr.free_persistent_raw(live[idx].first, live[idx].second);
+      live[idx] = live.back();
+      live.pop_back();
+    }
+    tr.commit_transaction();
+  }
+  tr.shutdown();
+  root->restart();
+  auto t0 = chrono::steady_clock::now();
+  tr.restart();
+  auto t1 = chrono::steady_clock::now();
+  TransactionRoot::destroy(tr_ptr);
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// single unit alloc/free and mark cycles at random positions, these are
+// bound by L1/L2 position math rather than bitmap scans
+template <class L1>
+static double run_geometry(size_t rounds)
+{
+  BenchAllocator<L1> a;
+  a._init(capacity, unit);
+  mt19937_64 rng(1);
+  auto t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; i++) {
+    interval_vector_t v;
+    uint64_t allocated = 0;
+    a._allocate_l2(unit, unit, unit, no_hint, &allocated, &v);
+    a._free_l2(v);
+    uint64_t pos = p2align<uint64_t>(rng() % capacity, unit);
+    a._mark_free(pos, unit);
+    a._mark_allocated(pos, unit);
+  }
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// L1 entry lookup math as done per marked or allocated position, with
+// the level geometry taken from virtuals as before devirtualization
+// and from compile time constants as now
+struct virtual_geometry_t
+{
+  virtual ~virtual_geometry_t() {}
+  virtual uint64_t _children_per_slot() const = 0;
+  virtual uint64_t _level_granularity() const = 0;
+};
+template <uint64_t ChildrenPerSlot>
+struct virtual_geometry_impl_t : public virtual_geometry_t
+{
+  uint64_t l1_granularity = unit * bits_per_slotset;
+  uint64_t _children_per_slot() const override {
+    return ChildrenPerSlot;
+  }
+  uint64_t _level_granularity() const override {
+    return l1_granularity;
+  }
+};
+
+static uint64_t geometry_math(uint64_t l0_pos, uint64_t children_per_slot,
+  uint64_t granularity)
+{
+  auto l1_pos = l0_pos / bits_per_slotset;
+  auto idx = l1_pos / children_per_slot;
+  auto shift = (l1_pos % children_per_slot) *
+    (bits_per_slot / children_per_slot);
+  auto l2_pos = l1_pos / (children_per_slot * slotset_width);
+  return idx + shift + l2_pos + l1_pos * granularity;
+}
+
+static double run_geometry_math(const vector<uint64_t>& positions,
+  const virtual_geometry_t& g, uint64_t* res)
+{
+  auto t0 = chrono::steady_clock::now();
+  for (auto pos : positions) {
+    *res ^= geometry_math(pos, g._children_per_slot(), g._level_granularity());
+  }
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+template <uint64_t ChildrenPerSlot>
+static double run_geometry_math(const vector<uint64_t>& positions,
+  const virtual_geometry_t& g, uint64_t* res)
+{
+  auto granularity = g._level_granularity();
+  auto t0 = chrono::steady_clock::now();
+  for (auto pos : positions) {
+    *res ^= geometry_math(pos, ChildrenPerSlot, granularity);
+  }
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// a single unit is freed at a random position of an otherwise full pool
+// and allocated back, hence scans run over half of L2 on average
+static double run_full_pool(uint64_t pool, size_t rounds, bool l3)
+{
+  BenchAllocator<AllocatorLevel01Loose> a;
+  a._init(pool, unit, false);
+  a._enable_l3(l3);
+  mt19937_64 rng(1);
+  auto t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; i++) {
+    a._mark_free(p2align<uint64_t>(rng() % pool, unit), unit);
+    interval_vector_t v;
+    uint64_t allocated = 0;
+    a._allocate_l2(unit, unit, unit, no_hint, &allocated, &v);
+    ceph_assert(allocated == unit);
+  }
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// marks random extents up to 'max_units' long as allocated and back free
+template <class L1>
+static double run_marking(size_t rounds, uint64_t max_units)
+{
+  BenchAllocator<L1> a;
+  a._init(capacity, unit);
+  mt19937_64 rng(1);
+  auto t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; i++) {
+    uint64_t len = unit * (1 + rng() % max_units);
+    uint64_t pos = p2align<uint64_t>(rng() % (capacity - len), unit);
+    a._mark_allocated(pos, len);
+    a._mark_free(pos, len);
+  }
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// a free unit in every 8th slotset of a large pool, requests for two
+// contiguous units can't be served hence walk L0 of all of them
+static double run_sparse_scan(uint64_t pool, size_t rounds, bool huge)
+{
+  bitmap_huge_pages = huge;
+  BenchAllocator<AllocatorLevel01Loose> a;
+  a._init(pool, unit, false);
+  bitmap_huge_pages = true;
+  for (uint64_t pos = 0; pos < pool; pos += unit * bits_per_slotset * 8) {
+    a._mark_free(pos, unit);
+  }
+  auto t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; i++) {
+    interval_vector_t v;
+    uint64_t allocated = 0;
+    a._allocate_l2(unit * 2, unit * 2, unit * 2, no_hint, &allocated, &v);
+    ceph_assert(allocated == 0);
+  }
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// random alloc/free mix keeping the pool about 75% full, requests are
+// mostly short with occasional long ones which may be fragmented
+template <class Policy>
+static void run_aging(const char* name, size_t ops)
+{
+  const uint64_t pool = 1ull << 30;
+  const uint64_t pool_unit = 4096;
+  BenchAllocator<AllocatorLevel01Loose, Policy> a;
+  a._init(pool, pool_unit);
+  mt19937_64 rng(1);
+  vector<interval_t> live;
+  vector<uint64_t> lat;
+  lat.reserve(ops);
+  uint64_t used = 0;
+  uint64_t fragments = 0, allocs = 0;
+  for (size_t i = 0; i < ops; i++) {
+    bool do_alloc = live.empty() ||
+      (used < pool * 3 / 4 && rng() % 100 < 55);
+    if (!do_alloc) {
+      size_t idx = rng() % live.size();
+      interval_vector_t v = { live[idx] };
+      used -= live[idx].length;
+      live[idx] = live.back();
+      live.pop_back();
+      a._free_l2(v);
+      continue;
+    }
+    uint64_t length = rng() % 16 ? pool_unit * (1 + rng() % 8) :
+      pool_unit * 8 * (2 + rng() % 30);
+    uint64_t min_length = std::min(length, pool_unit * 8);
+    interval_vector_t v;
+    uint64_t allocated = 0;
+    auto t0 = chrono::steady_clock::now();
+    a._allocate_l2(length, min_length, length, no_hint, &allocated, &v);
+    auto t1 = chrono::steady_clock::now();
+    lat.push_back(chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count());
+    ++allocs;
+    fragments += v.size();
+    used += allocated;
+    live.insert(live.end(), v.begin(), v.end());
+  }
+  std::map<size_t, size_t> bins;
+  a.collect_stats(bins);
+  size_t runs = 0;
+  size_t longest_bin = 0;
+  for (auto& b : bins) {
+    runs += b.second;
+    longest_bin = std::max(longest_bin, b.first);
+  }
+  sort(lat.begin(), lat.end());
+  cout << "  " << name << ": free runs " << runs
+       << ", longest < " << (pool_unit << (longest_bin + 1))
+       << ", partial slotsets " << a._get_fragmentation() * 100 << "%"
+       << ", fragments/alloc " << double(fragments) / allocs
+       << ", latency p50 " << lat[lat.size() / 2]
+       << " ns p99 " << lat[lat.size() * 99 / 100] << " ns" << std::endl;
+}
+
+static uint64_t total_length(const interval_vector_t& v)
+{
+  uint64_t res = 0;
+  for (auto& e : v) {
+    res += e.length;
+  }
+  return res;
+}
+
+int main(int argc, char** argv)
+{
+  size_t rounds = argc > 1 ? atoi(argv[1]) : 200;
+  const int detected = AllocatorLevel::simd_level;
+  const char* names[] = { "scalar", "avx2", "avx512" };
+
+  for (uint64_t length : { unit * 32, unit * 64, unit * 256 }) {
+    interval_vector_t ref;
+    AllocatorLevel::simd_level = AllocatorLevel::SIMD_NONE;
+    double ref_ms = run<AllocatorLevel01Loose>(rounds, length, length, &ref);
+    cout << "length " << length << " rounds " << rounds << std::endl;
+    cout << "  " << names[AllocatorLevel::SIMD_NONE] << ": "
+	 << ref_ms << " ms" << std::endl;
+    for (int level = AllocatorLevel::SIMD_AVX2; level <= detected; ++level) {
+      interval_vector_t res;
+      AllocatorLevel::simd_level = level;
+      double ms = run<AllocatorLevel01Loose>(rounds, length, length, &res);
+      bool match = res.size() == ref.size();
+      for (size_t i = 0; match && i < res.size(); i++) {
+	match = res[i].offset == ref[i].offset &&
+	  res[i].length == ref[i].length;
+      }
+      cout << "  " << names[level] << ": " << ms << " ms (x"
+	   << ref_ms / ms << ")" << (match ? "" : " MISMATCH") << std::endl;
+      if (!match) {
+	return 1;
+      }
+    }
+  }
+  AllocatorLevel::simd_level = detected;
+
+  // L1 flavors: single unit, fragmented and contiguous requests;
+  // placement differs hence just the amount allocated is checked
+  struct {
+    uint64_t length;
+    uint64_t min_length;
+    size_t rounds;
+  } cases[] = {
+    { unit, unit, rounds * 50 },
+    { unit * 64, unit, rounds * 50 },
+    { unit * 64, unit * 64, rounds },
+  };
+  cout << "L1 flavors (" << names[detected] << ")" << std::endl;
+  for (auto& c : cases) {
+    interval_vector_t loose, compact;
+    uint64_t loose_l1 = 0, compact_l1 = 0;
+    double loose_ms = run<AllocatorLevel01Loose>(c.rounds, c.length,
+      c.min_length, &loose, &loose_l1);
+    double compact_ms = run<AllocatorLevel01Compact>(c.rounds, c.length,
+      c.min_length, &compact, &compact_l1);
+    bool match = total_length(loose) == total_length(compact);
+    cout << "  length " << c.length << " min " << c.min_length
+	 << " rounds " << c.rounds << std::endl;
+    cout << "    loose: " << loose_ms << " ms, L1 "
+	 << loose_l1 << " bytes" << std::endl;
+    cout << "    compact: " << compact_ms << " ms (x"
+	 << loose_ms / compact_ms << "), L1 " << compact_l1 << " bytes"
+	 << (match ? "" : " MISMATCH") << std::endl;
+    if (!match) {
+      return 1;
+    }
+  }
+
+  // fragment() leaves runs up to 12 units long, hence longer requests
+  // fall back to misfits and shorter ones skip the rest of the scan
+  cout << "run cache (" << names[detected] << ")" << std::endl;
+  for (auto& c : cases) {
+    interval_vector_t ref[2], res[2];
+    double ref_ms[2], ms[2];
+    ref_ms[0] = run<AllocatorLevel01Loose>(c.rounds, c.length,
+      c.min_length, &ref[0]);
+    ms[0] = run<AllocatorLevel01Loose>(c.rounds, c.length,
+      c.min_length, &res[0], nullptr, true);
+    ref_ms[1] = run<AllocatorLevel01Compact>(c.rounds, c.length,
+      c.min_length, &ref[1]);
+    ms[1] = run<AllocatorLevel01Compact>(c.rounds, c.length,
+      c.min_length, &res[1], nullptr, true);
+    cout << "  length " << c.length << " min " << c.min_length
+	 << " rounds " << c.rounds << std::endl;
+    for (size_t f = 0; f < 2; f++) {
+      bool match = res[f].size() == ref[f].size();
+      for (size_t i = 0; match && i < res[f].size(); i++) {
+	match = res[f][i].offset == ref[f][i].offset &&
+	  res[f][i].length == ref[f][i].length;
+      }
+      cout << "    " << (f ? "compact: " : "loose: ") << ref_ms[f]
+	   << " ms, cached: " << ms[f] << " ms (x" << ref_ms[f] / ms[f] << ")"
+	   << (match ? "" : " MISMATCH") << std::endl;
+      if (!match) {
+	return 1;
+      }
+    }
+  }
+
+  cout << "geometry bound paths, " << rounds * 5000 << " cycles"
+       << std::endl;
+  cout << "  loose: " << run_geometry<AllocatorLevel01Loose>(rounds * 5000)
+       << " ms" << std::endl;
+  cout << "  compact: " << run_geometry<AllocatorLevel01Compact>(rounds * 5000)
+       << " ms" << std::endl;
+
+  {
+    // loose and compact L1 widths
+    virtual_geometry_impl_t<bits_per_slot / 2> loose;
+    virtual_geometry_impl_t<bits_per_slot> compact;
+    // keeps the compiler from binding the virtuals at the call site
+    vector<virtual_geometry_t*> flavors = { &loose, &compact };
+    vector<uint64_t> positions(rounds * 50000);
+    mt19937_64 rng(1);
+    for (auto& p : positions) {
+      p = rng() % (capacity / unit);
+    }
+    cout << "geometry math, " << positions.size() << " positions"
+	 << std::endl;
+    for (size_t f = 0; f < flavors.size(); f++) {
+      uint64_t r0 = 0, r1 = 0;
+      double virtual_ms = run_geometry_math(positions, *flavors[f], &r0);
+      double ms = f ?
+	run_geometry_math<bits_per_slot>(positions, *flavors[f], &r1) :
+	run_geometry_math<bits_per_slot / 2>(positions, *flavors[f], &r1);
+      cout << "  " << (f ? "compact" : "loose") << ": virtual "
+	   << virtual_ms << " ms, constexpr " << ms << " ms (x"
+	   << virtual_ms / ms << ")" << (r0 == r1 ? "" : " MISMATCH")
+	   << std::endl;
+      if (r0 != r1) {
+	return 1;
+      }
+    }
+  }
+
+  cout << "range marking, " << rounds * 500 << " extents" << std::endl;
+  for (uint64_t units : { 64, 4096 }) {
+    cout << "  up to " << units << " units: loose "
+	 << run_marking<AllocatorLevel01Loose>(rounds * 500, units)
+	 << " ms, compact "
+	 << run_marking<AllocatorLevel01Compact>(rounds * 500, units)
+	 << " ms" << std::endl;
+  }
+
+  cout << "full pool, " << unit << " B unit, " << rounds * 500
+       << " single unit allocs" << std::endl;
+  for (uint64_t gib : { 1, 32 }) {
+    double ms = run_full_pool(gib << 30, rounds * 500, false);
+    double l3_ms = run_full_pool(gib << 30, rounds * 500, true);
+    cout << "  " << gib << " GiB: " << ms << " ms, L3: " << l3_ms
+	 << " ms (x" << ms / l3_ms << ")" << std::endl;
+  }
+
+  cout << "sparse pool scans, " << unit << " B unit, " << rounds / 4
+       << " requests" << std::endl;
+  for (uint64_t gib : { 1, 16 }) {
+    double ms = run_sparse_scan(gib << 30, rounds / 4, false);
+    double huge_ms = run_sparse_scan(gib << 30, rounds / 4, true);
+    cout << "  " << gib << " GiB: " << ms << " ms, huge pages: " << huge_ms
+	 << " ms (x" << ms / huge_ms << ")" << std::endl;
+  }
+
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  cout << "snapshot apply, 4K unit, " << threads << " threads" << std::endl;
+  for (uint64_t gib : { 1, 64, 512 }) {
+    uint64_t snapshot_bytes = 0;
+    double single_ms = run_apply<AllocatorLevel01Loose>(gib << 30, 1,
+      &snapshot_bytes);
+    double parallel_ms = run_apply<AllocatorLevel01Loose>(gib << 30, threads,
+      &snapshot_bytes);
+    cout << "  " << gib << " GiB, snapshot " << snapshot_bytes
+	 << " bytes: " << single_ms << " ms, parallel: " << parallel_ms
+	 << " ms (x" << single_ms / parallel_ms << ")" << std::endl;
+  }
+
+  // the same unit as snapshot apply above, L0 of a 512 GiB pool would
+  // take 4 GiB at the minimal object size
+  cout << "pool restart, 4K unit, " << threads << " threads" << std::endl;
+  PersistentObjects::root->init();
+  for (uint64_t gib : { 1, 64, 512 }) {
+    double single_ms = run_restart(gib << 30, 4096, 1);
+    double parallel_ms = run_restart(gib << 30, 4096, threads);
+    cout << "  " << gib << " GiB: " << single_ms << " ms, parallel: "
+	 << parallel_ms << " ms (x" << single_ms / parallel_ms << ")"
+	 << std::endl;
+  }
+
+  size_t ops = rounds * 1000;
+  cout << "placement policies, aged with " << ops << " ops" << std::endl;
+  run_aging<placement_default>("default", ops);
+  run_aging<placement_next_fit>("next fit", ops);
+  run_aging<placement_first_fit>("first fit", ops);
+  run_aging<placement_best_fit>("best fit", ops);
+  return 0;
+}
@@ -8,12 +8,356 @@
 
 #include "fastbmap_allocator_impl.h"
 
-uint64_t AllocatorLevel::l0_dives = 0;
-uint64_t AllocatorLevel::l0_iterations = 0;
-uint64_t AllocatorLevel::l0_inner_iterations = 0;
-uint64_t AllocatorLevel::alloc_fragments = 0;
-uint64_t AllocatorLevel::alloc_fragments_fast = 0;
-uint64_t AllocatorLevel::l2_allocs = 0;
+#include <condition_variable>
+#include <cstdlib>
+#include <new>
+#include <unordered_map>
+#include <sys/mman.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FASTBMAP_X86_SIMD
+#include <immintrin.h>
+#endif
+
+std::atomic<uint64_t> AllocatorLevel::last_counters_id = { 0 };
+
+std::atomic<bool> bitmap_huge_pages = { true };
+
+void* bitmap_alloc(size_t bytes)
+{
+  if (bytes < BITMAP_HUGE_PAGE) {
+    void* p = aligned_alloc(BITMAP_ALIGN, p2roundup<size_t>(bytes, BITMAP_ALIGN));
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+  size_t len = p2roundup<size_t>(bytes, BITMAP_HUGE_PAGE);
+  bool huge = bitmap_huge_pages;
+  // bitmaps are reserved for the max pool size upfront (see _reserve),
+  // hence no MAP_HUGETLB which would pin huge pages for all of it.
+  // Transparent ones are populated on first touch only. Map a huge
+  // page more than needed and trim it to have the mapping aligned.
+  auto p = (uint8_t*)mmap(nullptr, len + BITMAP_HUGE_PAGE,
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+    -1, 0);
+  if (p == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  auto res = (uint8_t*)p2roundup<uintptr_t>((uintptr_t)p, BITMAP_HUGE_PAGE);
+  if (res != p) {
+    munmap(p, res - p);
+  }
+  munmap(res + len, p + BITMAP_HUGE_PAGE - res);
+#ifdef MADV_HUGEPAGE
+  madvise(res, len, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+  return res;
+}
+
+void bitmap_free(void* p, size_t bytes)
+{
+  if (bytes < BITMAP_HUGE_PAGE) {
+    free(p);
+    return;
+  }
+  munmap(p, p2roundup<size_t>(bytes, BITMAP_HUGE_PAGE));
+}
+
+namespace {
+class worker_pool_t
+{
+  std::mutex run_lock; // serializes callers
+  std::mutex lock; // protects the members below
+  std::condition_variable cond;
+  std::condition_variable done_cond;
+  std::vector<std::thread> workers;
+  const std::function<void()>* job = nullptr;
+  uint64_t job_seq = 0;
+  size_t wanted = 0; // workers yet to pick the current job
+  size_t running = 0;
+  bool stop = false;
+
+  void entry()
+  {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> l(lock);
+    while (true) {
+      // every worker picks a job once at most
+      cond.wait(l, [&]() {
+	return stop || (wanted && seen != job_seq);
+      });
+      if (stop) {
+	return;
+      }
+      seen = job_seq;
+      --wanted;
+      ++running;
+      auto fn = job;
+      l.unlock();
+      (*fn)();
+      l.lock();
+      if (--running == 0 && wanted == 0) {
+	done_cond.notify_all();
+      }
+    }
+  }
+public:
+  ~worker_pool_t()
+  {
+    {
+      std::lock_guard<std::mutex> l(lock);
+      stop = true;
+    }
+    cond.notify_all();
+    for (auto& t : workers) {
+      t.join();
+    }
+  }
+  void run(size_t threads, const std::function<void()>& fn)
+  {
+    std::lock_guard<std::mutex> r(run_lock);
+    std::unique_lock<std::mutex> l(lock);
+    while (workers.size() < threads - 1) {
+      workers.emplace_back([this]() { entry(); });
+    }
+    job = &fn;
+    ++job_seq;
+    wanted = threads - 1;
+    cond.notify_all();
+    l.unlock();
+    fn();
+    l.lock();
+    done_cond.wait(l, [&]() {
+      return wanted == 0 && running == 0;
+    });
+    job = nullptr;
+  }
+};
+}
+
+void run_on_workers(size_t threads, const std::function<void()>& fn)
+{
+  static worker_pool_t pool;
+  pool.run(threads, fn);
+}
+
+AllocatorLevel::thread_counters_t::thread_counters_t()
+{
+  for (auto& c : v) {
+    c.store(0, std::memory_order_relaxed);
+  }
+}
+
+AllocatorLevel::thread_counters_t& AllocatorLevel::_lookup_thread_counters()
+{
+  // entries of destroyed levels are left behind, they are never hit
+  static thread_local std::unordered_map<uint64_t, thread_counters_t*> known;
+  auto& c = known[counters_id];
+  if (!c) {
+    std::unique_ptr<thread_counters_t> n(new thread_counters_t);
+    c = n.get();
+    std::lock_guard<std::mutex> l(counters_lock);
+    counters.emplace_back(std::move(n));
+  }
+  return *c;
+}
+
+void AllocatorLevel::add_counters(stats_t* res) const
+{
+  std::lock_guard<std::mutex> l(counters_lock);
+  for (auto& t : counters) {
+    for (size_t i = 0; i < CNT_MAX; ++i) {
+      res->counters[i] += t->v[i].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+uint64_t AllocatorLevel::stats_t::get_calls(size_t latency_cnt) const
+{
+  uint64_t res = 0;
+  for (size_t i = 0; i < 64; ++i) {
+    res += counters[latency_cnt + i];
+  }
+  return res;
+}
+
+uint64_t AllocatorLevel::stats_t::get_percentile(size_t latency_cnt,
+  double q) const
+{
+  auto calls = get_calls(latency_cnt);
+  if (!calls) {
+    return 0;
+  }
+  // bin i keeps [2^i, 2^(i+1)) nanoseconds, bin 0 takes zeros as well
+  double need = q * calls;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < 64; ++i) {
+    auto n = counters[latency_cnt + i];
+    if (n && seen + n >= need) {
+      uint64_t lo = i ? uint64_t(1) << i : 0;
+      uint64_t hi = (uint64_t(1) << i) * 2 - 1;
+      return lo + uint64_t((hi - lo) * std::max(0.0, need - seen) / n);
+    }
+    seen += n;
+  }
+  return 0;
+}
+
+int AllocatorLevel::detect_simd_level()
+{
+#ifdef FASTBMAP_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SIMD_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  }
+#endif
+  return SIMD_NONE;
+}
+int AllocatorLevel::simd_level = AllocatorLevel::detect_simd_level();
+
+// low bit of every 2-bit l1 entry
+static const slot_t l1_entry_lo_bits = all_slot_set / 3;
+
+enum {
+  SLOTSET_MIXED,
+  SLOTSET_FREE,
+  SLOTSET_FULL,
+};
+
+// Classifies a slotset (slotset_width l0 slots) as totally free,
+// totally allocated or mixed.
+static inline int _classify_slotset_generic(const slot_t* p)
+{
+  slot_t a = all_slot_set;
+  slot_t o = all_slot_clear;
+  for (size_t i = 0; i < slotset_width; i++) {
+    a &= p[i];
+    o |= p[i];
+  }
+  return a == all_slot_set ? SLOTSET_FREE :
+    o == all_slot_clear ? SLOTSET_FULL : SLOTSET_MIXED;
+}
+
+// Builds per-slot masks of FREE and PARTIAL l1 entries (low bit of each
+// entry is set), returns false if all the entries are FULL.
+static inline bool _classify_l1_generic(const slot_t* p, size_t n,
+  slot_t* free_m, slot_t* partial_m)
+{
+  slot_t any = all_slot_clear;
+  for (size_t i = 0; i < n; i++) {
+    slot_t v = p[i];
+    free_m[i] = v & (v >> 1) & l1_entry_lo_bits;
+    partial_m[i] = v & ~(v >> 1) & l1_entry_lo_bits;
+    any |= v;
+  }
+  return any != all_slot_clear;
+}
+
+#ifdef FASTBMAP_X86_SIMD
+static_assert(slotset_width == 8, "SIMD kernels assume 512-bit slotsets");
+
+__attribute__((target("avx2")))
+static int _classify_slotset_avx2(const slot_t* p)
+{
+  __m256i a = _mm256_loadu_si256((const __m256i*)p);
+  __m256i b = _mm256_loadu_si256((const __m256i*)(p + 4));
+  __m256i and_v = _mm256_and_si256(a, b);
+  __m256i or_v = _mm256_or_si256(a, b);
+  if (_mm256_testc_si256(and_v, _mm256_set1_epi64x(-1))) {
+    return SLOTSET_FREE;
+  }
+  if (_mm256_testz_si256(or_v, or_v)) {
+    return SLOTSET_FULL;
+  }
+  return SLOTSET_MIXED;
+}
+
+__attribute__((target("avx2")))
+static bool _classify_l1_avx2(const slot_t* p, size_t n,
+  slot_t* free_m, slot_t* partial_m)
+{
+  const __m256i lo_bits = _mm256_set1_epi64x(l1_entry_lo_bits);
+  __m256i any = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+    __m256i hi = _mm256_srli_epi64(v, 1);
+    _mm256_storeu_si256((__m256i*)(free_m + i),
+      _mm256_and_si256(_mm256_and_si256(v, hi), lo_bits));
+    _mm256_storeu_si256((__m256i*)(partial_m + i),
+      _mm256_and_si256(_mm256_andnot_si256(hi, v), lo_bits));
+    any = _mm256_or_si256(any, v);
+  }
+  bool res = !_mm256_testz_si256(any, any);
+  return _classify_l1_generic(p + i, n - i, free_m + i, partial_m + i) || res;
+}
+
+__attribute__((target("avx512f")))
+static int _classify_slotset_avx512(const slot_t* p)
+{
+  __m512i v = _mm512_loadu_si512((const void*)p);
+  if (_mm512_cmpneq_epi64_mask(v, _mm512_set1_epi64(-1)) == 0) {
+    return SLOTSET_FREE;
+  }
+  if (_mm512_test_epi64_mask(v, v) == 0) {
+    return SLOTSET_FULL;
+  }
+  return SLOTSET_MIXED;
+}
+
+__attribute__((target("avx512f")))
+static bool _classify_l1_avx512(const slot_t* p, size_t n,
+  slot_t* free_m, slot_t* partial_m)
+{
+  const __m512i lo_bits = _mm512_set1_epi64(l1_entry_lo_bits);
+  __mmask8 any = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i v = _mm512_loadu_si512((const void*)(p + i));
+    // maskz forms avoid gcc's bogus uninitialized warnings on the
+    // unmasked intrinsics
+    __m512i hi = _mm512_maskz_srli_epi64(0xff, v, 1);
+    _mm512_storeu_si512((void*)(free_m + i),
+      _mm512_and_si512(_mm512_and_si512(v, hi), lo_bits));
+    _mm512_storeu_si512((void*)(partial_m + i),
+      _mm512_and_si512(_mm512_maskz_andnot_epi64(0xff, hi, v), lo_bits));
+    any |= _mm512_test_epi64_mask(v, v);
+  }
+  return _classify_l1_generic(p + i, n - i, free_m + i, partial_m + i) ||
+    any != 0;
+}
+#endif
+
+static inline int _classify_slotset(const slot_t* p)
+{
+#ifdef FASTBMAP_X86_SIMD
+  switch (AllocatorLevel::simd_level) {
+  case AllocatorLevel::SIMD_AVX512:
+    return _classify_slotset_avx512(p);
+  case AllocatorLevel::SIMD_AVX2:
+    return _classify_slotset_avx2(p);
+  }
+#endif
+  return _classify_slotset_generic(p);
+}
+
+static inline bool _classify_l1(const slot_t* p, size_t n,
+  slot_t* free_m, slot_t* partial_m)
+{
+#ifdef FASTBMAP_X86_SIMD
+  switch (AllocatorLevel::simd_level) {
+  case AllocatorLevel::SIMD_AVX512:
+    return _classify_l1_avx512(p, n, free_m, partial_m);
+  case AllocatorLevel::SIMD_AVX2:
+    return _classify_l1_avx2(p, n, free_m, partial_m);
+  }
+#endif
+  return _classify_l1_generic(p, n, free_m, partial_m);
+}
 
 inline interval_t _align2units(uint64_t offset, uint64_t len, uint64_t min_length)
 {
@@ -35,9 +379,12 @@ inline interval_t _align2units(uint64_t offset, uint64_t len, uint64_t min_lengt
   return interval_t();
 }
 
-interval_t AllocatorLevel01Loose::_get_longest_from_l0(uint64_t pos0,
+interval_t AllocatorLevel01::_get_longest_from_l0(uint64_t pos0,
   uint64_t pos1, uint64_t min_length, interval_t* tail) const
 {
+  if (simd_level != SIMD_NONE) {
+    return _get_longest_from_l0_simd(pos0, pos1, min_length, tail);
+  }
   interval_t res;
   if (pos0 >= pos1) {
     return res;
@@ -128,10 +475,51 @@ interval_t AllocatorLevel01Loose::_get_longest_from_l0(uint64_t pos0,
   return res;
 }
 
+void AllocatorLevel01::_calc_runs(uint64_t l1_pos)
+{
+  uint64_t head = 0, longest = 0, run = 0;
+  bool in_head = true;
+  for (auto idx = l1_pos * slotset_width; idx < (l1_pos + 1) * slotset_width;
+    ++idx) {
+    slot_t v = l0[idx];
+    if (v == all_slot_set) {
+      run += bits_per_slot;
+      continue;
+    }
+    // walk the slot run by run, set bits shifted out leave zeros at the top
+    unsigned pos = 0;
+    while (pos < bits_per_slot) {
+      unsigned ones = __builtin_ctzll(~(v >> pos));
+      run += ones;
+      pos += ones;
+      if (pos >= bits_per_slot) {
+	break;
+      }
+      if (in_head) {
+	head = run;
+	in_head = false;
+      }
+      longest = std::max(longest, run);
+      run = 0;
+      slot_t rest = v >> pos;
+      pos += rest ? __builtin_ctzll(rest) : bits_per_slot - pos;
+    }
+  }
+  longest = std::max(longest, run);
+  auto& r = run_cache[l1_pos];
+  r.head = in_head ? run : head;
+  r.tail = run;
+  r.longest = longest;
+}
+
 void AllocatorLevel01Loose::_analyze_partials(uint64_t pos_start,
   uint64_t pos_end, uint64_t length, uint64_t min_length, int mode,
   search_ctx_t* ctx)
 {
+  if (simd_level != SIMD_NONE) {
+    _analyze_partials_simd(pos_start, pos_end, length, min_length, mode, ctx);
+    return;
+  }
   auto d = CHILD_PER_SLOT;
   ceph_assert((pos_start % d) == 0);
   ceph_assert((pos_end % d) == 0);
@@ -170,6 +558,11 @@ void AllocatorLevel01Loose::_analyze_partials(uint64_t pos_start,
         if (mode == STOP_ON_EMPTY) {
           return;
         }
+        if (mode == STOP_ON_FIT &&
+	    _align2units(ctx->free_l1_pos * l1_granularity,
+	      ctx->free_count * l1_granularity, min_length).length >= length) {
+          return;
+        }
         break;
       case L1_ENTRY_FULL:
         prev_tail = empty_tail;
@@ -177,6 +570,10 @@ void AllocatorLevel01Loose::_analyze_partials(uint64_t pos_start,
       case L1_ENTRY_PARTIAL:
 	interval_t longest;
         ++ctx->partial_count;
+        if (_has_run_cache() && mode != STOP_ON_PARTIAL &&
+	    _skip_partial(l1_pos, length, min_length, *ctx, &prev_tail)) {
+          break;
+        }
 
         longest = _get_longest_from_l0(l1_pos * l0_w, (l1_pos + 1) * l0_w, min_length, &prev_tail);
 
@@ -197,7 +594,8 @@ void AllocatorLevel01Loose::_analyze_partials(uint64_t pos_start,
 //          ctx->min_affordable_len = p2align<uint64_t>(longest.length, min_length);
 	  ctx->min_affordable_offs = longest.offset;
         }
-        if (mode == STOP_ON_PARTIAL) {
+        if (mode == STOP_ON_PARTIAL ||
+	    (mode == STOP_ON_FIT && ctx->affordable_len)) {
           return;
         }
         break;
@@ -209,7 +607,194 @@ void AllocatorLevel01Loose::_analyze_partials(uint64_t pos_start,
   ctx->fully_processed = true;
 }
 
-void AllocatorLevel01Loose::_mark_l1_on_l0(int64_t l0_pos, int64_t l0_pos_end)
+// Same as _get_longest_from_l0 but skips totally free/allocated slotsets
+// with a single vector compare and walks mixed slots run by run
+// (ctz) rather than bit by bit.
+interval_t AllocatorLevel01::_get_longest_from_l0_simd(uint64_t pos0,
+  uint64_t pos1, uint64_t min_length, interval_t* tail) const
+{
+  interval_t res;
+  if (pos0 >= pos1) {
+    return res;
+  }
+  interval_t res_candidate;
+  if (tail->length != 0) {
+    ceph_assert((tail->offset % l0_granularity) == 0);
+    ceph_assert((tail->length % l0_granularity) == 0);
+    res_candidate.offset = tail->offset / l0_granularity;
+    res_candidate.length = tail->length / l0_granularity;
+  }
+  *tail = interval_t();
+
+  auto d = bits_per_slot;
+  auto min_granules = min_length / l0_granularity;
+  auto close_candidate = [&](uint64_t end) {
+    if (res_candidate.length) {
+      if (end == pos1) {
+	*tail = res_candidate;
+      }
+      res_candidate = _align2units(res_candidate.offset,
+	res_candidate.length, min_granules);
+      if (res.length < res_candidate.length) {
+	res = res_candidate;
+      }
+      res_candidate = interval_t();
+    }
+  };
+
+  auto pos = pos0;
+  while (pos < pos1) {
+    if ((pos % bits_per_slotset) == 0 && pos1 - pos >= bits_per_slotset) {
+      switch (_classify_slotset(&l0[pos / d])) {
+      case SLOTSET_FREE:
+	if (!res_candidate.length) {
+	  res_candidate.offset = pos;
+	}
+	res_candidate.length += bits_per_slotset;
+	pos += bits_per_slotset;
+	continue;
+      case SLOTSET_FULL:
+	close_candidate(pos);
+	pos += bits_per_slotset;
+	continue;
+      }
+    }
+    uint64_t base = pos - (pos % d);
+    uint64_t b = pos % d;
+    uint64_t b_end = std::min(d, b + (pos1 - pos));
+    slot_t bits = l0[pos / d];
+    while (b < b_end) {
+      slot_t rest = bits >> b;
+      uint64_t run;
+      if (rest & 1) {
+	// free run starting at b
+	run = ~rest ? __builtin_ctzll(~rest) : d;
+	run = std::min(run, b_end - b);
+	if (!res_candidate.length) {
+	  res_candidate.offset = base + b;
+	}
+	res_candidate.length += run;
+      } else {
+	close_candidate(base + b);
+	run = rest ? __builtin_ctzll(rest) : d;
+	run = std::min(run, b_end - b);
+      }
+      b += run;
+    }
+    pos = base + b_end;
+  }
+  close_candidate(pos1);
+
+  res.offset *= l0_granularity;
+  res.length *= l0_granularity;
+  tail->offset *= l0_granularity;
+  tail->length *= l0_granularity;
+  return res;
+}
+
+// Same as _analyze_partials but classifies l1 entries a batch of slots
+// at a time and visits non-FULL entries only.
+void AllocatorLevel01Loose::_analyze_partials_simd(uint64_t pos_start,
+  uint64_t pos_end, uint64_t length, uint64_t min_length, int mode,
+  search_ctx_t* ctx)
+{
+  auto d = CHILD_PER_SLOT;
+  ceph_assert((pos_start % d) == 0);
+  ceph_assert((pos_end % d) == 0);
+
+  uint64_t l0_w = slotset_width * CHILD_PER_SLOT_L0;
+
+  const interval_t empty_tail;
+  interval_t prev_tail;
+
+  uint64_t next_free_l1_pos = 0;
+  // position following the last visited entry, any gap means
+  // FULL entries in between
+  uint64_t expected_l1_pos = pos_start;
+
+  const size_t batch = 8;
+  slot_t free_m[batch];
+  slot_t partial_m[batch];
+  for (auto pos = pos_start / d; pos < pos_end / d; pos += batch) {
+    size_t n = std::min<uint64_t>(batch, pos_end / d - pos);
+    if (!_classify_l1(&l1[pos], n, free_m, partial_m)) {
+      continue;
+    }
+    for (size_t i = 0; i < n; i++) {
+      slot_t m = free_m[i] | partial_m[i];
+      while (m) {
+	auto bit = __builtin_ctzll(m);
+	m &= m - 1;
+	uint64_t l1_pos = (pos + i) * d + bit / L1_ENTRY_WIDTH;
+	if (l1_pos != expected_l1_pos) {
+	  prev_tail = empty_tail;
+	}
+	expected_l1_pos = l1_pos + 1;
+
+	if (free_m[i] & (slot_t(1) << bit)) {
+	  prev_tail = empty_tail;
+	  if (!ctx->free_count) {
+	    ctx->free_l1_pos = l1_pos;
+	  } else if (l1_pos != next_free_l1_pos) {
+	    auto o = ctx->free_l1_pos * l1_granularity;
+	    auto l = ctx->free_count * l1_granularity;
+	    // check if already found extent fits min_length after alignment
+	    if (_align2units(o, l, min_length).length >= min_length) {
+	      continue;
+	    }
+	    // if not - proceed with the next one
+	    ctx->free_l1_pos = l1_pos;
+	    ctx->free_count = 0;
+	  }
+	  next_free_l1_pos = l1_pos + 1;
+	  ++ctx->free_count;
+	  if (mode == STOP_ON_EMPTY) {
+	    return;
+	  }
+	  if (mode == STOP_ON_FIT &&
+	      _align2units(ctx->free_l1_pos * l1_granularity,
+		ctx->free_count * l1_granularity, min_length).length >= length) {
+	    return;
+	  }
+	  continue;
+	}
+
+	++ctx->partial_count;
+	if (_has_run_cache() && mode != STOP_ON_PARTIAL &&
+	    _skip_partial(l1_pos, length, min_length, *ctx, &prev_tail)) {
+	  continue;
+	}
+	interval_t longest = _get_longest_from_l0_simd(l1_pos * l0_w,
+	  (l1_pos + 1) * l0_w, min_length, &prev_tail);
+
+	if (longest.length >= length) {
+	  if ((ctx->affordable_len == 0) ||
+	      ((ctx->affordable_len != 0) &&
+		(longest.length < ctx->affordable_len))) {
+	    ctx->affordable_len = longest.length;
+	    ctx->affordable_offs = longest.offset;
+	  }
+	}
+	if (longest.length >= min_length &&
+	    (ctx->min_affordable_len == 0 ||
+	      (longest.length < ctx->min_affordable_len))) {
+
+	  auto delta = longest.length % min_length;
+	  ctx->min_affordable_len = longest.length - delta;
+	  ctx->min_affordable_offs = longest.offset;
+	}
+	if (mode == STOP_ON_PARTIAL ||
+	    (mode == STOP_ON_FIT && ctx->affordable_len)) {
+	  return;
+	}
+      }
+    }
+  }
+  ctx->fully_processed = true;
+}
+
+void AllocatorLevel01Loose::_mark_l1_on_l0(int64_t l0_pos, int64_t l0_pos_end,
+  size_t* unalloc_count, size_t* partial_count)
 {
   if (l0_pos == l0_pos_end) {
     return;
@@ -262,20 +847,20 @@ void AllocatorLevel01Loose::_mark_l1_on_l0(int64_t l0_pos, int64_t l0_pos_end)
       slot_t old_mask = (slot_val & mask) >> shift;
       switch(old_mask) {
       case L1_ENTRY_FREE:
-	unalloc_l1_count--;
+	(*unalloc_count)--;
 	break;
       case L1_ENTRY_PARTIAL:
-	partial_l1_count--;
+	(*partial_count)--;
 	break;
       }
       slot_val &= ~mask;
       slot_val |= slot_t(mask_to_apply) << shift;
       switch(mask_to_apply) {
       case L1_ENTRY_FREE:
-	unalloc_l1_count++;
+	(*unalloc_count)++;
 	break;
       case L1_ENTRY_PARTIAL:
-	partial_l1_count++;
+	(*partial_count)++;
 	break;
       }
       mask_to_apply = L1_ENTRY_NOT_USED;
@@ -284,36 +869,18 @@ void AllocatorLevel01Loose::_mark_l1_on_l0(int64_t l0_pos, int64_t l0_pos_end)
   }
 }
 
-void AllocatorLevel01Loose::_mark_alloc_l0(int64_t l0_pos_start,
+void AllocatorLevel01::_mark_alloc_l0(int64_t l0_pos_start,
   int64_t l0_pos_end)
 {
-  auto d0 = CHILD_PER_SLOT_L0;
-
-  int64_t pos = l0_pos_start;
-  slot_t bits = (slot_t)1 << (l0_pos_start % d0);
-  slot_t* val_s = &l0[pos / d0];
-  int64_t round_val = p2roundup<int64_t>(l0_pos_start + 1, d0);
-  int64_t pos_e = std::min(l0_pos_end, round_val);
-  while (pos < pos_e) {
-    (*val_s) &= ~bits;
-    bits <<= 1;
-    pos++;
-  }
-  int64_t align_val = p2align<int64_t>(l0_pos_end, d0);
-  pos_e = std::min(l0_pos_end, align_val);
-  while (pos < pos_e) {
-    *(++val_s) = all_slot_clear;
-    pos += d0;
-  }
-  bits = 1;
-  ++val_s;
-  while (pos < l0_pos_end) {
-    (*val_s) &= ~bits;
-    bits <<= 1;
-    pos++;
+  _mark_dirty_l0(l0_pos_start, l0_pos_end);
+  _invalidate_runs(l0_pos_start, l0_pos_end);
+  if (free_index) {
+    _index_mark_alloc(l0_pos_start, l0_pos_end);
   }
+  clear_bit_range(l0.data(), l0_pos_start, l0_pos_end);
 }
 
+template <int Fit>
 interval_t AllocatorLevel01Loose::_allocate_l1_contiguous(uint64_t length,
   uint64_t min_length, uint64_t max_length,
   uint64_t pos_start, uint64_t pos_end)
@@ -321,7 +888,25 @@ interval_t AllocatorLevel01Loose::_allocate_l1_contiguous(uint64_t length,
   interval_t res = { 0, 0 };
   uint64_t l0_w = slotset_width * CHILD_PER_SLOT_L0;
 
-  if (unlikely(length <= l0_granularity)) {
+  if constexpr (Fit == FIT_NEXT) {
+    // first fit over the range rotated to start at the previous allocation
+    auto start = next_fit_pos > pos_start && next_fit_pos < pos_end ?
+      next_fit_pos : pos_start;
+    res = _allocate_l1_contiguous<FIT_FIRST>(length, min_length, max_length,
+      start, pos_end);
+    if (!res.length && start != pos_start) {
+      res = _allocate_l1_contiguous<FIT_FIRST>(length, min_length, max_length,
+	pos_start, start);
+    }
+    if (res.length) {
+      next_fit_pos = p2align<uint64_t>(res.offset / l1_granularity,
+	CHILD_PER_SLOT);
+    }
+    return res;
+  }
+  // first and best fit policies take the generic path below regardless
+  // of the length, the former stopping at the first matching entry
+  if (Fit == FIT_DEFAULT && unlikely(length <= l0_granularity)) {
     search_ctx_t ctx;
     _analyze_partials(pos_start, pos_end, l0_granularity, l0_granularity,
       STOP_ON_PARTIAL, &ctx);
@@ -347,7 +932,7 @@ interval_t AllocatorLevel01Loose::_allocate_l1_contiguous(uint64_t length,
       res = interval_t(ctx.free_l1_pos * l1_granularity, l);
       return res;
     }
-  } else if (unlikely(length == l1_granularity)) {
+  } else if (Fit == FIT_DEFAULT && unlikely(length == l1_granularity)) {
     search_ctx_t ctx;
     _analyze_partials(pos_start, pos_end, length, min_length, STOP_ON_EMPTY, &ctx);
 
@@ -385,9 +970,21 @@ interval_t AllocatorLevel01Loose::_allocate_l1_contiguous(uint64_t length,
       return interval_t(ctx.min_affordable_offs, ctx.min_affordable_len);
     }
   } else {
+    if constexpr (Fit == FIT_BEST) {
+      // the analysis below picks the slotset with the shortest longest
+      // run, look at every run instead and fall back to that for misfits
+      auto e = _get_tightest_run(pos_start, pos_end, length, min_length);
+      if (e.length) {
+	ceph_assert((length % l0_granularity) == 0);
+	auto pos = e.offset / l0_granularity;
+	_mark_alloc_l1_l0(pos, pos + length / l0_granularity);
+	return interval_t(e.offset, length);
+      }
+    }
     search_ctx_t ctx;
-    _analyze_partials(pos_start, pos_end, length, min_length, NO_STOP, &ctx);
-    ceph_assert(ctx.fully_processed);
+    int mode = Fit == FIT_FIRST ? STOP_ON_FIT : NO_STOP;
+    _analyze_partials(pos_start, pos_end, length, min_length, mode, &ctx);
+    ceph_assert(ctx.fully_processed || mode == STOP_ON_FIT);
     // check partially free slot sets first (including neighboring),
     // full length match required.
     if (ctx.affordable_len) {
@@ -428,6 +1025,78 @@ interval_t AllocatorLevel01Loose::_allocate_l1_contiguous(uint64_t length,
   return res;
 }
 
+template <int Fit>
+interval_t AllocatorLevel01Loose::_allocate_l1_extent(uint64_t length,
+  uint64_t l1_pos_start, uint64_t l1_pos_end,
+  bool* empty,
+  uint64_t l1_pos_from)
+{
+  uint64_t d1 = CHILD_PER_SLOT;
+
+  ceph_assert(0 == (l1_pos_start % (slotset_width * d1)));
+  ceph_assert(0 == (l1_pos_end % (slotset_width * d1)));
+  interval_t res;
+  if (length != l0_granularity) {
+    res = _allocate_l1_contiguous<Fit>(length, length, length,
+      l1_pos_start, l1_pos_end);
+    ceph_assert(res.length == 0 || res.length == length);
+  } else {
+    // take the first free l0 bit from the first non-full l1 entry,
+    // best fit prefers partially free entries if any, next fit
+    // starts from the previous allocation and wraps around
+    const slot_t lo_bits = all_slot_set / L1_ENTRY_MASK;
+    auto idx_start = l1_pos_start / d1;
+    auto idx_end = l1_pos_end / d1;
+    auto first = idx_start;
+    if (l1_pos_from / d1 > idx_start && l1_pos_from / d1 < idx_end) {
+      // hinted
+      first = l1_pos_from / d1;
+    } else if (Fit == FIT_BEST) {
+      for (auto idx = idx_start; idx < idx_end; ++idx) {
+	slot_t slot_val = l1[idx];
+	if (slot_val & ~(slot_val >> 1) & lo_bits) {
+	  first = idx;
+	  break;
+	}
+      }
+    } else if (Fit == FIT_NEXT && next_fit_pos / d1 > idx_start &&
+	next_fit_pos / d1 < idx_end) {
+      first = next_fit_pos / d1;
+    }
+    for (auto n = idx_start; n < idx_end; ++n) {
+      auto idx = first + n - idx_start;
+      if (idx >= idx_end) {
+	idx -= idx_end - idx_start;
+      }
+      slot_t slot_val = l1[idx];
+      if (slot_val == all_slot_clear) {
+	continue;
+      }
+      slot_t partial_m = slot_val & ~(slot_val >> 1) & lo_bits;
+      auto free_pos = Fit == FIT_BEST && partial_m ?
+	__builtin_ctzll(partial_m) : find_next_set_bit(slot_val, 0);
+      ceph_assert(free_pos < bits_per_slot);
+      auto l1_pos = idx * d1 + free_pos / L1_ENTRY_WIDTH;
+      auto l0_idx = l1_pos * slotset_width;
+      auto l0_idx_end = l0_idx + slotset_width;
+      for (; l0_idx < l0_idx_end; ++l0_idx) {
+	if (l0[l0_idx] != all_slot_clear) {
+	  break;
+	}
+      }
+      ceph_assert(l0_idx < l0_idx_end);
+      int64_t l0_pos = l0_idx * bits_per_slot + __builtin_ctzll(l0[l0_idx]);
+      _mark_alloc_l1_l0(l0_pos, l0_pos + 1);
+      res = interval_t(l0_pos * l0_granularity, l0_granularity);
+      next_fit_pos = idx * d1;
+      break;
+    }
+  }
+  *empty = _is_empty_l1(l1_pos_start, l1_pos_end);
+  return res;
+}
+
+template <int Fit>
 bool AllocatorLevel01Loose::_allocate_l1(uint64_t length,
   uint64_t min_length, uint64_t max_length,
   uint64_t l1_pos_start, uint64_t l1_pos_end,
@@ -445,7 +1114,7 @@ bool AllocatorLevel01Loose::_allocate_l1(uint64_t length,
     bool has_space = true;
     while (length > *allocated && has_space) {
       interval_t i =
-        _allocate_l1_contiguous(length - *allocated, min_length, max_length,
+        _allocate_l1_contiguous<Fit>(length - *allocated, min_length, max_length,
 	  l1_pos_start, l1_pos_end);
       if (i.length == 0) {
         has_space = false;
@@ -456,68 +1125,458 @@ bool AllocatorLevel01Loose::_allocate_l1(uint64_t length,
     }
   } else {
     uint64_t l0_w = slotset_width * d0;
+    // low bits of 2-bit entries
+    const slot_t lo_bits = all_slot_set / L1_ENTRY_MASK;
+    auto idx_start = l1_pos_start / d1;
+    auto idx_end = l1_pos_end / d1;
+    auto first = idx_start;
+    if (Fit == FIT_NEXT && next_fit_pos / d1 > idx_start &&
+	next_fit_pos / d1 < idx_end) {
+      first = next_fit_pos / d1;
+    }
+    // best fit consumes partially free entries during an extra first pass
+    for (int pass = Fit == FIT_BEST ? 0 : 1; pass < 2; ++pass) {
+      for (auto n = idx_start; n < idx_end && length > *allocated; ++n) {
+	auto idx = first + n - idx_start;
+	if (idx >= idx_end) {
+	  idx -= idx_end - idx_start;
+	}
+	slot_t& slot_val = l1[idx];
+	auto candidates = [&]() {
+	  return pass ? slot_val : slot_val & ~(slot_val >> 1) & lo_bits;
+	};
+	if (candidates() == all_slot_clear) {
+	  continue;
+	} else if (slot_val == all_slot_set) {
+	  uint64_t to_alloc = std::min(length - *allocated,
+	    l1_granularity * d1);
+	  *allocated += to_alloc;
+	  inc_counter(CNT_ALLOC_FRAGMENTS_FAST);
+	  _fragment_and_emplace(max_length, idx * d1 * l1_granularity, to_alloc,
+	    res);
+	  _mark_alloc_l1_l0(idx * d1 * bits_per_slotset,
+	    idx * d1 * bits_per_slotset + to_alloc / l0_granularity);
+	  next_fit_pos = idx * d1;
+	  continue;
+	}
+	auto free_pos = find_next_set_bit(candidates(), 0);
+	ceph_assert(free_pos < bits_per_slot);
+	do {
+	  ceph_assert(length > *allocated);
 
-    for (auto idx = l1_pos_start / d1;
-      idx < l1_pos_end / d1 && length > *allocated;
-      ++idx) {
+	  bool empty;
+	  empty = _allocate_l0(length, max_length,
+	    (idx * d1 + free_pos / L1_ENTRY_WIDTH) * l0_w,
+	    (idx * d1 + free_pos / L1_ENTRY_WIDTH + 1) * l0_w,
+	    allocated,
+	    res);
+
+	  auto mask = slot_t(L1_ENTRY_MASK) << free_pos;
+
+	  slot_t old_mask = (slot_val & mask) >> free_pos;
+	  switch(old_mask) {
+	  case L1_ENTRY_FREE:
+	    counter_sub(unalloc_l1_count, 1);
+	    break;
+	  case L1_ENTRY_PARTIAL:
+	    counter_sub(partial_l1_count, 1);
+	    break;
+	  }
+	  slot_val &= ~mask;
+	  if (empty) {
+	    // the next line is no op with the current L1_ENTRY_FULL but left
+	    // as-is for the sake of uniformity and to avoid potential errors
+	    // in future
+	    slot_val |= slot_t(L1_ENTRY_FULL) << free_pos;
+	  } else {
+	    slot_val |= slot_t(L1_ENTRY_PARTIAL) << free_pos;
+	    counter_add(partial_l1_count, 1);
+	  }
+	  if (length <= *allocated || slot_val == all_slot_clear) {
+	    break;
+	  }
+	  free_pos = find_next_set_bit(candidates(), free_pos + L1_ENTRY_WIDTH);
+	} while (free_pos < bits_per_slot);
+	next_fit_pos = idx * d1;
+      }
+    }
+  }
+  return _is_empty_l1(l1_pos_start, l1_pos_end);
+}
+
+int64_t AllocatorLevel01Loose::_claim_l1_entry(uint64_t l1_pos_start,
+  uint64_t l1_pos_end)
+{
+  uint64_t d = CHILD_PER_SLOT;
+  ceph_assert(0 == (l1_pos_start % d));
+  ceph_assert(0 == (l1_pos_end % d));
+  // low bits of 2-bit entries
+  const slot_t lo_bits = all_slot_set / L1_ENTRY_MASK;
+
+  // prefer partially free entries to keep fragmentation low
+  for (auto want : { L1_ENTRY_PARTIAL, L1_ENTRY_FREE }) {
+    for (auto idx = l1_pos_start / d; idx < l1_pos_end / d; ++idx) {
       slot_t& slot_val = l1[idx];
       if (slot_val == all_slot_clear) {
-        continue;
-      } else if (slot_val == all_slot_set) {
-        uint64_t to_alloc = std::min(length - *allocated,
-          l1_granularity * d1);
-        *allocated += to_alloc;
-        ++alloc_fragments_fast;
-	_fragment_and_emplace(max_length, idx * d1 * l1_granularity, to_alloc,
-	  res);
-        _mark_alloc_l1_l0(idx * d1 * bits_per_slotset,
-	  idx * d1 * bits_per_slotset + to_alloc / l0_granularity);
-        continue;
+	continue;
       }
-      auto free_pos = find_next_set_bit(slot_val, 0);
-      ceph_assert(free_pos < bits_per_slot);
-      do {
-        ceph_assert(length > *allocated);
+      slot_t mask = want == L1_ENTRY_FREE ?
+	slot_val & (slot_val >> 1) & lo_bits :
+	slot_val & ~(slot_val >> 1) & lo_bits;
+      if (mask == all_slot_clear) {
+	continue;
+      }
+      auto shift = __builtin_ctzll(mask);
+      if (want == L1_ENTRY_FREE) {
+	counter_sub(unalloc_l1_count, 1);
+      } else {
+	counter_sub(partial_l1_count, 1);
+      }
+      slot_val &= ~(slot_t(L1_ENTRY_MASK) << shift);
+      uint64_t l1_pos = idx * d + shift / L1_ENTRY_WIDTH;
+      _update_free_bins(l1_pos * bits_per_slotset,
+	(l1_pos + 1) * bits_per_slotset, -1);
+      if (free_index) {
+	_index_mark_alloc(l1_pos * bits_per_slotset,
+	  (l1_pos + 1) * bits_per_slotset);
+      }
+      return l1_pos;
+    }
+  }
+  return -1;
+}
+
+// invokes fn(pos, len) for every free run within [l0_pos, l0_pos_end)
+template <typename F>
+static void _for_each_free_run(const slot_vector_t& l0, uint64_t l0_pos,
+  uint64_t l0_pos_end, F fn)
+{
+  auto d0 = bits_per_slot;
+  uint64_t run_pos = 0;
+  uint64_t run_len = 0;
+  auto pos = l0_pos;
+  while (pos < l0_pos_end) {
+    slot_t bits = l0[pos / d0] >> (pos % d0);
+    uint64_t left = std::min(d0 - pos % d0, l0_pos_end - pos);
+    uint64_t n;
+    if (bits & 1) {
+      n = ~bits ? std::min<uint64_t>(__builtin_ctzll(~bits), left) : left;
+      if (!run_len) {
+	run_pos = pos;
+      }
+      run_len += n;
+    } else {
+      if (run_len) {
+	fn(run_pos, run_len);
+	run_len = 0;
+      }
+      n = bits ? std::min<uint64_t>(__builtin_ctzll(bits), left) : left;
+    }
+    pos += n;
+  }
+  if (run_len) {
+    fn(run_pos, run_len);
+  }
+}
+
+bool AllocatorLevel01::_get_tightest_from_l0(uint64_t pos0, uint64_t pos1,
+  uint64_t length, uint64_t min_length, interval_t* best) const
+{
+  _for_each_free_run(l0, pos0, pos1, [&](uint64_t pos, uint64_t len) {
+    auto e = _align2units(pos * l0_granularity, len * l0_granularity,
+      min_length);
+    if (e.length >= length && (!best->length || e.length < best->length)) {
+      *best = e;
+    }
+  });
+  return best->length == length;
+}
+
+interval_t AllocatorLevel01Loose::_get_tightest_run(uint64_t pos_start,
+  uint64_t pos_end, uint64_t length, uint64_t min_length) const
+{
+  auto d = CHILD_PER_SLOT;
+  ceph_assert((pos_start % d) == 0);
+  ceph_assert((pos_end % d) == 0);
+  uint64_t l0_w = slotset_width * CHILD_PER_SLOT_L0;
+
+  // runs can't span full entries, walk L0 under the rest span by span
+  interval_t best;
+  uint64_t span = pos_start;
+  for (auto idx = pos_start / d; idx < pos_end / d; ++idx) {
+    slot_t slot_val = l1[idx];
+    if (slot_val == all_slot_set) {
+      continue;
+    }
+    for (uint64_t c = 0; c < d; ++c) {
+      if ((slot_val & L1_ENTRY_MASK) == L1_ENTRY_FULL) {
+	auto l1_pos = idx * d + c;
+	if (span < l1_pos &&
+	    _get_tightest_from_l0(span * l0_w, l1_pos * l0_w,
+	      length, min_length, &best)) {
+	  return best;
+	}
+	span = l1_pos + 1;
+      }
+      slot_val >>= L1_ENTRY_WIDTH;
+    }
+  }
+  if (span < pos_end) {
+    _get_tightest_from_l0(span * l0_w, pos_end * l0_w,
+      length, min_length, &best);
+  }
+  return best;
+}
+
+interval_t AllocatorLevel01Compact::_get_tightest_run(uint64_t pos_start,
+  uint64_t pos_end, uint64_t length, uint64_t min_length) const
+{
+  auto d = CHILD_PER_SLOT;
+  ceph_assert((pos_start % d) == 0);
+  ceph_assert((pos_end % d) == 0);
+  uint64_t l0_w = slotset_width * CHILD_PER_SLOT_L0;
 
-        bool empty;
-        empty = _allocate_l0(length, max_length,
-	  (idx * d1 + free_pos / L1_ENTRY_WIDTH) * l0_w,
-          (idx * d1 + free_pos / L1_ENTRY_WIDTH + 1) * l0_w,
-          allocated,
-          res);
+  interval_t best;
+  uint64_t span = pos_start;
+  for (auto idx = pos_start / d; idx < pos_end / d; ++idx) {
+    slot_t m = ~l1[idx];
+    while (m) {
+      auto l1_pos = idx * d + __builtin_ctzll(m);
+      m &= m - 1;
+      if (span < l1_pos &&
+	  _get_tightest_from_l0(span * l0_w, l1_pos * l0_w,
+	    length, min_length, &best)) {
+	return best;
+      }
+      span = l1_pos + 1;
+    }
+  }
+  if (span < pos_end) {
+    _get_tightest_from_l0(span * l0_w, pos_end * l0_w,
+      length, min_length, &best);
+  }
+  return best;
+}
 
-	auto mask = slot_t(L1_ENTRY_MASK) << free_pos;
+// returns the first position within L1 entries [l1_pos_start, l1_pos_end)
+// aligned to 'align' (power of 2) and followed by 'len' free L0 entries,
+// -1 if none. classify(l1_pos) provides SLOTSET_* state of an L1 entry,
+// mixed ones are walked run by run.
+template <typename F>
+static int64_t _find_aligned_run(const slot_vector_t& l0,
+  uint64_t l1_pos_start, uint64_t l1_pos_end,
+  uint64_t len, uint64_t align, F classify)
+{
+  auto d0 = bits_per_slot;
+  uint64_t run_pos = 0;
+  uint64_t run_len = 0;
+  // returns true once the run fits
+  auto extend = [&](uint64_t pos, uint64_t n) {
+    if (!run_len) {
+      run_pos = pos;
+    }
+    run_len += n;
+    return p2roundup(run_pos, align) + len <= run_pos + run_len;
+  };
+  for (auto l1_pos = l1_pos_start; l1_pos < l1_pos_end; ++l1_pos) {
+    auto pos = l1_pos * bits_per_slotset;
+    switch (classify(l1_pos)) {
+    case SLOTSET_FULL:
+      run_len = 0;
+      continue;
+    case SLOTSET_FREE:
+      if (extend(pos, bits_per_slotset)) {
+	return p2roundup(run_pos, align);
+      }
+      continue;
+    case SLOTSET_MIXED:
+      // walked run by run below
+      break;
+    }
+    for (auto idx = pos / d0; idx < (pos + bits_per_slotset) / d0; ++idx) {
+      slot_t bits = l0[idx];
+      uint64_t b = 0;
+      while (b < d0) {
+	slot_t rest = bits >> b;
+	if (rest & 1) {
+	  uint64_t n = ~rest ? __builtin_ctzll(~rest) : d0;
+	  if (extend(idx * d0 + b, n)) {
+	    return p2roundup(run_pos, align);
+	  }
+	  b += n;
+	} else {
+	  run_len = 0;
+	  if (!rest) {
+	    break;
+	  }
+	  b += __builtin_ctzll(rest);
+	}
+      }
+    }
+  }
+  return -1;
+}
 
-	slot_t old_mask = (slot_val & mask) >> free_pos;
-	switch(old_mask) {
-	case L1_ENTRY_FREE:
-	  unalloc_l1_count--;
+interval_t AllocatorLevel01Loose::_allocate_l1_aligned(uint64_t length,
+  uint64_t align, uint64_t l1_pos_start, uint64_t l1_pos_end,
+  bool* empty)
+{
+  ceph_assert(0 == (align % l0_granularity));
+  interval_t res;
+  auto pos = _find_aligned_run(l0, l1_pos_start, l1_pos_end,
+    length / l0_granularity, align / l0_granularity,
+    [&](uint64_t l1_pos) {
+      auto shift = (l1_pos % CHILD_PER_SLOT) * L1_ENTRY_WIDTH;
+      switch ((l1[l1_pos / CHILD_PER_SLOT] >> shift) & L1_ENTRY_MASK) {
+      case L1_ENTRY_FREE:
+	return SLOTSET_FREE;
+      case L1_ENTRY_PARTIAL:
+	return SLOTSET_MIXED;
+      }
+      return SLOTSET_FULL;
+    });
+  if (pos >= 0) {
+    _mark_alloc_l1_l0(pos, pos + length / l0_granularity);
+    res = interval_t(pos * l0_granularity, length);
+  }
+  *empty = _is_empty_l1(l1_pos_start, l1_pos_end);
+  return res;
+}
+
+void AllocatorLevel01::_index_add(uint64_t l0_pos, uint64_t l0_pos_end)
+{
+  auto& idx = *free_index;
+  _for_each_free_run(l0, l0_pos, l0_pos_end,
+    [&](uint64_t p, uint64_t l) {
+      idx.insert(p, l);
+    });
+}
+
+void AllocatorLevel01Loose::_index_build()
+{
+  free_index.reset(new free_index_t);
+  uint64_t l1_entries = l1.size() * CHILD_PER_SLOT;
+  uint64_t pos = 0;
+  while (pos < l1_entries) {
+    // entries claimed for lock-free access are marked full at L1
+    // while having free L0 bits, skip them
+    auto end = pos;
+    while (end < l1_entries &&
+      ((l1[end / CHILD_PER_SLOT] >> ((end % CHILD_PER_SLOT) * L1_ENTRY_WIDTH)) &
+	L1_ENTRY_MASK) != L1_ENTRY_FULL) {
+      ++end;
+    }
+    _index_add(pos * bits_per_slotset, end * bits_per_slotset);
+    pos = end + 1;
+  }
+}
+
+void AllocatorLevel01::_index_mark_alloc(uint64_t l0_pos,
+  uint64_t l0_pos_end)
+{
+  auto& idx = *free_index;
+  auto it = idx.runs.upper_bound(l0_pos);
+  if (it != idx.runs.begin()) {
+    auto prev = std::prev(it);
+    if (prev->first + prev->second > l0_pos) {
+      it = prev;
+    }
+  }
+  while (it != idx.runs.end() && it->first < l0_pos_end) {
+    auto run_pos = it->first;
+    auto run_end = it->first + it->second;
+    it = idx.erase(it);
+    if (run_pos < l0_pos) {
+      idx.insert(run_pos, l0_pos - run_pos);
+    }
+    if (run_end > l0_pos_end) {
+      idx.insert(l0_pos_end, run_end - l0_pos_end);
+    }
+  }
+}
+
+void AllocatorLevel01::_index_mark_free(uint64_t l0_pos,
+  uint64_t l0_pos_end)
+{
+  auto& idx = *free_index;
+  auto it = idx.runs.upper_bound(l0_pos);
+  if (it != idx.runs.begin()) {
+    auto prev = std::prev(it);
+    if (prev->first + prev->second >= l0_pos) {
+      it = prev;
+    }
+  }
+  // merge with overlapping and adjacent runs
+  while (it != idx.runs.end() && it->first <= l0_pos_end) {
+    l0_pos = std::min(l0_pos, it->first);
+    l0_pos_end = std::max(l0_pos_end, it->first + it->second);
+    it = idx.erase(it);
+  }
+  idx.insert(l0_pos, l0_pos_end - l0_pos);
+}
+
+void AllocatorLevel01::_index_refresh(uint64_t l0_pos,
+  uint64_t l0_pos_end)
+{
+  _index_mark_alloc(l0_pos, l0_pos_end);
+  _for_each_free_run(l0, l0_pos, l0_pos_end,
+    [&](uint64_t p, uint64_t l) {
+      _index_mark_free(p, p + l);
+    });
+}
+
+interval_t AllocatorLevel01::_index_find(uint64_t len, uint64_t align,
+  bool* conclusive, bool exact)
+{
+  auto& idx = *free_index;
+  ceph_assert(len && align);
+
+  uint64_t pos = 0;
+  uint64_t found = 0;
+  *conclusive = true;
+  // the lowest bucket able to fit, any run fits for sure starting
+  // from bucket(len + align - 1) on
+  for (auto k = free_index_t::bucket(len); !found && k < bits_per_slot; ++k) {
+    size_t probes = 0;
+    for (auto& r : idx.buckets[k]) {
+      auto p = round_up_to(r.first, align);
+      if (p + len <= r.first + r.second) {
+	pos = p;
+	found = len;
+	break;
+      }
+      if (++probes >= free_index_t::MAX_PROBES) {
+	*conclusive = false;
+	break;
+      }
+    }
+  }
+  if (!found && !exact && align < len) {
+    // no full fit, take the longest piece
+    for (auto k = bits_per_slot; !found && k-- > free_index_t::bucket(align);) {
+      size_t probes = 0;
+      for (auto& r : idx.buckets[k]) {
+	auto e = _align2units(r.first, r.second, align);
+	if (e.length) {
+	  pos = e.offset;
+	  found = std::min(e.length, len);
 	  break;
-	case L1_ENTRY_PARTIAL:
-	  partial_l1_count--;
+	}
+	if (++probes >= free_index_t::MAX_PROBES) {
+	  *conclusive = false;
 	  break;
 	}
-        slot_val &= ~mask;
-        if (empty) {
-          // the next line is no op with the current L1_ENTRY_FULL but left
-          // as-is for the sake of uniformity and to avoid potential errors
-          // in future
-          slot_val |= slot_t(L1_ENTRY_FULL) << free_pos;
-        } else {
-          slot_val |= slot_t(L1_ENTRY_PARTIAL) << free_pos;
-	  partial_l1_count++;
-        }
-        if (length <= *allocated || slot_val == all_slot_clear) {
-          break;
-        }
-	free_pos = find_next_set_bit(slot_val, free_pos + L1_ENTRY_WIDTH);
-      } while (free_pos < bits_per_slot);
+      }
     }
   }
-  return _is_empty_l1(l1_pos_start, l1_pos_end);
+  if (!found) {
+    return interval_t();
+  }
+  *conclusive = true;
+  return interval_t(pos, found);
 }
 
-void AllocatorLevel01Loose::collect_stats(
+void AllocatorLevel01::collect_stats(
   std::map<size_t, size_t>& bins_overall)
 {
   size_t free_seq_cnt = 0;
@@ -551,3 +1610,354 @@ void AllocatorLevel01Loose::collect_stats(
     bins_overall[cbits(free_seq_cnt) - 1]++;
   }
 }
+
+void AllocatorLevel01::_count_free_runs(uint64_t l0_pos,
+  uint64_t l0_pos_end, uint64_t* bins) const
+{
+  ceph_assert(0 == (l0_pos % bits_per_slotset));
+  ceph_assert(0 == (l0_pos_end % bits_per_slotset));
+  for (auto idx = l0_pos / bits_per_slot; idx < l0_pos_end / bits_per_slot;
+    idx += slotset_width) {
+    size_t run = 0;
+    for (size_t i = 0; i < slotset_width; ++i) {
+      slot_t v = l0[idx + i];
+      if (v == all_slot_set) {
+	run += bits_per_slot;
+	continue;
+      }
+      size_t pos = 0;
+      while (pos < bits_per_slot) {
+	slot_t w = v >> pos;
+	if (w & 1) {
+	  // NB: ~w has high bits set hence ctz never exceeds the remainder
+	  auto n = __builtin_ctzll(~w);
+	  run += n;
+	  pos += n;
+	} else {
+	  if (run) {
+	    bins[cbits(run) - 1]++;
+	    run = 0;
+	  }
+	  if (!w) {
+	    break;
+	  }
+	  pos += __builtin_ctzll(w);
+	}
+      }
+    }
+    if (run) {
+      bins[cbits(run) - 1]++;
+    }
+  }
+}
+
+void AllocatorLevel01Compact::_mark_l1_on_l0(int64_t l0_pos,
+  int64_t l0_pos_end)
+{
+  if (l0_pos == l0_pos_end) {
+    return;
+  }
+  auto d0 = bits_per_slotset;
+  uint64_t l1_w = CHILD_PER_SLOT;
+  // this should be aligned with slotset boundaries
+  ceph_assert(0 == (l0_pos % d0));
+  ceph_assert(0 == (l0_pos_end % d0));
+
+  // entries are collected per L1 slot and applied with a single update
+  uint64_t l1_pos = l0_pos / d0;
+  uint64_t l1_pos_end = l0_pos_end / d0;
+  while (l1_pos < l1_pos_end) {
+    auto word_end = std::min(p2align(l1_pos, l1_w) + l1_w, l1_pos_end);
+    slot_t bits = all_slot_clear;
+    for (auto pos = l1_pos; pos < word_end; ++pos) {
+      slot_t any_free = all_slot_clear;
+      for (auto idx = pos * slotset_width;
+	idx < (pos + 1) * slotset_width; ++idx) {
+	any_free |= l0[idx];
+      }
+      if (any_free) {
+	bits |= slot_t(1) << (pos % l1_w);
+      }
+    }
+    assign_bit_range(&l1[l1_pos / l1_w], l1_pos % l1_w,
+      word_end - p2align(l1_pos, l1_w), bits);
+    l1_pos = word_end;
+  }
+}
+
+// max_length isn't needed here, the caller splits the extent
+// returned into max_length pieces
+template <int Fit>
+interval_t AllocatorLevel01Compact::_allocate_l1_contiguous(uint64_t length,
+  uint64_t min_length, uint64_t /*max_length*/,
+  uint64_t pos_start, uint64_t pos_end)
+{
+  auto d = CHILD_PER_SLOT;
+  ceph_assert((pos_start % d) == 0);
+  ceph_assert((pos_end % d) == 0);
+
+  uint64_t l0_w = slotset_width * CHILD_PER_SLOT_L0;
+
+  if constexpr (Fit == FIT_BEST) {
+    auto e = _get_tightest_run(pos_start, pos_end, length, min_length);
+    if (e.length) {
+      auto pos = e.offset / l0_granularity;
+      _mark_alloc_l1_l0(pos, pos + length / l0_granularity);
+      return interval_t(e.offset, length);
+    }
+  }
+  // free and partial entries are indistinguishable at L1 hence
+  // just take the first fit, runs spanning adjacent entries are
+  // tracked via tails. Remember the longest misfit to fall back to.
+  interval_t prev_tail;
+  interval_t longest_misfit;
+  interval_t best;
+  uint64_t expected_l1_pos = pos_start;
+  for (auto idx = pos_start / d; idx < pos_end / d; ++idx) {
+    slot_t m = l1[idx];
+    while (m) {
+      uint64_t l1_pos = idx * d + __builtin_ctzll(m);
+      m &= m - 1;
+      if (l1_pos != expected_l1_pos) {
+	prev_tail = interval_t();
+      }
+      expected_l1_pos = l1_pos + 1;
+
+      if (_has_run_cache() && length > l0_granularity) {
+	// skip entries which can't give a fit or a longer misfit
+	interval_t tail;
+	auto bound = _get_longest_bound(l1_pos, prev_tail, &tail);
+	if (bound < min_length ||
+	    (bound < length && bound <= longest_misfit.length)) {
+	  prev_tail = tail;
+	  continue;
+	}
+      }
+      interval_t longest = _get_longest_from_l0(l1_pos * l0_w,
+	(l1_pos + 1) * l0_w, min_length, &prev_tail);
+      if (longest.length >= length) {
+	best = longest;
+	break;
+      }
+      if (longest.length > longest_misfit.length) {
+	longest_misfit = longest;
+      }
+    }
+    if (best.length) {
+      break;
+    }
+  }
+  if (best.length) {
+    auto pos = best.offset / l0_granularity;
+    _mark_alloc_l1_l0(pos, pos + length / l0_granularity);
+    return interval_t(best.offset, length);
+  }
+  if (longest_misfit.length) {
+    ceph_assert((longest_misfit.length % min_length) == 0);
+    auto pos = longest_misfit.offset / l0_granularity;
+    _mark_alloc_l1_l0(pos, pos + longest_misfit.length / l0_granularity);
+  }
+  return longest_misfit;
+}
+
+template <int Fit>
+interval_t AllocatorLevel01Compact::_allocate_l1_extent(uint64_t length,
+  uint64_t l1_pos_start, uint64_t l1_pos_end,
+  bool* empty,
+  uint64_t l1_pos_from)
+{
+  uint64_t d1 = CHILD_PER_SLOT;
+
+  ceph_assert(0 == (l1_pos_start % (slotset_width * d1)));
+  ceph_assert(0 == (l1_pos_end % (slotset_width * d1)));
+  interval_t res;
+  if (length != l0_granularity) {
+    res = _allocate_l1_contiguous<Fit>(length, length, length,
+      l1_pos_start, l1_pos_end);
+    ceph_assert(res.length == 0 || res.length == length);
+  } else {
+    // take the first free l0 bit from the first non-full l1 entry,
+    // starting at the hinted slot if any
+    auto idx_start = l1_pos_start / d1;
+    auto idx_end = l1_pos_end / d1;
+    auto first = idx_start;
+    if (l1_pos_from / d1 > idx_start && l1_pos_from / d1 < idx_end) {
+      first = l1_pos_from / d1;
+    }
+    for (auto n = idx_start; n < idx_end; ++n) {
+      auto idx = first + n - idx_start;
+      if (idx >= idx_end) {
+	idx -= idx_end - idx_start;
+      }
+      slot_t slot_val = l1[idx];
+      if (slot_val == all_slot_clear) {
+	continue;
+      }
+      auto l1_pos = idx * d1 + __builtin_ctzll(slot_val);
+      auto l0_idx = l1_pos * slotset_width;
+      auto l0_idx_end = l0_idx + slotset_width;
+      for (; l0_idx < l0_idx_end; ++l0_idx) {
+	if (l0[l0_idx] != all_slot_clear) {
+	  break;
+	}
+      }
+      ceph_assert(l0_idx < l0_idx_end);
+      int64_t l0_pos = l0_idx * bits_per_slot + __builtin_ctzll(l0[l0_idx]);
+      _mark_alloc_l1_l0(l0_pos, l0_pos + 1);
+      res = interval_t(l0_pos * l0_granularity, l0_granularity);
+      break;
+    }
+  }
+  *empty = _is_empty_l1(l1_pos_start, l1_pos_end);
+  return res;
+}
+
+template <int Fit>
+bool AllocatorLevel01Compact::_allocate_l1(uint64_t length,
+  uint64_t min_length, uint64_t max_length,
+  uint64_t l1_pos_start, uint64_t l1_pos_end,
+  uint64_t* allocated,
+  interval_vector_t* res)
+{
+  uint64_t d0 = CHILD_PER_SLOT_L0;
+  uint64_t d1 = CHILD_PER_SLOT;
+
+  ceph_assert(0 == (l1_pos_start % (slotset_width * d1)));
+  ceph_assert(0 == (l1_pos_end % (slotset_width * d1)));
+  if (min_length != l0_granularity) {
+    bool has_space = true;
+    while (length > *allocated && has_space) {
+      interval_t i =
+        _allocate_l1_contiguous<Fit>(length - *allocated, min_length, max_length,
+	  l1_pos_start, l1_pos_end);
+      if (i.length == 0) {
+        has_space = false;
+      } else {
+	_fragment_and_emplace(max_length, i.offset, i.length, res);
+        *allocated += i.length;
+      }
+    }
+  } else {
+    uint64_t l0_w = slotset_width * d0;
+
+    for (auto idx = l1_pos_start / d1;
+      idx < l1_pos_end / d1 && length > *allocated;
+      ++idx) {
+      slot_t& slot_val = l1[idx];
+      slot_t m = slot_val;
+      while (m && length > *allocated) {
+	auto bit = __builtin_ctzll(m);
+	m &= m - 1;
+	auto l1_pos = idx * d1 + bit;
+	bool empty = _allocate_l0(length, max_length,
+	  l1_pos * l0_w, (l1_pos + 1) * l0_w,
+	  allocated,
+	  res);
+	if (empty) {
+	  slot_val &= ~(slot_t(1) << bit);
+	}
+      }
+    }
+  }
+  return _is_empty_l1(l1_pos_start, l1_pos_end);
+}
+
+int64_t AllocatorLevel01Compact::_claim_l1_entry(uint64_t l1_pos_start,
+  uint64_t l1_pos_end)
+{
+  uint64_t d = CHILD_PER_SLOT;
+  ceph_assert(0 == (l1_pos_start % d));
+  ceph_assert(0 == (l1_pos_end % d));
+
+  // prefer partially free entries to keep fragmentation low
+  int64_t res = -1;
+  bool partial = false;
+  for (auto idx = l1_pos_start / d; idx < l1_pos_end / d && !partial; ++idx) {
+    slot_t m = l1[idx];
+    while (m && !partial) {
+      uint64_t l1_pos = idx * d + __builtin_ctzll(m);
+      m &= m - 1;
+      partial = !_is_l1_entry_free(l1_pos);
+      if (partial || res < 0) {
+	res = l1_pos;
+      }
+    }
+  }
+  if (res >= 0) {
+    l1[res / d] &= ~(slot_t(1) << (res % d));
+    _update_free_bins(res * bits_per_slotset, (res + 1) * bits_per_slotset, -1);
+    if (free_index) {
+      _index_mark_alloc(res * bits_per_slotset, (res + 1) * bits_per_slotset);
+    }
+  }
+  return res;
+}
+
+interval_t AllocatorLevel01Compact::_allocate_l1_aligned(uint64_t length,
+  uint64_t align, uint64_t l1_pos_start, uint64_t l1_pos_end,
+  bool* empty)
+{
+  ceph_assert(0 == (align % l0_granularity));
+  interval_t res;
+  auto pos = _find_aligned_run(l0, l1_pos_start, l1_pos_end,
+    length / l0_granularity, align / l0_granularity,
+    [&](uint64_t l1_pos) {
+      return _is_l1_entry_set(l1_pos) ?
+	_classify_slotset(&l0[l1_pos * slotset_width]) : int(SLOTSET_FULL);
+    });
+  if (pos >= 0) {
+    _mark_alloc_l1_l0(pos, pos + length / l0_granularity);
+    res = interval_t(pos * l0_granularity, length);
+  }
+  *empty = _is_empty_l1(l1_pos_start, l1_pos_end);
+  return res;
+}
+
+void AllocatorLevel01Compact::_index_build()
+{
+  free_index.reset(new free_index_t);
+  uint64_t l1_entries = l1.size() * CHILD_PER_SLOT;
+  uint64_t pos = 0;
+  while (pos < l1_entries) {
+    // claimed entries are indistinguishable from full ones, skip both
+    auto end = pos;
+    while (end < l1_entries && _is_l1_entry_set(end)) {
+      ++end;
+    }
+    _index_add(pos * bits_per_slotset, end * bits_per_slotset);
+    pos = end + 1;
+  }
+}
+
+double AllocatorLevel01Compact::get_fragmentation() const
+{
+  size_t partial = 0;
+  size_t total = 0;
+  for (uint64_t l1_pos = 0; l1_pos < l0.size() / slotset_width; ++l1_pos) {
+    if (!_is_l1_entry_set(l1_pos)) {
+      continue;
+    }
+    ++total;
+    if (_classify_slotset(&l0[l1_pos * slotset_width]) != SLOTSET_FREE) {
+      ++partial;
+    }
+  }
+  return total ? double(partial) / double(total) : 0.0;
+}
+
+// L1 entry points for every placement policy
+#define INSTANTIATE_L1_FIT(L1, Fit)					\
+  template interval_t L1::_allocate_l1_contiguous<Fit>(uint64_t,	\
+    uint64_t, uint64_t, uint64_t, uint64_t);				\
+  template bool L1::_allocate_l1<Fit>(uint64_t, uint64_t, uint64_t,	\
+    uint64_t, uint64_t, uint64_t*, interval_vector_t*);			\
+  template interval_t L1::_allocate_l1_extent<Fit>(uint64_t, uint64_t,	\
+    uint64_t, bool*, uint64_t);
+#define INSTANTIATE_L1(L1)						\
+  INSTANTIATE_L1_FIT(L1, FIT_DEFAULT)					\
+  INSTANTIATE_L1_FIT(L1, FIT_FIRST)					\
+  INSTANTIATE_L1_FIT(L1, FIT_NEXT)					\
+  INSTANTIATE_L1_FIT(L1, FIT_BEST)
+
+INSTANTIATE_L1(AllocatorLevel01Loose)
+INSTANTIATE_L1(AllocatorLevel01Compact)
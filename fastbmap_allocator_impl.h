@@ -12,11 +12,52 @@
 #include <vector>
 #include <algorithm>
 #include <map>
+#include <set>
 #include <mutex>
 #include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <functional>
 
 typedef uint64_t slot_t;
 
+// Bitmap storage is cache line aligned hence slotsets never straddle
+// cache lines. Bitmaps of BITMAP_HUGE_PAGE bytes and more are mapped
+// separately and backed by transparent huge pages to cut TLB misses
+// on scans.
+enum {
+  BITMAP_ALIGN = 64,
+  BITMAP_HUGE_PAGE = 2 << 20,
+};
+void* bitmap_alloc(size_t bytes);
+void bitmap_free(void* p, size_t bytes);
+// applies to the bitmaps allocated afterwards
+extern std::atomic<bool> bitmap_huge_pages;
+
+template <class T>
+struct bitmap_allocator_t
+{
+  typedef T value_type;
+
+  bitmap_allocator_t() = default;
+  template <class U>
+  bitmap_allocator_t(const bitmap_allocator_t<U>&) {}
+
+  T* allocate(size_t n)
+  {
+    return static_cast<T*>(bitmap_alloc(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n)
+  {
+    bitmap_free(p, n * sizeof(T));
+  }
+  template <class U>
+  bool operator==(const bitmap_allocator_t<U>&) const { return true; }
+  template <class U>
+  bool operator!=(const bitmap_allocator_t<U>&) const { return false; }
+};
+
 #ifdef NON_CEPH_BUILD
 #include <assert.h>
 #include <cstring>
@@ -34,7 +75,7 @@ struct interval_t
     offset(ext.offset), length(ext.length) {}
 };
 typedef std::vector<interval_t> interval_vector_t;
-typedef std::vector<slot_t> slot_vector_t;
+typedef std::vector<slot_t, bitmap_allocator_t<slot_t>> slot_vector_t;
 #ifndef unlikely
 #define unlikely(c) c
 #endif
@@ -56,6 +97,118 @@ typedef mempool::bluestore_alloc::vector<slot_t> slot_vector_t;
 
 typedef std::vector<std::pair<uint8_t*, uint64_t>> bufferlist;
 
+// copies len bytes to/from the bufferlist starting at the specified offset
+// within it, returns the amount of bytes copied
+inline uint64_t bufferlist_copy_in(bufferlist& target, uint64_t offset,
+  const uint8_t* from, uint64_t len)
+{
+  uint64_t copied = 0;
+  uint64_t pos = 0;
+  for (auto b : target) {
+    if (pos + b.second > offset && copied < len) {
+      auto skip = offset > pos ? offset - pos : 0;
+      auto to_copy = std::min(b.second - skip, len - copied);
+      memcpy(b.first + skip, from + copied, to_copy);
+      copied += to_copy;
+      offset += to_copy;
+    }
+    pos += b.second;
+  }
+  return copied;
+}
+inline uint64_t bufferlist_copy_out(const bufferlist& source, uint64_t offset,
+  uint8_t* to, uint64_t len)
+{
+  uint64_t copied = 0;
+  uint64_t pos = 0;
+  for (auto b : source) {
+    if (pos + b.second > offset && copied < len) {
+      auto skip = offset > pos ? offset - pos : 0;
+      auto to_copy = std::min(b.second - skip, len - copied);
+      memcpy(to + copied, b.first + skip, to_copy);
+      copied += to_copy;
+      offset += to_copy;
+    }
+    pos += b.second;
+  }
+  return copied;
+}
+// sequential access to the bufferlist contents
+class bufferlist_cursor
+{
+  const bufferlist& bl;
+  size_t idx = 0;
+  uint64_t pos = 0; // within bl[idx]
+
+  uint64_t _copy(uint8_t* p, uint64_t len, bool in)
+  {
+    uint64_t copied = 0;
+    while (copied < len && idx < bl.size()) {
+      auto to_copy = std::min(bl[idx].second - pos, len - copied);
+      if (in) {
+        memcpy(bl[idx].first + pos, p + copied, to_copy);
+      } else if (p) {
+        memcpy(p + copied, bl[idx].first + pos, to_copy);
+      }
+      copied += to_copy;
+      pos += to_copy;
+      if (pos == bl[idx].second) {
+        ++idx;
+        pos = 0;
+      }
+    }
+    return copied;
+  }
+public:
+  bufferlist_cursor(const bufferlist& _bl, uint64_t offset) : bl(_bl)
+  {
+    while (idx < bl.size() && offset >= bl[idx].second) {
+      offset -= bl[idx].second;
+      ++idx;
+    }
+    pos = offset;
+  }
+  // both return the amount of bytes copied
+  uint64_t copy_in(const void* from, uint64_t len)
+  {
+    return _copy((uint8_t*)from, len, true);
+  }
+  uint64_t copy_out(void* to, uint64_t len)
+  {
+    return _copy((uint8_t*)to, len, false);
+  }
+  uint64_t skip(uint64_t len)
+  {
+    return _copy(nullptr, len, false);
+  }
+};
+
+// runs fn on the calling thread and on threads - 1 pooled workers,
+// returns once all of them are done. Workers are spawned on demand and
+// kept for the later calls, concurrent calls are serialized.
+void run_on_workers(size_t threads, const std::function<void()>& fn);
+
+// invokes fn(begin, end) for chunk sized ranges covering [0, count)
+// on up to 'threads' threads, the calling one included
+template <class Func>
+void parallel_for_ranges(uint64_t count, uint64_t chunk, size_t threads,
+  Func fn)
+{
+  std::atomic<uint64_t> next(0);
+  auto worker = [&]() {
+    uint64_t pos;
+    while ((pos = next.fetch_add(chunk)) < count) {
+      fn(pos, std::min(pos + chunk, count));
+    }
+  };
+  threads = std::min<uint64_t>(threads, (count + chunk - 1) / chunk);
+  if (threads <= 1) {
+    worker();
+    return;
+  }
+  run_on_workers(threads, worker);
+}
+
 // fitting into cache line on x86_64
 static const size_t slotset_width = 8; // 8 slots per set
 static const size_t slotset_bytes = sizeof(slot_t) * slotset_width;
@@ -63,6 +216,11 @@ static const size_t bits_per_slot = sizeof(slot_t) * 8;
 static const size_t bits_per_slotset = slotset_bytes * 8;
 static const slot_t all_slot_set = 0xffffffffffffffff;
 static const slot_t all_slot_clear = 0;
+// L0 bitmap is tracked for incremental snapshots in pages of this size
+static const size_t snapshot_page_bytes = 4096;
+static const size_t bits_per_snapshot_page = snapshot_page_bytes * 8;
+// allocation hints are byte offsets, offset 0 is a valid one
+static const uint64_t no_hint = ~uint64_t(0);
 
 inline size_t find_next_set_bit(slot_t slot_val, size_t start_pos)
 {
@@ -80,40 +238,289 @@ inline size_t find_next_set_bit(slot_t slot_val, size_t start_pos)
   return start_pos;
 }
 
+// bits [from, to) of a slot, from < to <= bits_per_slot
+inline slot_t slot_range_mask(size_t from, size_t to)
+{
+  return (all_slot_set << from) & (all_slot_set >> (bits_per_slot - to));
+}
 
-class AllocatorLevel
+// Range updates over bitmaps: bits [pos, pos_end) are handled with
+// at most two masked updates of the boundary slots and whole slot
+// fills in between.
+inline void set_bit_range(slot_t* v, uint64_t pos, uint64_t pos_end)
 {
-protected:
+  if (pos >= pos_end) {
+    return;
+  }
+  auto idx = pos / bits_per_slot;
+  auto idx_last = (pos_end - 1) / bits_per_slot;
+  auto head = all_slot_set << (pos % bits_per_slot);
+  auto tail = all_slot_set >> (bits_per_slot - 1 - (pos_end - 1) % bits_per_slot);
+  if (idx == idx_last) {
+    v[idx] |= head & tail;
+    return;
+  }
+  v[idx] |= head;
+  std::fill(v + idx + 1, v + idx_last, all_slot_set);
+  v[idx_last] |= tail;
+}
+inline void clear_bit_range(slot_t* v, uint64_t pos, uint64_t pos_end)
+{
+  if (pos >= pos_end) {
+    return;
+  }
+  auto idx = pos / bits_per_slot;
+  auto idx_last = (pos_end - 1) / bits_per_slot;
+  auto head = all_slot_set << (pos % bits_per_slot);
+  auto tail = all_slot_set >> (bits_per_slot - 1 - (pos_end - 1) % bits_per_slot);
+  if (idx == idx_last) {
+    v[idx] &= ~(head & tail);
+    return;
+  }
+  v[idx] &= ~head;
+  std::fill(v + idx + 1, v + idx_last, all_slot_clear);
+  v[idx_last] &= ~tail;
+}
+// replaces bits [from, to) of the slot with the ones from 'bits'
+inline void assign_bit_range(slot_t* v, size_t from, size_t to, slot_t bits)
+{
+  auto mask = slot_range_mask(from, to);
+  *v = (*v & ~mask) | (bits & mask);
+}
+
+// stable per-thread value to pick thread's home magazine/shard with
+inline size_t get_thread_hash()
+{
+  static thread_local size_t thread_hash =
+    std::hash<std::thread::id>()(std::this_thread::get_id());
+  return thread_hash;
+}
 
-  virtual uint64_t _children_per_slot() const = 0;
-  virtual uint64_t _level_granularity() const = 0;
+// atomic accessors for bitmap words shared with lock-free paths
+inline slot_t slot_load_atomic(const slot_t* p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+inline bool slot_cas_atomic(slot_t* p, slot_t* expected, slot_t desired)
+{
+  return __atomic_compare_exchange_n(p, expected, desired, false,
+    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+inline void slot_or_atomic(slot_t* p, slot_t bits)
+{
+  __atomic_fetch_or(p, bits, __ATOMIC_RELEASE);
+}
+
+// counters modified under a lock but read without it: a relaxed
+// load and store is enough, no need for a locked read-modify-write
+template <class T>
+inline void counter_add(std::atomic<T>& c,
+  typename std::atomic<T>::value_type v)
+{
+  c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+template <class T>
+inline void counter_sub(std::atomic<T>& c,
+  typename std::atomic<T>::value_type v)
+{
+  c.store(c.load(std::memory_order_relaxed) - v, std::memory_order_relaxed);
+}
+
+// Power of 2 space per bitmap entry. Keeps the log2 too, hence converting
+// offsets to positions shifts rather than takes a runtime divide.
+struct granularity_t
+{
+  uint64_t value = 0;
+  unsigned shift = 0;
+
+  granularity_t& operator=(uint64_t v)
+  {
+    ceph_assert(v == 0 || isp2(v));
+    value = v;
+    shift = v ? __builtin_ctzll(v) : 0;
+    return *this;
+  }
+  operator uint64_t() const
+  {
+    return value;
+  }
+};
+template <class T,
+  typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+inline T operator/(T v, const granularity_t& g)
+{
+  return T(uint64_t(v) >> g.shift);
+}
+template <class T,
+  typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+inline T operator%(T v, const granularity_t& g)
+{
+  return T(uint64_t(v) & (g.value - 1));
+}
 
+// Level geometry (children per slot, entry encoding) is a compile time
+// constant of every level class and isn't dispatched through this base,
+// virtuals are left for stats collection only.
+class AllocatorLevel
+{
 public:
-  static uint64_t l0_dives;
-  static uint64_t l0_iterations;
-  static uint64_t l0_inner_iterations;
-  static uint64_t alloc_fragments;
-  static uint64_t alloc_fragments_fast;
-  static uint64_t l2_allocs;
+  // instrumentation counters, kept per level object, see add_counters
+  enum {
+    CNT_L0_DIVES,
+    CNT_L0_ITERATIONS,
+    CNT_L0_INNER_ITERATIONS,
+    CNT_ALLOC_FRAGMENTS,
+    CNT_ALLOC_FRAGMENTS_FAST,
+    CNT_L2_ALLOCS,
+    CNT_ALLOC_LATENCY, // log2(nanoseconds) histograms
+    CNT_FREE_LATENCY = CNT_ALLOC_LATENCY + 64,
+    CNT_MAX = CNT_FREE_LATENCY + 64,
+  };
+  struct stats_t
+  {
+    uint64_t counters[CNT_MAX] = { 0 };
+
+    uint64_t operator[](size_t cnt) const {
+      return counters[cnt];
+    }
+    uint64_t get_calls(size_t latency_cnt) const;
+    // latency in nanoseconds which q (0..1) of the calls don't exceed,
+    // interpolated within the power-of-two histogram bin
+    uint64_t get_percentile(size_t latency_cnt, double q) const;
+  };
+  // Every thread updates its own block of the level's counters only,
+  // hence no contention and no atomic RMW on hot paths, readers sum
+  // them up. Blocks of exited threads are kept with the level.
+  struct alignas(64) thread_counters_t
+  {
+    std::atomic<uint64_t> v[CNT_MAX];
+
+    thread_counters_t();
+  };
+  thread_counters_t& get_thread_counters()
+  {
+    // blocks used by the thread are cached per id modulo cache size.
+    // Levels of an allocator (L2 and its L1, shards) get consecutive
+    // ids, hence don't evict each other while alternating.
+    struct cached_t {
+      uint64_t id = 0;
+      thread_counters_t* counters = nullptr;
+    };
+    static thread_local cached_t cache[COUNTERS_CACHE_SIZE];
+    auto& c = cache[counters_id % COUNTERS_CACHE_SIZE];
+    if (c.id != counters_id) {
+      c.counters = &_lookup_thread_counters();
+      c.id = counters_id;
+    }
+    return *c.counters;
+  }
+  static void add_counter(thread_counters_t& c, size_t cnt, uint64_t n)
+  {
+    c.v[cnt].store(c.v[cnt].load(std::memory_order_relaxed) + n,
+      std::memory_order_relaxed);
+  }
+  void inc_counter(size_t cnt)
+  {
+    add_counter(get_thread_counters(), cnt, 1);
+  }
+  // latency_cnt is either CNT_ALLOC_LATENCY or CNT_FREE_LATENCY
+  void note_latency(size_t latency_cnt, uint64_t nsec)
+  {
+    inc_counter(latency_cnt + (nsec ? cbits(nsec) - 1 : 0));
+  }
+  // adds up the counters of this level and the ones it consists of
+  virtual void add_counters(stats_t* res) const;
+  void collect_counters(stats_t* res) const
+  {
+    *res = stats_t();
+    add_counters(res);
+  }
+  // latencies are tracked by the callers, see latency_timer_t
+  std::atomic<bool> latency_stats = { false };
+
+  // bitmap scan kernels in use, detected via CPUID at startup;
+  // can be lowered (e.g. to SIMD_NONE) to force the scalar code
+  enum {
+    SIMD_NONE,
+    SIMD_AVX2,
+    SIMD_AVX512,
+  };
+  static int simd_level;
+  static int detect_simd_level();
 
+  AllocatorLevel() : counters_id(++last_counters_id)
+  {}
   virtual ~AllocatorLevel()
   {}
 
   virtual void collect_stats(
     std::map<size_t, size_t>& bins_overall) = 0;
 
+private:
+  static constexpr size_t COUNTERS_CACHE_SIZE = 8;
+  // unlike the address it's never reused, hence threads' cached
+  // lookups of destroyed levels can't hit
+  static std::atomic<uint64_t> last_counters_id;
+  const uint64_t counters_id;
+  mutable std::mutex counters_lock;
+  std::vector<std::unique_ptr<thread_counters_t>> counters;
+
+  thread_counters_t& _lookup_thread_counters();
+};
+
+// feeds the scope duration to the given latency histogram of the level
+// when its latency_stats is on
+class latency_timer_t
+{
+  AllocatorLevel& level;
+  size_t cnt;
+  bool active;
+  std::chrono::steady_clock::time_point start;
+public:
+  latency_timer_t(AllocatorLevel& _level, size_t _cnt) :
+    level(_level), cnt(_cnt),
+    active(level.latency_stats.load(std::memory_order_relaxed))
+  {
+    if (active) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+  ~latency_timer_t()
+  {
+    if (active) {
+      level.note_latency(cnt,
+	std::chrono::duration_cast<std::chrono::nanoseconds>(
+	  std::chrono::steady_clock::now() - start).count());
+    }
+  }
 };
 
 class AllocatorLevel01 : public AllocatorLevel
 {
 protected:
+  enum {
+    CHILD_PER_SLOT_L0 = bits_per_slot, // 64
+  };
   slot_vector_t l0; // set bit means free entry
   slot_vector_t l1;
-  uint64_t l0_granularity = 0; // space per entry
-  uint64_t l1_granularity = 0; // space per entry
-
-  size_t partial_l1_count = 0;
-  size_t unalloc_l1_count = 0;
+  // bit per L0 snapshot page modified since the last full snapshot
+  slot_vector_t l0_dirty;
+  granularity_t l0_granularity; // space per entry
+  granularity_t l1_granularity; // space per entry
+
+  // updated under the allocator lock, read without it
+  std::atomic<size_t> partial_l1_count = { 0 };
+  std::atomic<size_t> unalloc_l1_count = { 0 };
+
+  // Histogram of free L0 runs maintained incrementally by _allocate_l0 and
+  // L1 flavors' mark functions. Runs are split at slotset boundaries,
+  // bin N counts runs of [2^N, 2^(N+1)) entries. Slotsets claimed for
+  // lock-free access aren't accounted. Updated under the allocator lock,
+  // read without it.
+  enum {
+    FREE_BINS = 10, // up to bits_per_slotset long runs
+  };
+  std::atomic<uint64_t> free_bins[FREE_BINS] = {};
 
   double get_fragmentation() const {
     double res = 0.0;
@@ -124,7 +531,7 @@ protected:
     return res;
   }
 
-  uint64_t _level_granularity() const override
+  uint64_t _level_granularity() const
   {
     return l1_granularity;
   }
@@ -132,35 +539,19 @@ protected:
   inline bool _is_slot_fully_allocated(uint64_t idx) const {
     return l1[idx] == all_slot_clear;
   }
-public:
-  inline uint64_t get_min_alloc_size() const
-  {
-    return l0_granularity;
-  }
-};
-
-template <class T>
-class AllocatorLevel02;
 
-class AllocatorLevel01Loose : public AllocatorLevel01
-{
-  enum {
-    L1_ENTRY_WIDTH = 2,
-    L1_ENTRY_MASK = (1 << L1_ENTRY_WIDTH) - 1,
-    L1_ENTRY_FULL = 0x00,
-    L1_ENTRY_PARTIAL = 0x01,
-    L1_ENTRY_NOT_USED = 0x02,
-    L1_ENTRY_FREE = 0x03,
-    CHILD_PER_SLOT = bits_per_slot / L1_ENTRY_WIDTH, // 32
-    CHILD_PER_SLOT_L0 = bits_per_slot, // 64
-  };
-  uint64_t _children_per_slot() const override
-  {
-    return CHILD_PER_SLOT;
-  }
+  // Helpers below operate on L0 bitmap only and are shared by all
+  // L1 flavors, L1 state is maintained by the callers.
 
   interval_t _get_longest_from_l0(uint64_t pos0, uint64_t pos1,
     uint64_t min_length, interval_t* tail) const;
+  interval_t _get_longest_from_l0_simd(uint64_t pos0, uint64_t pos1,
+    uint64_t min_length, interval_t* tail) const;
+  // updates 'best' with the shortest free run within L0 [pos0, pos1)
+  // holding 'length' once aligned to 'min_length'. Returns true on
+  // an exact match.
+  bool _get_tightest_from_l0(uint64_t pos0, uint64_t pos1,
+    uint64_t length, uint64_t min_length, interval_t* best) const;
 
   inline void _fragment_and_emplace(uint64_t max_length, uint64_t offset,
     uint64_t len,
@@ -203,8 +594,10 @@ class AllocatorLevel01Loose : public AllocatorLevel01
     interval_vector_t* res)
   {
     uint64_t d0 = CHILD_PER_SLOT_L0;
-
-    ++l0_dives;
+    // flushed to the thread's counters once done
+    uint64_t iterations = 0;
+    uint64_t inner_iterations = 0;
+    uint64_t fragments = 0;
 
     ceph_assert(l0_pos0 < l0_pos1);
     ceph_assert(length > *allocated);
@@ -213,10 +606,11 @@ class AllocatorLevel01Loose : public AllocatorLevel01
     ceph_assert(((length - *allocated) % l0_granularity) == 0);
 
     uint64_t need_entries = (length - *allocated) / l0_granularity;
+    _update_free_bins(l0_pos0, l0_pos1, -1);
 
     for (auto idx = l0_pos0 / d0; (idx < l0_pos1 / d0) && (length > *allocated);
       ++idx) {
-      ++l0_iterations;
+      ++iterations;
       slot_t& slot_val = l0[idx];
       auto base = idx * d0;
       if (slot_val == all_slot_clear) {
@@ -224,7 +618,7 @@ class AllocatorLevel01Loose : public AllocatorLevel01
       } else if (slot_val == all_slot_set) {
         uint64_t to_alloc = std::min(need_entries, d0);
         *allocated += to_alloc * l0_granularity;
-	++alloc_fragments;
+	++fragments;
         need_entries -= to_alloc;
 
 	_fragment_and_emplace(max_length, base * l0_granularity,
@@ -232,6 +626,11 @@ class AllocatorLevel01Loose : public AllocatorLevel01
 
         if (to_alloc == d0) {
           slot_val = all_slot_clear;
+	  _mark_dirty_l0(base, base + d0);
+	  _invalidate_runs(base, base + d0);
+	  if (free_index) {
+	    _index_mark_alloc(base, base + d0);
+	  }
         } else {
           _mark_alloc_l0(base, base + to_alloc);
         }
@@ -243,12 +642,12 @@ class AllocatorLevel01Loose : public AllocatorLevel01
       auto next_pos = free_pos + 1;
       while (next_pos < bits_per_slot &&
         (next_pos - free_pos) < need_entries) {
-	++l0_inner_iterations;
+	++inner_iterations;
 
         if (0 == (slot_val & (slot_t(1) << next_pos))) {
           auto to_alloc = (next_pos - free_pos);
           *allocated += to_alloc * l0_granularity;
-	  ++alloc_fragments;
+	  ++fragments;
           need_entries -= to_alloc;
 	  _fragment_and_emplace(max_length, (base + free_pos) * l0_granularity,
 	    to_alloc * l0_granularity, res);
@@ -262,135 +661,32 @@ class AllocatorLevel01Loose : public AllocatorLevel01
       if (need_entries && free_pos < bits_per_slot) {
         auto to_alloc = std::min(need_entries, d0 - free_pos);
         *allocated += to_alloc * l0_granularity;
-	++alloc_fragments;
+	++fragments;
 	need_entries -= to_alloc;
 	_fragment_and_emplace(max_length, (base + free_pos) * l0_granularity,
 	  to_alloc * l0_granularity, res);
         _mark_alloc_l0(base + free_pos, base + free_pos + to_alloc);
       }
     }
+    _update_free_bins(l0_pos0, l0_pos1, 1);
+    auto& c = get_thread_counters();
+    add_counter(c, CNT_L0_DIVES, 1);
+    add_counter(c, CNT_L0_ITERATIONS, iterations);
+    add_counter(c, CNT_L0_INNER_ITERATIONS, inner_iterations);
+    add_counter(c, CNT_ALLOC_FRAGMENTS, fragments);
     return _is_empty_l0(l0_pos0, l0_pos1);
   }
 
-protected:
-
-  friend class AllocatorLevel02<AllocatorLevel01Loose>;
-
-  void _init(uint64_t capacity, uint64_t _alloc_unit, bool mark_as_free = true)
-  {
-    l0_granularity = _alloc_unit;
-    // 512 bits at L0 mapped to L1 entry
-    l1_granularity = l0_granularity * bits_per_slotset;
-
-    // capacity to have slot alignment at l1
-    auto aligned_capacity =
-      p2roundup((int64_t)capacity,
-        int64_t(l1_granularity * slotset_width * _children_per_slot()));
-    size_t slot_count =
-      aligned_capacity / l1_granularity / _children_per_slot();
-    // we use set bit(s) as a marker for (partially) free entry
-    l1.resize(slot_count, mark_as_free ? all_slot_set : all_slot_clear);
-
-    // l0 slot count
-    size_t slot_count_l0 = aligned_capacity / _alloc_unit / bits_per_slot;
-    // we use set bit(s) as a marker for (partially) free entry
-    l0.resize(slot_count_l0, mark_as_free ? all_slot_set : all_slot_clear);
-
-    partial_l1_count = unalloc_l1_count = 0;
-    if (mark_as_free) {
-      unalloc_l1_count = slot_count * _children_per_slot();
-      auto l0_pos_no_use = p2roundup((int64_t)capacity, (int64_t)l0_granularity) / l0_granularity;
-      auto l0_pos_end = aligned_capacity / l0_granularity;
-      if (l0_pos_end > l0_pos_no_use) {
-        _mark_alloc_l1_l0(l0_pos_no_use, l0_pos_end);
-      }
-    }
-  }
-  void _shutdown()
-  {
-    l0_granularity = 0;
-    l1_granularity = 0;
-
-    l1.clear();
-    l0.clear();
-
-    partial_l1_count = unalloc_l1_count = 0;
-  }
-
-  struct search_ctx_t
-  {
-    size_t partial_count = 0;
-    size_t free_count = 0;
-    uint64_t free_l1_pos = 0;
-
-    uint64_t min_affordable_len = 0;
-    uint64_t min_affordable_offs = 0;
-    uint64_t affordable_len = 0;
-    uint64_t affordable_offs = 0;
-
-    bool fully_processed = false;
-
-    void reset()
-    {
-      *this = search_ctx_t();
-    }
-  };
-  enum {
-    NO_STOP,
-    STOP_ON_EMPTY,
-    STOP_ON_PARTIAL,
-  };
-  void _analyze_partials(uint64_t pos_start, uint64_t pos_end,
-    uint64_t length, uint64_t min_length, int mode,
-    search_ctx_t* ctx);
-
-  void _mark_l1_on_l0(int64_t l0_pos, int64_t l0_pos_end);
   void _mark_alloc_l0(int64_t l0_pos_start, int64_t l0_pos_end);
 
-  void _mark_alloc_l1_l0(int64_t l0_pos_start, int64_t l0_pos_end)
-  {
-    _mark_alloc_l0(l0_pos_start, l0_pos_end);
-    l0_pos_start = p2align(l0_pos_start, int64_t(bits_per_slotset));
-    l0_pos_end = p2roundup(l0_pos_end, int64_t(bits_per_slotset));
-    _mark_l1_on_l0(l0_pos_start, l0_pos_end);
-  }
-
   void _mark_free_l0(int64_t l0_pos_start, int64_t l0_pos_end)
   {
-    auto d0 = CHILD_PER_SLOT_L0;
-
-    auto pos = l0_pos_start;
-    slot_t bits = (slot_t)1 << (l0_pos_start % d0);
-    slot_t* val_s = &l0[pos / d0];
-    int64_t round_val = p2roundup<int64_t>(l0_pos_start + 1, d0);
-    int64_t pos_e = std::min(l0_pos_end,
-                             round_val);
-    while (pos < pos_e) {
-      *val_s |=  bits;
-      bits <<= 1;
-      pos++;
-    }
-    int64_t align_val = p2align<int64_t>(l0_pos_end, d0);
-    pos_e = std::min(l0_pos_end, align_val);
-    while (pos < pos_e) {
-      *(++val_s) = all_slot_set;
-      pos += d0;
+    _mark_dirty_l0(l0_pos_start, l0_pos_end);
+    _invalidate_runs(l0_pos_start, l0_pos_end);
+    if (free_index) {
+      _index_mark_free(l0_pos_start, l0_pos_end);
     }
-    bits = 1;
-    ++val_s;
-    while (pos < l0_pos_end) {
-      *val_s |= bits;
-      bits <<= 1;
-      pos++;
-    }
-  }
-
-  void _mark_free_l1_l0(int64_t l0_pos_start, int64_t l0_pos_end)
-  {
-    _mark_free_l0(l0_pos_start, l0_pos_end);
-    l0_pos_start = p2align(l0_pos_start, int64_t(bits_per_slotset));
-    l0_pos_end = p2roundup(l0_pos_end, int64_t(bits_per_slotset));
-    _mark_l1_on_l0(l0_pos_start, l0_pos_end);
+    set_bit_range(l0.data(), l0_pos_start, l0_pos_end);
   }
 
   bool _is_empty_l0(uint64_t l0_pos, uint64_t l0_pos_end)
@@ -408,63 +704,358 @@ protected:
     }
     return no_free;
   }
-  bool _is_empty_l1(uint64_t l1_pos, uint64_t l1_pos_end)
-  {
-    bool no_free = true;
-    uint64_t d = slotset_width * _children_per_slot();
-    ceph_assert(0 == (l1_pos % d));
-    ceph_assert(0 == (l1_pos_end % d));
 
-    auto idx = l1_pos / CHILD_PER_SLOT;
-    auto idx_end = l1_pos_end / CHILD_PER_SLOT;
-    while (idx < idx_end && no_free) {
-      no_free = _is_slot_fully_allocated(idx);
-      ++idx;
+  uint64_t _count_free_l0(uint64_t l1_pos) const
+  {
+    uint64_t res = 0;
+    for (auto idx = l1_pos * slotset_width; idx < (l1_pos + 1) * slotset_width;
+      ++idx) {
+      res += __builtin_popcountll(slot_load_atomic(&l0[idx]));
     }
-    return no_free;
+    return res;
+  }
+  bool _allocate_l0_atomic(uint64_t l1_pos, uint64_t* l0_pos)
+  {
+    for (auto idx = l1_pos * slotset_width; idx < (l1_pos + 1) * slotset_width;
+      ++idx) {
+      slot_t* p = &l0[idx];
+      slot_t v = slot_load_atomic(p);
+      while (v != all_slot_clear) {
+	auto bit = __builtin_ctzll(v);
+	if (slot_cas_atomic(p, &v, v & ~(slot_t(1) << bit))) {
+	  *l0_pos = idx * CHILD_PER_SLOT_L0 + bit;
+	  return true;
+	}
+      }
+    }
+    return false;
+  }
+  void _free_l0_atomic(uint64_t l0_pos)
+  {
+    slot_or_atomic(&l0[l0_pos / CHILD_PER_SLOT_L0],
+      slot_t(1) << (l0_pos % CHILD_PER_SLOT_L0));
   }
 
-  interval_t _allocate_l1_contiguous(uint64_t length,
-    uint64_t min_length, uint64_t max_length,
-    uint64_t pos_start, uint64_t pos_end);
-
-  bool _allocate_l1(uint64_t length,
-    uint64_t min_length, uint64_t max_length,
-    uint64_t l1_pos_start, uint64_t l1_pos_end,
-    uint64_t* allocated,
-    interval_vector_t* res);
+  void _init_dirty_l0()
+  {
+    l0_dirty.assign(
+      div_round_up(get_snapshot_page_count(), bits_per_slot), all_slot_clear);
+  }
+  void _mark_dirty_l0(uint64_t l0_pos, uint64_t l0_pos_end)
+  {
+    set_bit_range(l0_dirty.data(), l0_pos / bits_per_snapshot_page,
+      div_round_up(l0_pos_end, bits_per_snapshot_page));
+  }
+  void _clear_dirty_l0()
+  {
+    std::fill(l0_dirty.begin(), l0_dirty.end(), all_slot_clear);
+  }
 
-  uint64_t _mark_alloc_l1(uint64_t offset, uint64_t length)
+  // adds free runs of slotsets within the range to the bins
+  void _count_free_runs(uint64_t l0_pos, uint64_t l0_pos_end,
+    uint64_t* bins) const;
+  void _reset_free_bins(bool all_free)
   {
-    uint64_t l0_pos_start = offset / l0_granularity;
-    uint64_t l0_pos_end = p2roundup(offset + length, l0_granularity) / l0_granularity;
-    _mark_alloc_l1_l0(l0_pos_start, l0_pos_end);
-    return l0_granularity * (l0_pos_end - l0_pos_start);
+    for (auto& b : free_bins) {
+      b.store(0, std::memory_order_relaxed);
+    }
+    if (all_free) {
+      free_bins[FREE_BINS - 1].store(l0.size() / slotset_width,
+	std::memory_order_relaxed);
+    }
+  }
+  // adds (sign > 0) or removes free runs of slotsets overlapping the range
+  void _update_free_bins(uint64_t l0_pos, uint64_t l0_pos_end, int sign)
+  {
+    uint64_t bins[FREE_BINS] = { 0 };
+    _count_free_runs(p2align<uint64_t>(l0_pos, bits_per_slotset),
+      p2roundup<uint64_t>(l0_pos_end, bits_per_slotset), bins);
+    for (size_t i = 0; i < FREE_BINS; ++i) {
+      if (bins[i]) {
+	auto v = free_bins[i].load(std::memory_order_relaxed);
+	free_bins[i].store(sign > 0 ? v + bins[i] : v - bins[i],
+	  std::memory_order_relaxed);
+      }
+    }
+  }
+  // copies L0 page from the snapshot and marks it dirty,
+  // returns its L0 position range, L1 to be updated by the caller
+  std::pair<uint64_t, uint64_t> _load_snapshot_page(const bufferlist& source,
+    uint64_t offset, uint64_t page)
+  {
+    auto bytes = std::min(snapshot_page_bytes,
+      get_snapshot_size() - page * snapshot_page_bytes);
+    auto l0_pos = page * bits_per_snapshot_page;
+    auto l0_pos_end = l0_pos + bytes * 8;
+    _update_free_bins(l0_pos, l0_pos_end, -1);
+    bufferlist_copy_out(source, offset,
+      (uint8_t*)&l0.at(0) + page * snapshot_page_bytes, bytes);
+    _update_free_bins(l0_pos, l0_pos_end, 1);
+    _mark_dirty_l0(l0_pos, l0_pos_end);
+    _invalidate_runs(l0_pos, l0_pos_end);
+    return std::make_pair(l0_pos, l0_pos_end);
   }
 
-  uint64_t _free_l1(uint64_t offs, uint64_t len)
+  // Optional index of free L0 runs bucketed by log2 of their length.
+  // Maintained by _mark_alloc_l0/_mark_free_l0 and lets contiguous
+  // allocations pick a fitting run without scanning partial L1 entries.
+  // Entries claimed for lock-free access are excluded.
+  struct free_index_t
   {
-    uint64_t l0_pos_start = offs / l0_granularity;
-    uint64_t l0_pos_end = p2roundup(offs + len, l0_granularity) / l0_granularity;
-    _mark_free_l1_l0(l0_pos_start, l0_pos_end);
-    return l0_granularity * (l0_pos_end - l0_pos_start);
+    enum {
+      // max runs to check in a bucket which might have no fit
+      MAX_PROBES = 16,
+    };
+    std::map<uint64_t, uint64_t> runs; // l0 pos -> length
+    std::set<std::pair<uint64_t, uint64_t>> buckets[bits_per_slot];
+
+    static size_t bucket(uint64_t len) {
+      return bits_per_slot - 1 - __builtin_clzll(len);
+    }
+    void insert(uint64_t pos, uint64_t len) {
+      runs.emplace(pos, len);
+      buckets[bucket(len)].emplace(pos, len);
+    }
+    std::map<uint64_t, uint64_t>::iterator erase(
+      std::map<uint64_t, uint64_t>::iterator it) {
+      buckets[bucket(it->second)].erase(std::make_pair(it->first, it->second));
+      return runs.erase(it);
+    }
+  };
+  std::unique_ptr<free_index_t> free_index;
+
+  bool _has_free_index() const
+  {
+    return !!free_index;
   }
+  // adds free runs within the range to the index
+  void _index_add(uint64_t l0_pos, uint64_t l0_pos_end);
+  void _index_mark_alloc(uint64_t l0_pos, uint64_t l0_pos_end);
+  void _index_mark_free(uint64_t l0_pos, uint64_t l0_pos_end);
+  // resyncs the range with L0 bitmap
+  void _index_refresh(uint64_t l0_pos, uint64_t l0_pos_end);
+  // looks up a run for an extent aligned to 'align' L0 entries,
+  // of 'len' entries if possible or the longest one available
+  // (but not shorter than 'align') unless 'exact' otherwise.
+  // Returns L0 position/length and doesn't mark anything. 'conclusive'
+  // is reset if a fit might have been missed due to probe limit.
+  interval_t _index_find(uint64_t len, uint64_t align, bool* conclusive,
+    bool exact = false);
+
+  // Optional per L1 entry (slotset) summary of free L0 runs, lengths are
+  // in L0 entries. Entries are invalidated on L0 updates and recalculated
+  // on demand, partial scans use them to skip slotsets which can't
+  // satisfy the request without touching L0.
+  enum {
+    RUN_UNKNOWN = 0xffff,
+  };
+  struct run_summary_t
+  {
+    uint16_t head = 0; // free entries at the beginning
+    uint16_t tail = 0; // free entries at the end
+    uint16_t longest = RUN_UNKNOWN;
+  };
+  std::vector<run_summary_t> run_cache;
 
-public:
-  uint64_t debug_get_allocated(uint64_t pos0 = 0, uint64_t pos1 = 0)
+  bool _has_run_cache() const
   {
-    if (pos1 == 0) {
-      pos1 = l1.size() * CHILD_PER_SLOT;
+    return !run_cache.empty();
+  }
+  void _invalidate_runs(uint64_t l0_pos, uint64_t l0_pos_end)
+  {
+    if (run_cache.empty()) {
+      return;
     }
-    auto avail = debug_get_free(pos0, pos1);
-    return (pos1 - pos0) * l1_granularity - avail;
+    auto l1_pos_end = div_round_up(l0_pos_end, bits_per_slotset);
+    for (auto l1_pos = l0_pos / bits_per_slotset; l1_pos < l1_pos_end;
+	 ++l1_pos) {
+      run_cache[l1_pos].longest = RUN_UNKNOWN;
+    }
+  }
+  void _reset_run_cache()
+  {
+    std::fill(run_cache.begin(), run_cache.end(), run_summary_t());
+  }
+  void _enable_run_cache(bool enable)
+  {
+    if (!enable) {
+      run_cache.clear();
+      run_cache.shrink_to_fit();
+    } else if (run_cache.empty()) {
+      run_cache.resize(l0.size() / slotset_width);
+    }
+  }
+  void _calc_runs(uint64_t l1_pos);
+  // upper bound (in bytes, prior to alignment) of the longest run
+  // _get_longest_from_l0 may return for the L1 entry given the previous
+  // entry's tail. 'tail' receives the one to pass to the next entry.
+  uint64_t _get_longest_bound(uint64_t l1_pos, const interval_t& prev_tail,
+    interval_t* tail)
+  {
+    auto& r = run_cache[l1_pos];
+    if (r.longest == RUN_UNKNOWN) {
+      _calc_runs(l1_pos);
+    }
+    uint64_t head = r.head * l0_granularity;
+    uint64_t bound = std::max(r.longest * l0_granularity,
+      prev_tail.length + head);
+    if (r.head == bits_per_slotset) {
+      *tail = prev_tail.length ?
+	interval_t(prev_tail.offset, prev_tail.length + head) :
+	interval_t(l1_pos * l1_granularity, head);
+    } else if (r.tail) {
+      *tail = interval_t((l1_pos + 1) * l1_granularity -
+	r.tail * l0_granularity, r.tail * l0_granularity);
+    } else {
+      *tail = interval_t();
+    }
+    return bound;
   }
 
-  uint64_t debug_get_free(uint64_t l1_pos0 = 0, uint64_t l1_pos1 = 0)
+  // Compressed snapshot is a sequence of 64-bit run headers: two upper bits
+  // give the run type and the rest its length in L0 slots. Mixed runs are
+  // followed by their slots verbatim.
+  enum {
+    SNAPSHOT_RUN_CLEAR = 0,
+    SNAPSHOT_RUN_SET = 1,
+    SNAPSHOT_RUN_MIXED = 2,
+  };
+  static const uint64_t snapshot_run_shift = 62;
+  static const uint64_t snapshot_run_len_mask =
+    (uint64_t(1) << snapshot_run_shift) - 1;
+
+  // invokes fn(header, mixed slots or nullptr) for every run
+  template <class Func>
+  void _encode_l0(Func fn) const
+  {
+    size_t end = l0.size();
+    // single uniform slot is cheaper to keep within a mixed run
+    auto uniform_run = [&](size_t pos) {
+      return pos + 1 < end && l0[pos] == l0[pos + 1] &&
+        (l0[pos] == all_slot_clear || l0[pos] == all_slot_set);
+    };
+    size_t i = 0;
+    while (i < end) {
+      size_t j = i + 1;
+      if (uniform_run(i)) {
+        while (j < end && l0[j] == l0[i]) {
+          ++j;
+        }
+        uint64_t type = l0[i] == all_slot_set ?
+          SNAPSHOT_RUN_SET : SNAPSHOT_RUN_CLEAR;
+        fn((type << snapshot_run_shift) | (j - i), nullptr);
+      } else {
+        while (j < end && !uniform_run(j)) {
+          ++j;
+        }
+        fn((uint64_t(SNAPSHOT_RUN_MIXED) << snapshot_run_shift) | (j - i),
+          &l0[i]);
+      }
+      i = j;
+    }
+  }
+  // walks run headers of the compressed snapshot, returns its size and
+  // the run (L0 slot, stream offset) each apply chunk starts within
+  uint64_t _scan_compressed_snapshot(const bufferlist& source,
+    uint64_t offset,
+    std::vector<std::pair<uint64_t, uint64_t>>* chunk_runs)
+  {
+    bufferlist_cursor c(source, offset);
+    uint64_t res = 0;
+    size_t i = 0;
+    while (i < l0.size()) {
+      uint64_t h;
+      auto r = c.copy_out(&h, sizeof(h));
+      ceph_assert(r == sizeof(h));
+      auto n = h & snapshot_run_len_mask;
+      ceph_assert(n && i + n <= l0.size());
+      while (chunk_runs->size() * apply_chunk_slots < i + n) {
+        chunk_runs->emplace_back(i, offset + res);
+      }
+      res += r;
+      if ((h >> snapshot_run_shift) == SNAPSHOT_RUN_MIXED) {
+        r = c.skip(n * sizeof(slot_t));
+        ceph_assert(r == n * sizeof(slot_t));
+        res += r;
+      }
+      i += n;
+    }
+    return res;
+  }
+  // decodes L0 slots [begin, end) starting from the run at the given
+  // L0 slot and stream offset
+  void _load_compressed_range(const bufferlist& source,
+    const std::pair<uint64_t, uint64_t>& run,
+    uint64_t begin, uint64_t end)
+  {
+    bufferlist_cursor c(source, run.second);
+    auto i = run.first;
+    while (i < end) {
+      uint64_t h;
+      c.copy_out(&h, sizeof(h));
+      auto n = h & snapshot_run_len_mask;
+      auto b = std::max(i, begin);
+      auto e = std::min(i + n, end);
+      switch (h >> snapshot_run_shift) {
+      case SNAPSHOT_RUN_CLEAR:
+        std::fill(l0.begin() + b, l0.begin() + e, all_slot_clear);
+        break;
+      case SNAPSHOT_RUN_SET:
+        std::fill(l0.begin() + b, l0.begin() + e, all_slot_set);
+        break;
+      default:
+        c.skip((b - i) * sizeof(slot_t));
+        c.copy_out(&l0[b], (e - b) * sizeof(slot_t));
+        c.skip((i + n - e) * sizeof(slot_t));
+      }
+      i += n;
+    }
+  }
+  // copies L0 slots [begin, end) from the snapshot,
+  // returns the amount of bytes copied
+  uint64_t _load_snapshot_range(const bufferlist& source, uint64_t offset,
+    uint64_t begin, uint64_t end)
+  {
+    bufferlist_cursor c(source, offset + begin * sizeof(slot_t));
+    return c.copy_out(&l0[begin], (end - begin) * sizeof(slot_t));
+  }
+
+  // Snapshot apply restores L0 and rebuilds L1 over it chunk by chunk,
+  // chunks are processed by up to 'threads' threads. Chunk size is
+  // a multiple of L2 entry size for both L1 flavors hence workers never
+  // share L1 words. load(slot_begin, slot_end) restores L0 range,
+  // mark(l0_pos, l0_pos_end) updates L1 over it.
+  static const uint64_t apply_chunk_slots = 32 * 1024; // 256 KiB of L0
+  template <class Load, class Mark>
+  void _apply_parallel(size_t threads, Load load, Mark mark)
+  {
+    _reset_free_bins(false);
+    parallel_for_ranges(l0.size(), apply_chunk_slots, threads,
+      [&](uint64_t begin, uint64_t end) {
+	load(begin, end);
+	mark(begin * bits_per_slot, end * bits_per_slot);
+	uint64_t bins[FREE_BINS] = { 0 };
+	_count_free_runs(begin * bits_per_slot, end * bits_per_slot, bins);
+	for (size_t i = 0; i < FREE_BINS; ++i) {
+	  free_bins[i] += bins[i];
+	}
+      });
+    _clear_dirty_l0();
+  }
+
+public:
+  inline granularity_t get_min_alloc_size() const
+  {
+    return l0_granularity;
+  }
+  uint64_t get_l1_bytes() const
   {
-    ceph_assert(0 == (l1_pos0 % CHILD_PER_SLOT));
-    ceph_assert(0 == (l1_pos1 % CHILD_PER_SLOT));
+    return l1.size() * sizeof(slot_t);
+  }
 
+  // positions are to be slot aligned at L1, see flavors' wrapper
+  uint64_t debug_get_free(uint64_t l1_pos0 = 0, uint64_t l1_pos1 = 0)
+  {
     auto idx0 = l1_pos0 * slotset_width;
     auto idx1 = l1_pos1 * slotset_width;
 
@@ -495,232 +1086,2121 @@ public:
   }
   void collect_stats(
     std::map<size_t, size_t>& bins_overall) override;
+  // constant time alternative to collect_stats, free runs are split
+  // at slotset boundaries though. Safe to call without the lock.
+  void collect_slotset_stats(std::map<size_t, size_t>& bins_overall) const
+  {
+    for (size_t i = 0; i < FREE_BINS; ++i) {
+      auto v = free_bins[i].load(std::memory_order_relaxed);
+      if (v) {
+	bins_overall[i] += v;
+      }
+    }
+  }
 
-  uint64_t get_snapshot_size() { return l0.size() * sizeof(slot_t); }
+  uint64_t get_snapshot_size() const { return l0.size() * sizeof(slot_t); }
   uint64_t take_snapshot(void* target, uint64_t size) {
     auto ret = std::min(size, get_snapshot_size());
     memcpy(target, &l0.at(0), ret);
+    _clear_dirty_l0();
     return ret * 8 * l0_granularity;
   }
-  uint64_t apply_snapshot(const void* from, uint64_t size) {
-    assert(size >= get_snapshot_size());
-    memcpy(&l0.at(0), from, get_snapshot_size());
-    _mark_l1_on_l0(0, l0.size() * slotset_width);
-
-  }
-  uint64_t take_snapshot(bufferlist& target) {
+  // offset denotes the position of this bitmap within the bufferlist,
+  // which permits multiple allocators to share a single snapshot
+  uint64_t take_snapshot(bufferlist& target, uint64_t offset = 0) {
     uint64_t captured_bytes = 0;
     auto snapshot_bytes = get_snapshot_size();
+    uint64_t pos = 0;
     for (auto b : target) {
-      auto to_copy = std::min(b.second,
-                              get_snapshot_size() - captured_bytes);
-      memcpy(b.first, &l0.at(captured_bytes / sizeof(slot_t)), to_copy);
-      captured_bytes += to_copy;
+      if (pos + b.second > offset && captured_bytes < snapshot_bytes) {
+        auto skip = offset > pos ? offset - pos : 0;
+        auto to_copy = std::min(b.second - skip,
+                                snapshot_bytes - captured_bytes);
+        memcpy(b.first + skip, (uint8_t*)&l0.at(0) + captured_bytes, to_copy);
+        captured_bytes += to_copy;
+      }
+      pos += b.second;
     }
+    _clear_dirty_l0();
     return captured_bytes * 8 * l0_granularity;
   }
-  uint64_t apply_snapshot(const bufferlist& source) {
-    uint64_t applied_bytes = 0;
-    auto snapshot_bytes = get_snapshot_size();
-    for (auto b : source) {
-      auto to_copy = std::min(b.second,
-                              get_snapshot_size() - applied_bytes);
-      memcpy(&l0.at(applied_bytes / sizeof(slot_t)), b.first, to_copy);
-      applied_bytes += to_copy;
-    }
-    _mark_l1_on_l0(0, l0.size() * slotset_width);
-    return applied_bytes * 8 * l0_granularity;
+
+  // compressed snapshots run-length encode uniform L0 slots
+  uint64_t get_compressed_snapshot_size() const
+  {
+    uint64_t res = 0;
+    _encode_l0([&](uint64_t h, const slot_t* mixed) {
+      res += sizeof(h);
+      if (mixed) {
+        res += (h & snapshot_run_len_mask) * sizeof(slot_t);
+      }
+    });
+    return res;
+  }
+  // returns the amount of bytes captured
+  uint64_t take_compressed_snapshot(bufferlist& target, uint64_t offset = 0)
+  {
+    bufferlist_cursor c(target, offset);
+    uint64_t res = 0;
+    _encode_l0([&](uint64_t h, const slot_t* mixed) {
+      res += c.copy_in(&h, sizeof(h));
+      if (mixed) {
+        res += c.copy_in(mixed, (h & snapshot_run_len_mask) * sizeof(slot_t));
+      }
+    });
+    _clear_dirty_l0();
+    return res;
   }
-};
 
-class AllocatorLevel01Compact : public AllocatorLevel01
-{
-  uint64_t _children_per_slot() const override
+  uint64_t get_snapshot_page_count() const
   {
-    return 8;
+    return div_round_up(get_snapshot_size(), snapshot_page_bytes);
   }
-public:
-  void collect_stats(
-    std::map<size_t, size_t>& bins_overall) override
+  size_t get_dirty_page_count() const
   {
-    // not implemented
+    size_t res = 0;
+    for (auto v : l0_dirty) {
+      res += __builtin_popcountll(v);
+    }
+    return res;
+  }
+  // captures up to max_pages dirty pages one after another into the target
+  // starting at offset, their numbers go to 'pages'. Returns page count.
+  size_t take_snapshot_pages(bufferlist& target, uint64_t offset,
+    uint64_t* pages, size_t max_pages)
+  {
+    size_t res = 0;
+    for (size_t i = 0; i < l0_dirty.size() && res < max_pages; ++i) {
+      slot_t v = l0_dirty[i];
+      while (v && res < max_pages) {
+	uint64_t page = i * bits_per_slot + __builtin_ctzll(v);
+	v &= v - 1;
+	auto bytes = std::min(snapshot_page_bytes,
+	  get_snapshot_size() - page * snapshot_page_bytes);
+	bufferlist_copy_in(target, offset + res * snapshot_page_bytes,
+	  (uint8_t*)&l0.at(0) + page * snapshot_page_bytes, bytes);
+	pages[res++] = page;
+      }
+    }
+    return res;
   }
 };
 
-template <class L1>
-class AllocatorLevel02 : public AllocatorLevel
+// CRTP base of L1 flavors: T::CHILD_PER_SLOT (L1 entries per slot) is
+// a compile time constant hence divisions and modulos by it as well as by
+// derived widths fold into shifts and masks.
+// Flavors provide the encoding specific parts only:
+//   _reset_l1(free_entries) - resets L1 entry counters, if any
+//   _mark_l1_on_l0(l0_pos, l0_pos_end) - updates L1 entries from L0
+//   _apply_l0(threads, load) - rebuilds L1 once L0 is loaded
+//   _index_build() - fills the free index in
+template <class T>
+class AllocatorLevel01Geometry : public AllocatorLevel01
 {
 protected:
-#ifdef NON_CEPH_BUILD
-  std::mutex lock;
-#else
-  ceph::mutex lock = ceph::make_mutex("AllocatorLevel02::lock");
-#endif
-public:
-  uint64_t debug_get_free(uint64_t pos0 = 0, uint64_t pos1 = 0)
+  static constexpr uint64_t _children_per_slot()
   {
-    std::lock_guard<std::mutex> l(lock);
-    return l1.debug_get_free(pos0 * l1._children_per_slot() * bits_per_slot,
-      pos1 * l1._children_per_slot() * bits_per_slot);
+    return T::CHILD_PER_SLOT;
   }
-  uint64_t debug_get_allocated(uint64_t pos0 = 0, uint64_t pos1 = 0)
+  T& _self()
   {
-    std::lock_guard<std::mutex> l(lock);
-    return l1.debug_get_allocated(pos0 * l1._children_per_slot() * bits_per_slot,
-      pos1 * l1._children_per_slot() * bits_per_slot);
+    return *static_cast<T*>(this);
   }
 
-  uint64_t get_alloc_count()
+  void _init(uint64_t capacity, uint64_t _alloc_unit, bool mark_as_free = true)
   {
-    std::lock_guard<std::mutex> l(lock);
-    return alloc_cnt;
+    l0_granularity = _alloc_unit;
+    // 512 bits at L0 mapped to L1 entry
+    l1_granularity = l0_granularity * bits_per_slotset;
+
+    auto aligned_capacity = _get_aligned_capacity(capacity);
+    size_t slot_count =
+      aligned_capacity / l1_granularity / _children_per_slot();
+    // we use set bit(s) as a marker for (partially) free entry
+    l1.resize(slot_count, mark_as_free ? all_slot_set : all_slot_clear);
+
+    // l0 slot count
+    size_t slot_count_l0 = aligned_capacity / _alloc_unit / bits_per_slot;
+    // we use set bit(s) as a marker for (partially) free entry
+    l0.resize(slot_count_l0, mark_as_free ? all_slot_set : all_slot_clear);
+    _init_dirty_l0();
+    _reset_free_bins(mark_as_free);
+
+    _self()._reset_l1(mark_as_free ? slot_count * _children_per_slot() : 0);
+    if (mark_as_free) {
+      auto l0_pos_no_use = p2roundup((int64_t)capacity, (int64_t)l0_granularity) / l0_granularity;
+      auto l0_pos_end = aligned_capacity / l0_granularity;
+      if (l0_pos_end > l0_pos_no_use) {
+        _mark_alloc_l1_l0(l0_pos_no_use, l0_pos_end);
+      }
+    }
   }
-  uint64_t get_available()
+  void _shutdown()
   {
-    std::lock_guard<std::mutex> l(lock);
-    return available;
+    l0_granularity = 0;
+    l1_granularity = 0;
+
+    l1.clear();
+    l0.clear();
+    l0_dirty.clear();
+    _reset_free_bins(false);
+    free_index.reset();
+    run_cache.clear();
+
+    _self()._reset_l1(0);
   }
-  inline uint64_t get_min_alloc_size() const
+
+  void _mark_alloc_l1_l0(int64_t l0_pos_start, int64_t l0_pos_end)
   {
-    return l1.get_min_alloc_size();
+    _update_free_bins(l0_pos_start, l0_pos_end, -1);
+    _mark_alloc_l0(l0_pos_start, l0_pos_end);
+    _update_free_bins(l0_pos_start, l0_pos_end, 1);
+    l0_pos_start = p2align(l0_pos_start, int64_t(bits_per_slotset));
+    l0_pos_end = p2roundup(l0_pos_end, int64_t(bits_per_slotset));
+    _self()._mark_l1_on_l0(l0_pos_start, l0_pos_end);
+  }
+
+  void _mark_free_l1_l0(int64_t l0_pos_start, int64_t l0_pos_end)
+  {
+    _update_free_bins(l0_pos_start, l0_pos_end, -1);
+    _mark_free_l0(l0_pos_start, l0_pos_end);
+    _update_free_bins(l0_pos_start, l0_pos_end, 1);
+    l0_pos_start = p2align(l0_pos_start, int64_t(bits_per_slotset));
+    l0_pos_end = p2roundup(l0_pos_end, int64_t(bits_per_slotset));
+    _self()._mark_l1_on_l0(l0_pos_start, l0_pos_end);
+  }
+
+  bool _is_empty_l1(uint64_t l1_pos, uint64_t l1_pos_end)
+  {
+    bool no_free = true;
+    uint64_t d = slotset_width * _children_per_slot();
+    ceph_assert(0 == (l1_pos % d));
+    ceph_assert(0 == (l1_pos_end % d));
+
+    auto idx = l1_pos / _children_per_slot();
+    auto idx_end = l1_pos_end / _children_per_slot();
+    while (idx < idx_end && no_free) {
+      no_free = _is_slot_fully_allocated(idx);
+      ++idx;
+    }
+    return no_free;
+  }
+
+  uint64_t _mark_alloc_l1(uint64_t offset, uint64_t length)
+  {
+    uint64_t l0_pos_start = offset / l0_granularity;
+    uint64_t l0_pos_end = p2roundup(offset + length, l0_granularity) / l0_granularity;
+    _mark_alloc_l1_l0(l0_pos_start, l0_pos_end);
+    return l0_granularity * (l0_pos_end - l0_pos_start);
+  }
+
+  uint64_t _free_l1(uint64_t offs, uint64_t len)
+  {
+    uint64_t l0_pos_start = offs / l0_granularity;
+    uint64_t l0_pos_end = p2roundup(offs + len, l0_granularity) / l0_granularity;
+    _mark_free_l1_l0(l0_pos_start, l0_pos_end);
+    return l0_granularity * (l0_pos_end - l0_pos_start);
+  }
+
+  // Helpers for lock-free single entry allocations. These operate on
+  // an L1 entry (slotset) which is hidden from the locked paths
+  // by being marked as full at L1, see flavors' _claim_l1_entry.
+
+  // restores L1 entry state from L0 once lock-free access is over
+  void _unclaim_l1_entry(uint64_t l1_pos)
+  {
+    // lock-free path doesn't track dirty pages and free runs
+    _mark_dirty_l0(l1_pos * bits_per_slotset, (l1_pos + 1) * bits_per_slotset);
+    _invalidate_runs(l1_pos * bits_per_slotset, (l1_pos + 1) * bits_per_slotset);
+    _update_free_bins(l1_pos * bits_per_slotset,
+      (l1_pos + 1) * bits_per_slotset, 1);
+    _self()._mark_l1_on_l0(l1_pos * bits_per_slotset,
+      (l1_pos + 1) * bits_per_slotset);
+    if (free_index) {
+      _index_refresh(l1_pos * bits_per_slotset, (l1_pos + 1) * bits_per_slotset);
+    }
+  }
+
+  void _enable_free_index(bool enable)
+  {
+    if (!enable) {
+      free_index.reset();
+    } else if (!free_index) {
+      _self()._index_build();
+    }
+  }
+  // allocates an extent aligned to min_length, of the full length if possible
+  // or the longest one available (but not shorter than min_length) unless
+  // 'exact' otherwise. 'conclusive' is reset if a fit might have been missed
+  // due to probe limit.
+  interval_t _allocate_indexed_extent(uint64_t length, uint64_t min_length,
+    bool* conclusive, bool exact = false)
+  {
+    auto e = _index_find(length / l0_granularity, min_length / l0_granularity,
+      conclusive, exact);
+    if (e.length) {
+      _mark_alloc_l1_l0(e.offset, e.offset + e.length);
+    }
+    return interval_t(e.offset * l0_granularity, e.length * l0_granularity);
+  }
+  // returns false if bitmap scan might find more space
+  bool _allocate_indexed(uint64_t length,
+    uint64_t min_length, uint64_t max_length,
+    uint64_t* allocated,
+    interval_vector_t* res)
+  {
+    bool conclusive = true;
+    while (length > *allocated) {
+      auto e = _allocate_indexed_extent(length - *allocated, min_length,
+	&conclusive);
+      if (!e.length) {
+	break;
+      }
+      _fragment_and_emplace(max_length, e.offset, e.length, res);
+      *allocated += e.length;
+    }
+    return conclusive;
+  }
+
+  // capacity to have slot alignment at l1, see flavors' _init
+  uint64_t _get_aligned_capacity(uint64_t capacity) const
+  {
+    return p2roundup((int64_t)capacity,
+      int64_t(l1_granularity * slotset_width * _children_per_slot()));
+  }
+  // extends the bitmaps to cover new_capacity, new entries are allocated.
+  // Existing entries stay in place provided the space has been reserved.
+  void _grow(uint64_t new_capacity)
+  {
+    auto aligned_capacity = _get_aligned_capacity(new_capacity);
+    ceph_assert(aligned_capacity / l0_granularity / bits_per_slot >= l0.size());
+    // cleared bits mean allocated entries for both L1 flavors
+    l1.resize(aligned_capacity / l1_granularity / _children_per_slot(),
+      all_slot_clear);
+    l0.resize(aligned_capacity / l0_granularity / bits_per_slot,
+      all_slot_clear);
+    l0_dirty.resize(div_round_up(get_snapshot_page_count(), bits_per_slot),
+      all_slot_clear);
+    if (!run_cache.empty()) {
+      run_cache.resize(l0.size() / slotset_width);
+    }
+  }
+  void _reserve(uint64_t max_capacity)
+  {
+    auto aligned_capacity = _get_aligned_capacity(max_capacity);
+    auto l0_slots = aligned_capacity / l0_granularity / bits_per_slot;
+    l1.reserve(aligned_capacity / l1_granularity / _children_per_slot());
+    l0.reserve(l0_slots);
+    l0_dirty.reserve(div_round_up(
+      div_round_up(l0_slots * sizeof(slot_t), snapshot_page_bytes),
+      bits_per_slot));
+  }
+
+public:
+  uint64_t debug_get_allocated(uint64_t pos0 = 0, uint64_t pos1 = 0)
+  {
+    if (pos1 == 0) {
+      pos1 = l1.size() * _children_per_slot();
+    }
+    auto avail = debug_get_free(pos0, pos1);
+    return (pos1 - pos0) * l1_granularity - avail;
+  }
+
+  uint64_t debug_get_free(uint64_t l1_pos0 = 0, uint64_t l1_pos1 = 0)
+  {
+    ceph_assert(0 == (l1_pos0 % _children_per_slot()));
+    ceph_assert(0 == (l1_pos1 % _children_per_slot()));
+    return AllocatorLevel01::debug_get_free(l1_pos0, l1_pos1);
+  }
+
+  uint64_t apply_snapshot(const void* from, uint64_t size,
+    size_t threads = 1) {
+    ceph_assert(size >= get_snapshot_size());
+    _self()._apply_l0(threads, [&](uint64_t begin, uint64_t end) {
+      memcpy(&l0[begin], (const slot_t*)from + begin,
+	(end - begin) * sizeof(slot_t));
+    });
+    return get_snapshot_size() * 8 * l0_granularity;
+  }
+  uint64_t apply_snapshot(const bufferlist& source, uint64_t offset = 0,
+    size_t threads = 1) {
+    std::atomic<uint64_t> applied_bytes(0);
+    _self()._apply_l0(threads, [&](uint64_t begin, uint64_t end) {
+      applied_bytes += _load_snapshot_range(source, offset, begin, end);
+    });
+    return applied_bytes * 8 * l0_granularity;
+  }
+  // returns the amount of bytes consumed
+  uint64_t apply_compressed_snapshot(const bufferlist& source,
+    uint64_t offset = 0, size_t threads = 1) {
+    std::vector<std::pair<uint64_t, uint64_t>> chunk_runs;
+    auto res = _scan_compressed_snapshot(source, offset, &chunk_runs);
+    _self()._apply_l0(threads, [&](uint64_t begin, uint64_t end) {
+      _load_compressed_range(source, chunk_runs[begin / apply_chunk_slots],
+	begin, end);
+    });
+    return res;
+  }
+  // applies pages captured by take_snapshot_pages on top of the current state
+  void apply_snapshot_pages(const bufferlist& source, uint64_t offset,
+    const uint64_t* pages, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      auto r = _load_snapshot_page(source, offset + i * snapshot_page_bytes,
+	pages[i]);
+      _self()._mark_l1_on_l0(r.first, r.second);
+      if (free_index) {
+	_index_refresh(r.first, r.second);
+      }
+    }
+  }
+};
+
+// Placement policies, AllocatorLevel02 template argument.
+// 'resume_scan' makes L2 scan proceed from where the previous one stopped
+// rather than from the lowest address, 'fit' controls slotset selection
+// at L1.
+enum {
+  FIT_DEFAULT, // partially free slotsets first, tightest one for large extents
+  FIT_FIRST,   // the lowest address fit
+  FIT_NEXT,    // the first fit after the previous allocation
+  FIT_BEST,    // the tightest fitting free run
+};
+struct placement_default
+{
+  static constexpr bool resume_scan = true;
+  static constexpr int fit = FIT_DEFAULT;
+};
+struct placement_next_fit
+{
+  static constexpr bool resume_scan = true;
+  static constexpr int fit = FIT_NEXT;
+};
+struct placement_first_fit
+{
+  static constexpr bool resume_scan = false;
+  static constexpr int fit = FIT_FIRST;
+};
+struct placement_best_fit
+{
+  static constexpr bool resume_scan = false;
+  static constexpr int fit = FIT_BEST;
+};
+
+template <class L1, class Policy = placement_default>
+class AllocatorLevel02;
+
+class AllocatorLevel01Loose
+  : public AllocatorLevel01Geometry<AllocatorLevel01Loose>
+{
+  friend class AllocatorLevel01Geometry<AllocatorLevel01Loose>;
+  enum {
+    L1_ENTRY_WIDTH = 2,
+    L1_ENTRY_MASK = (1 << L1_ENTRY_WIDTH) - 1,
+    L1_ENTRY_FULL = 0x00,
+    L1_ENTRY_PARTIAL = 0x01,
+    L1_ENTRY_NOT_USED = 0x02,
+    L1_ENTRY_FREE = 0x03,
+    CHILD_PER_SLOT = bits_per_slot / L1_ENTRY_WIDTH, // 32
+  };
+  // L1 position (slot aligned) to resume FIT_NEXT scan from
+  uint64_t next_fit_pos = 0;
+
+public:
+  // get_fragmentation() reads counters only hence needs no lock
+  static constexpr bool lockless_fragmentation = true;
+
+protected:
+
+  template <class, class>
+  friend class AllocatorLevel02;
+
+  void _reset_l1(size_t free_entries)
+  {
+    partial_l1_count = 0;
+    unalloc_l1_count = free_entries;
+    next_fit_pos = 0;
+  }
+
+  struct search_ctx_t
+  {
+    size_t partial_count = 0;
+    size_t free_count = 0;
+    uint64_t free_l1_pos = 0;
+
+    uint64_t min_affordable_len = 0;
+    uint64_t min_affordable_offs = 0;
+    uint64_t affordable_len = 0;
+    uint64_t affordable_offs = 0;
+
+    bool fully_processed = false;
+
+    void reset()
+    {
+      *this = search_ctx_t();
+    }
+  };
+  enum {
+    NO_STOP,
+    STOP_ON_EMPTY,
+    STOP_ON_PARTIAL,
+    STOP_ON_FIT, // the first extent of 'length' either partial or free
+  };
+  void _analyze_partials(uint64_t pos_start, uint64_t pos_end,
+    uint64_t length, uint64_t min_length, int mode,
+    search_ctx_t* ctx);
+  void _analyze_partials_simd(uint64_t pos_start, uint64_t pos_end,
+    uint64_t length, uint64_t min_length, int mode,
+    search_ctx_t* ctx);
+  // true if the cached runs show the partial entry can't update
+  // the context, 'prev_tail' is advanced past the entry then
+  bool _skip_partial(uint64_t l1_pos, uint64_t length, uint64_t min_length,
+    const search_ctx_t& ctx, interval_t* prev_tail)
+  {
+    interval_t tail;
+    auto bound = _get_longest_bound(l1_pos, *prev_tail, &tail);
+    // nothing shorter than min_length is taken while min_length long
+    // misfit can't be beaten
+    if (bound >= min_length &&
+	(bound >= length || ctx.min_affordable_len != min_length)) {
+      return false;
+    }
+    *prev_tail = tail;
+    return true;
+  }
+
+  // counters to be updated are passed explicitly
+  // to permit concurrent updates of disjoint ranges
+  void _mark_l1_on_l0(int64_t l0_pos, int64_t l0_pos_end,
+    size_t* unalloc_count, size_t* partial_count);
+  void _mark_l1_on_l0(int64_t l0_pos, int64_t l0_pos_end)
+  {
+    size_t unalloc = unalloc_l1_count;
+    size_t partial = partial_l1_count;
+    _mark_l1_on_l0(l0_pos, l0_pos_end, &unalloc, &partial);
+    unalloc_l1_count = unalloc;
+    partial_l1_count = partial;
+  }
+
+  // 'Fit' is one of FIT_* placement choices
+  template <int Fit = FIT_DEFAULT>
+  interval_t _allocate_l1_contiguous(uint64_t length,
+    uint64_t min_length, uint64_t max_length,
+    uint64_t pos_start, uint64_t pos_end);
+  // the shortest free run within L1 entries [pos_start, pos_end)
+  // holding 'length' once aligned to 'min_length', empty if none
+  interval_t _get_tightest_run(uint64_t pos_start, uint64_t pos_end,
+    uint64_t length, uint64_t min_length) const;
+
+  template <int Fit = FIT_DEFAULT>
+  bool _allocate_l1(uint64_t length,
+    uint64_t min_length, uint64_t max_length,
+    uint64_t l1_pos_start, uint64_t l1_pos_end,
+    uint64_t* allocated,
+    interval_vector_t* res);
+
+  // allocates a single extent of exactly 'length' aligned to 'length',
+  // returns an empty interval if there is none in the range. Single unit
+  // requests start the search at the slot holding 'l1_pos_from' if it's
+  // in the range, wrapping around.
+  template <int Fit = FIT_DEFAULT>
+  interval_t _allocate_l1_extent(uint64_t length,
+    uint64_t l1_pos_start, uint64_t l1_pos_end,
+    bool* empty,
+    uint64_t l1_pos_from = 0);
+  // the same for an arbitrary power of 2 alignment (a multiple of
+  // l0 granularity), takes the first fit
+  interval_t _allocate_l1_aligned(uint64_t length, uint64_t align,
+    uint64_t l1_pos_start, uint64_t l1_pos_end,
+    bool* empty);
+
+  // finds a partially (preferred) or totally free L1 entry within the range
+  // and marks it as full, returns its position or -1 if none
+  int64_t _claim_l1_entry(uint64_t l1_pos_start, uint64_t l1_pos_end);
+
+  void _index_build();
+
+  // L1 is rebuilt from scratch, entry counters are summed up per chunk
+  template <class Load>
+  void _apply_l0(size_t threads, Load load)
+  {
+    std::fill(l1.begin(), l1.end(), slot_t(L1_ENTRY_FULL));
+    std::atomic<size_t> unalloc(0), partial(0);
+    _apply_parallel(threads, load, [&](int64_t l0_pos, int64_t l0_pos_end) {
+      size_t u = 0, p = 0;
+      _mark_l1_on_l0(l0_pos, l0_pos_end, &u, &p);
+      unalloc += u;
+      partial += p;
+    });
+    unalloc_l1_count = unalloc.load();
+    partial_l1_count = partial.load();
+    _reset_run_cache();
+    if (free_index) {
+      _index_build();
+    }
+  }
+};
+
+// L1 flavor keeping a single bit per L1 entry (slotset): set bit means
+// the entry is (partially) free. It takes half the memory of the Loose one
+// at the cost of checking L0 to distinguish free entries from partial ones.
+class AllocatorLevel01Compact
+  : public AllocatorLevel01Geometry<AllocatorLevel01Compact>
+{
+  friend class AllocatorLevel01Geometry<AllocatorLevel01Compact>;
+  enum {
+    CHILD_PER_SLOT = bits_per_slot, // 64
+  };
+
+public:
+  // get_fragmentation() walks the bitmaps
+  static constexpr bool lockless_fragmentation = false;
+
+protected:
+
+  template <class, class>
+  friend class AllocatorLevel02;
+
+  void _reset_l1(size_t)
+  {
+  }
+
+  inline bool _is_l1_entry_set(uint64_t l1_pos) const
+  {
+    return l1[l1_pos / CHILD_PER_SLOT] & (slot_t(1) << (l1_pos % CHILD_PER_SLOT));
+  }
+  inline bool _is_l1_entry_free(uint64_t l1_pos) const
+  {
+    for (auto idx = l1_pos * slotset_width; idx < (l1_pos + 1) * slotset_width;
+      ++idx) {
+      if (l0[idx] != all_slot_set) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  void _mark_l1_on_l0(int64_t l0_pos, int64_t l0_pos_end);
+
+  // 'Fit' is one of FIT_* placement choices, FIT_NEXT is handled
+  // as FIT_FIRST
+  template <int Fit = FIT_DEFAULT>
+  interval_t _allocate_l1_contiguous(uint64_t length,
+    uint64_t min_length, uint64_t max_length,
+    uint64_t pos_start, uint64_t pos_end);
+  // the same as AllocatorLevel01Loose::_get_tightest_run
+  interval_t _get_tightest_run(uint64_t pos_start, uint64_t pos_end,
+    uint64_t length, uint64_t min_length) const;
+
+  template <int Fit = FIT_DEFAULT>
+  bool _allocate_l1(uint64_t length,
+    uint64_t min_length, uint64_t max_length,
+    uint64_t l1_pos_start, uint64_t l1_pos_end,
+    uint64_t* allocated,
+    interval_vector_t* res);
+
+  // allocates a single extent of exactly 'length' aligned to 'length',
+  // returns an empty interval if there is none in the range. Single unit
+  // requests start the search at the slot holding 'l1_pos_from' if it's
+  // in the range, wrapping around.
+  template <int Fit = FIT_DEFAULT>
+  interval_t _allocate_l1_extent(uint64_t length,
+    uint64_t l1_pos_start, uint64_t l1_pos_end,
+    bool* empty,
+    uint64_t l1_pos_from = 0);
+  // the same for an arbitrary power of 2 alignment (a multiple of
+  // l0 granularity), takes the first fit
+  interval_t _allocate_l1_aligned(uint64_t length, uint64_t align,
+    uint64_t l1_pos_start, uint64_t l1_pos_end,
+    bool* empty);
+
+  // see AllocatorLevel01Loose for lock-free helpers description
+  int64_t _claim_l1_entry(uint64_t l1_pos_start, uint64_t l1_pos_end);
+
+  void _index_build();
+
+  // there is no room for free/partial entry counters at L1,
+  // hence fragmentation is calculated from L0 on demand
+  double get_fragmentation() const;
+
+  template <class Load>
+  void _apply_l0(size_t threads, Load load)
+  {
+    _apply_parallel(threads, load, [&](int64_t l0_pos, int64_t l0_pos_end) {
+      _mark_l1_on_l0(l0_pos, l0_pos_end);
+    });
+    _reset_run_cache();
+    if (free_index) {
+      _index_build();
+    }
+  }
+};
+
+template <class L1, class Policy>
+class AllocatorLevel02 : public AllocatorLevel
+{
+protected:
+#ifdef NON_CEPH_BUILD
+  std::mutex lock;
+#else
+  ceph::mutex lock = ceph::make_mutex("AllocatorLevel02::lock");
+#endif
+public:
+  // positions are in units of debug_get_granularity() bytes,
+  // i.e. bits_per_slot L1 slots
+  uint64_t debug_get_granularity() const
+  {
+    return l1._level_granularity() * L1::_children_per_slot() * bits_per_slot;
+  }
+  uint64_t debug_get_free(uint64_t pos0 = 0, uint64_t pos1 = 0)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    return l1.debug_get_free(pos0 * L1::_children_per_slot() * bits_per_slot,
+      pos1 * L1::_children_per_slot() * bits_per_slot);
+  }
+  uint64_t debug_get_allocated(uint64_t pos0 = 0, uint64_t pos1 = 0)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    return l1.debug_get_allocated(pos0 * L1::_children_per_slot() * bits_per_slot,
+      pos1 * L1::_children_per_slot() * bits_per_slot);
+  }
+
+  // counters are read without the lock, they might be a bit off while
+  // allocations are in progress but are exact at quiescent points
+  uint64_t get_alloc_count()
+  {
+    return alloc_cnt;
+  }
+  uint64_t get_available()
+  {
+    // extents parked in magazines and lock-free zones
+    // are still free from the user's perspective
+    return available + cached_bytes + lf_available;
+  }
+  inline granularity_t get_min_alloc_size() const
+  {
+    return l1.get_min_alloc_size();
+  }
+  void collect_stats(
+    std::map<size_t, size_t>& bins_overall) override {
+
+      std::lock_guard<std::mutex> l(lock);
+      l1.collect_stats(bins_overall);
+  }
+  void add_counters(stats_t* res) const override {
+    AllocatorLevel::add_counters(res);
+    l1.add_counters(res);
+  }
+  // doesn't take the lock, see AllocatorLevel01::collect_slotset_stats
+  void collect_slotset_stats(std::map<size_t, size_t>& bins_overall) const {
+    l1.collect_slotset_stats(bins_overall);
+  }
+
+  uint64_t get_snapshot_size() {
+    return l1.get_snapshot_size();
+  }
+  uint64_t take_snapshot(void* target, uint64_t size) {
+    // cached extents are marked as allocated in the bitmap,
+    // return them first to avoid leaking them into the snapshot
+    _drain_magazines();
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones();
+    return l1.take_snapshot(target, size);
+  }
+  void apply_snapshot(const void* from, uint64_t size, uint64_t _alloc_cnt) {
+    std::lock_guard<std::mutex> l(lock);
+    
+    uint64_t applied_capacity = l1.apply_snapshot(from, size, apply_threads);
+    auto aligned_capacity = get_aligned_capacity();
+    // L0 is aligned with L1 slotsets only hence might be shorter
+    assert(applied_capacity <= aligned_capacity);
+    alloc_cnt = _alloc_cnt;
+    available = l1.debug_get_free();
+    _mark_l2_on_l1(0, aligned_capacity / l2_granularity);
+  }
+  uint64_t take_snapshot(bufferlist& target, uint64_t offset = 0) {
+    _drain_magazines();
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones();
+    return l1.take_snapshot(target, offset);
+  }
+  void apply_snapshot(const bufferlist& source, uint64_t _alloc_cnt,
+    uint64_t offset = 0) {
+    std::lock_guard<std::mutex> l(lock);
+    uint64_t applied_capacity =
+      l1.apply_snapshot(source, offset, apply_threads);
+    auto aligned_capacity = get_aligned_capacity();
+    // L0 is aligned with L1 slotsets only hence might be shorter
+    assert(applied_capacity <= aligned_capacity);
+    alloc_cnt = _alloc_cnt;
+    available = l1.debug_get_free();
+    _mark_l2_on_l1(0, aligned_capacity / l2_granularity);
+  }
+  uint64_t get_compressed_snapshot_size() {
+    _drain_magazines();
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones();
+    return l1.get_compressed_snapshot_size();
+  }
+  uint64_t take_compressed_snapshot(bufferlist& target, uint64_t offset = 0) {
+    _drain_magazines();
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones();
+    return l1.take_compressed_snapshot(target, offset);
+  }
+  // returns the amount of bytes consumed
+  uint64_t apply_compressed_snapshot(const bufferlist& source,
+    uint64_t _alloc_cnt, uint64_t offset = 0) {
+    std::lock_guard<std::mutex> l(lock);
+    auto res = l1.apply_compressed_snapshot(source, offset, apply_threads);
+    alloc_cnt = _alloc_cnt;
+    available = l1.debug_get_free();
+    _mark_l2_on_l1(0, get_aligned_capacity() / l2_granularity);
+    return res;
+  }
+
+  // Incremental snapshots: L0 pages modified since the last full snapshot
+  // (taken or applied) are tracked as dirty and can be captured alone.
+  uint64_t get_snapshot_page_count() {
+    return l1.get_snapshot_page_count();
+  }
+  size_t get_dirty_page_count() {
+    _drain_magazines();
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones();
+    return l1.get_dirty_page_count();
+  }
+  size_t take_snapshot_pages(bufferlist& target, uint64_t* pages,
+    size_t max_pages, uint64_t offset = 0) {
+    _drain_magazines();
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones();
+    return l1.take_snapshot_pages(target, offset, pages, max_pages);
+  }
+  // to be applied on top of the full snapshot the pages are dirty against
+  void apply_snapshot_pages(const bufferlist& source, const uint64_t* pages,
+    size_t count, uint64_t _alloc_cnt, uint64_t offset = 0) {
+    std::lock_guard<std::mutex> l(lock);
+    l1.apply_snapshot_pages(source, offset, pages, count);
+    alloc_cnt = _alloc_cnt;
+    available = l1.debug_get_free();
+    _mark_l2_on_l1(0, get_aligned_capacity() / l2_granularity);
+  }
+
+protected:
+  L1 l1;
+  slot_vector_t l2;
+  // Optional summary level: a bit per L2 slot which is set if any of its
+  // entries is (partially) free. Lets scans skip 64 fully allocated L2
+  // slots at once, which keeps them short on huge and mostly full pools.
+  slot_vector_t l3;
+  granularity_t l2_granularity; // space per entry
+  // updated under the lock (alloc_cnt by the owner), read without it
+  std::atomic<uint64_t> available = { 0 };
+  uint64_t last_pos = 0;
+  std::atomic<uint64_t> alloc_cnt = { 0 };
+  size_t apply_threads = 1;
+
+  enum {
+    CHILD_PER_SLOT = bits_per_slot, // 64
+  };
+
+  // Optional per-thread allocation caches ("magazines") in front of
+  // _allocate_l2/_free_l2. Each magazine keeps LIFO stacks of pre-claimed
+  // extents for small size classes, i.e. exact multiples (1..MAGAZINE_CLASSES)
+  // of the min alloc unit. Cached extents are marked as allocated in
+  // the bitmap and accounted in cached_bytes rather than in available.
+  // Lock ordering: magazine lock first, then the allocator's one.
+  enum {
+    MAGAZINE_CLASSES = 16,
+    MAGAZINE_SIZE = 64,  // max extents per class
+    MAGAZINE_BATCH = 32, // extents to refill/drain at once
+  };
+  struct alignas(64) magazine_t
+  {
+    std::mutex lock;
+    uint32_t count[MAGAZINE_CLASSES] = { 0 };
+    uint64_t offsets[MAGAZINE_CLASSES][MAGAZINE_SIZE];
+  };
+  std::unique_ptr<magazine_t[]> magazines;
+  size_t magazine_count = 0;
+  std::atomic<uint64_t> cached_bytes = { 0 };
+
+  // Optional lock-free path for single alloc unit requests. A few L1
+  // entries (zones) are handed over to it under the lock by marking them
+  // as full at L1 which hides them from the locked paths. L0 bits inside
+  // a zone are then claimed/released with atomic ops. Exhausted zones are
+  // retired under the lock, which restores their L1/L2 state. refs
+  // counter lets retirement wait for in-flight lock-free operations.
+  // Free space within zones is accounted in lf_available.
+  enum : uint64_t {
+    LF_ZONE_NONE = uint64_t(-1),
+  };
+  struct alignas(64) lf_zone_t
+  {
+    std::atomic<uint64_t> pos = { LF_ZONE_NONE }; // L1 entry position
+    std::atomic<uint64_t> refs = { 0 };
+  };
+  std::unique_ptr<lf_zone_t[]> lf_zones;
+  size_t lf_zone_count = 0;
+  slot_vector_t lf_zone_map; // bit per L1 entry in use by zones
+  std::atomic<uint64_t> lf_available = { 0 };
+
+  static constexpr uint64_t _children_per_slot()
+  {
+    return CHILD_PER_SLOT;
+  }
+  uint64_t _level_granularity() const
+  {
+    return l2_granularity;
+  }
+  uint64_t get_aligned_capacity() const {
+    return l2.size() * (int64_t)l2_granularity * CHILD_PER_SLOT;
+  }
+  // space covered by a single L2 slot for the specified alloc unit
+  uint64_t _get_l2_slot_size(uint64_t _alloc_unit) const {
+    return _alloc_unit * bits_per_slotset * L1::_children_per_slot() *
+      slotset_width * CHILD_PER_SLOT;
+  }
+
+  void _init(uint64_t capacity, uint64_t _alloc_unit, bool mark_as_free = true)
+  {
+    ceph_assert(isp2(_alloc_unit));
+    l1._init(capacity, _alloc_unit, mark_as_free);
+
+    l2_granularity =
+      l1._level_granularity() * L1::_children_per_slot() * slotset_width;
+
+    // capacity to have slot alignment at l2
+    auto aligned_capacity =
+      p2roundup((int64_t)capacity, (int64_t)l2_granularity * CHILD_PER_SLOT);
+    size_t elem_count = aligned_capacity / l2_granularity / CHILD_PER_SLOT;
+    // we use set bit(s) as a marker for (partially) free entry
+    l2.resize(elem_count, mark_as_free ? all_slot_set : all_slot_clear);
+
+    if (mark_as_free) {
+      // capacity to have slotset alignment at l1
+      auto l2_pos_no_use =
+	p2roundup((int64_t)capacity, (int64_t)l2_granularity) / l2_granularity;
+      _mark_l2_allocated(l2_pos_no_use, aligned_capacity / l2_granularity);
+      available = p2align(capacity, _alloc_unit);
+    } else {
+      available = 0;
+    }
+    alloc_cnt = 0;
+  }
+
+  // updates L3 bits for L2 slots in [pos, pos_end)
+  void _mark_l3_on_l2(uint64_t pos, uint64_t pos_end)
+  {
+    if (l3.empty()) {
+      return;
+    }
+    while (pos < pos_end) {
+      auto word_end =
+	std::min(p2align(pos, uint64_t(bits_per_slot)) + bits_per_slot, pos_end);
+      slot_t bits = all_slot_clear;
+      for (auto p = pos; p < word_end; ++p) {
+	if (l2[p] != all_slot_clear) {
+	  bits |= slot_t(1) << (p % bits_per_slot);
+	}
+      }
+      assign_bit_range(&l3[pos / bits_per_slot], pos % bits_per_slot,
+	word_end - p2align(pos, uint64_t(bits_per_slot)), bits);
+      pos = word_end;
+    }
+  }
+  // returns the first L2 slot in [pos, pos_end) having free entries
+  // according to L3, pos_end if none
+  uint64_t _find_l2_free_slot(uint64_t pos, uint64_t pos_end) const
+  {
+    while (pos < pos_end) {
+      slot_t v = l3[pos / bits_per_slot] >> (pos % bits_per_slot);
+      if (v != all_slot_clear) {
+	pos += __builtin_ctzll(v);
+	break;
+      }
+      pos = p2align(pos, uint64_t(bits_per_slot)) + bits_per_slot;
+    }
+    return std::min(pos, pos_end);
+  }
+
+  void _mark_l2_allocated(int64_t l2_pos, int64_t l2_pos_end)
+  {
+    auto d = CHILD_PER_SLOT;
+    ceph_assert(0 <= l2_pos_end);
+    ceph_assert((int64_t)l2.size() >= (l2_pos_end / d));
+
+    clear_bit_range(l2.data(), l2_pos, l2_pos_end);
+    _mark_l3_on_l2(l2_pos / d, div_round_up(l2_pos_end, d));
+  }
+
+  void _mark_l2_free(int64_t l2_pos, int64_t l2_pos_end)
+  {
+    auto d = CHILD_PER_SLOT;
+    ceph_assert(0 <= l2_pos_end);
+    ceph_assert((int64_t)l2.size() >= (l2_pos_end / d));
+
+    set_bit_range(l2.data(), l2_pos, l2_pos_end);
+    _mark_l3_on_l2(l2_pos / d, div_round_up(l2_pos_end, d));
+  }
+
+  void _mark_l2_on_l1_extent(uint64_t offset, uint64_t length)
+  {
+    _mark_l2_on_l1(offset / l2_granularity,
+      p2roundup(int64_t(offset + length), int64_t(l2_granularity)) / l2_granularity);
+  }
+  void _mark_l2_on_l1(int64_t l2_pos, int64_t l2_pos_end)
+  {
+    auto d = CHILD_PER_SLOT;
+    ceph_assert(0 <= l2_pos_end);
+    ceph_assert((int64_t)l2.size() >= (l2_pos_end / d));
+
+    // entries are collected per L2 slot and applied with a single update
+    auto pos0 = l2_pos;
+    while (l2_pos < l2_pos_end) {
+      int64_t word_end =
+	std::min<int64_t>(p2align(l2_pos, int64_t(d)) + d, l2_pos_end);
+      slot_t bits = all_slot_clear;
+      for (auto pos = l2_pos; pos < word_end; ++pos) {
+	auto idx = pos * slotset_width;
+	auto idx_end = idx + slotset_width;
+	while (idx < idx_end && l1._is_slot_fully_allocated(idx)) {
+	  ++idx;
+	}
+	if (idx < idx_end) {
+	  bits |= slot_t(1) << (pos % d);
+	}
+      }
+      assign_bit_range(&l2[l2_pos / d], l2_pos % d,
+	word_end - p2align(l2_pos, int64_t(d)), bits);
+      l2_pos = word_end;
+    }
+    _mark_l3_on_l2(pos0 / d, div_round_up(l2_pos_end, d));
+  }
+
+  // invokes fn(l2_pos, &empty) for every L2 entry with free space
+  // starting at the slot holding 'cursor' and wrapping around, until
+  // fn returns true. Entries reported empty are cleared, 'cursor' is
+  // kept at the slot being processed.
+  template <class Func>
+  void _scan_l2(uint64_t& cursor, Func fn)
+  {
+    uint64_t d = CHILD_PER_SLOT;
+    auto l2_pos = cursor;
+    auto last_pos0 = cursor;
+    auto pos = cursor / d;
+    auto pos_end = l2.size();
+    bool done = false;
+    // outer loop below is intended to optimize the performance by
+    // avoiding 'modulo' operations inside the internal loop.
+    // Looks like they have negative impact on the performance
+    for (auto i = 0; !done && i < 2; ++i) {
+      for(; !done && pos < pos_end; ++pos) {
+	if (!l3.empty() && l2[pos] == all_slot_clear) {
+	  auto next = _find_l2_free_slot(pos, pos_end);
+	  l2_pos += (next - pos) * d;
+	  cursor = l2_pos;
+	  pos = next;
+	  if (pos == pos_end) {
+	    break;
+	  }
+	}
+	slot_t& slot_val = l2[pos];
+	if (slot_val == all_slot_clear) {
+	  l2_pos += d;
+	  cursor = l2_pos;
+	  continue;
+	}
+	size_t free_pos = find_next_set_bit(slot_val, 0);
+	ceph_assert(free_pos < bits_per_slot);
+	do {
+	  bool empty = false;
+	  done = fn(l2_pos + free_pos, &empty);
+	  if (empty) {
+	    slot_val &= ~(slot_t(1) << free_pos);
+	  }
+	  if (done || slot_val == all_slot_clear) {
+	    break;
+	  }
+	  free_pos = find_next_set_bit(slot_val, free_pos + 1);
+	} while (free_pos < bits_per_slot);
+	_mark_l3_on_l2(pos, pos + 1);
+	cursor = l2_pos;
+	l2_pos += d;
+      }
+      l2_pos = 0;
+      pos = 0;
+      pos_end = last_pos0 / d;
+    }
+  }
+
+  void _allocate_l2(uint64_t length,
+    uint64_t min_length,
+    uint64_t max_length,
+    uint64_t hint,
+    uint64_t* allocated,
+    interval_vector_t* res)
+  {
+    uint64_t prev_allocated = *allocated;
+    uint64_t d = CHILD_PER_SLOT;
+    //ceph_assert(isp2(min_length));
+    ceph_assert(min_length <= l2_granularity);
+    ceph_assert(max_length == 0 || max_length >= min_length);
+    ceph_assert(max_length == 0 || (max_length % min_length) == 0);
+    ceph_assert(length >= min_length);
+    ceph_assert((length % min_length) == 0);
+
+    uint64_t cap = 1ull << 31;
+    if (max_length == 0 || max_length >= cap) {
+      max_length = cap;
+    }
+
+    constexpr uint64_t l1_w = slotset_width * L1::_children_per_slot();
+
+    std::lock_guard<std::mutex> l(lock);
+
+    if (available < min_length) {
+      return;
+    }
+    bool scan = true;
+    if (min_length != l1.get_min_alloc_size() && l1._has_free_index()) {
+      auto n = res->size();
+      scan = !l1._allocate_indexed(length, min_length, max_length,
+	allocated, res);
+      for (auto i = n; i < res->size(); ++i) {
+	_mark_l2_on_l1_extent((*res)[i].offset, (*res)[i].length);
+      }
+    }
+    // policies without scan resumption start from the lowest address
+    // each time and leave the shared cursor intact, so do hinted requests
+    uint64_t scan_pos = 0;
+    auto& cursor = Policy::resume_scan && hint == no_hint ?
+      last_pos : scan_pos;
+    if (hint != no_hint) {
+      auto hint_pos = hint / l2_granularity;
+      cursor = (hint_pos / d) < l2.size() ? p2align(hint_pos, d) : 0;
+    }
+    if (scan && length > *allocated) {
+      _scan_l2(cursor, [&](uint64_t l2_pos, bool* empty) {
+	*empty = l1.template _allocate_l1<Policy::fit>(length,
+	  min_length,
+	  max_length,
+	  l2_pos * l1_w,
+	  (l2_pos + 1) * l1_w,
+	  allocated,
+	  res);
+	return length <= *allocated;
+      });
+    }
+
+    inc_counter(CNT_L2_ALLOCS);
+    auto allocated_here = *allocated - prev_allocated;
+    ceph_assert(available >= allocated_here);
+    counter_sub(available, allocated_here);
+  }
+
+  // single extent of 'length' from the given L2 entry, 'l1_pos_from'
+  // is passed to L1 as a starting point
+  interval_t _allocate_l2_entry(uint64_t length, uint64_t align,
+    uint64_t l2_pos, bool* empty, uint64_t l1_pos_from = 0)
+  {
+    constexpr uint64_t l1_w = slotset_width * L1::_children_per_slot();
+    return align ?
+      l1._allocate_l1_aligned(length, align,
+	l2_pos * l1_w, (l2_pos + 1) * l1_w, empty) :
+      l1.template _allocate_l1_extent<Policy::fit>(length,
+	l2_pos * l1_w, (l2_pos + 1) * l1_w, empty, l1_pos_from);
+  }
+
+  // tries the L2 entry holding 'hint' only, starting at the hinted L1
+  // slot, to be called under the lock
+  interval_t _allocate_l2_hinted(uint64_t length, uint64_t hint,
+    uint64_t align)
+  {
+    uint64_t d = CHILD_PER_SLOT;
+    auto l2_pos = hint / l2_granularity;
+    interval_t res;
+    if (l2_pos / d >= l2.size()) {
+      return res;
+    }
+    slot_t& slot_val = l2[l2_pos / d];
+    auto mask = slot_t(1) << (l2_pos % d);
+    if (slot_val & mask) {
+      bool empty = false;
+      res = _allocate_l2_entry(length, align, l2_pos, &empty,
+	hint / l1._level_granularity());
+      if (empty) {
+	slot_val &= ~mask;
+	_mark_l3_on_l2(l2_pos / d, l2_pos / d + 1);
+      }
+      if (res.length) {
+	inc_counter(CNT_L2_ALLOCS);
+	counter_sub(available, res.length);
+      }
+    }
+    return res;
+  }
+
+  // single extent counterpart of _allocate_l2(length, length, length, ...)
+  // which doesn't need a result vector. Non-zero 'align' (power of 2, up to
+  // l2 granularity) replaces the default alignment to the extent length.
+  // 'hint' is a byte offset whose L2 entry is tried first and the scan
+  // proceeds from, the shared scan cursor is left intact then as well as
+  // for policies without scan resumption.
+  interval_t _allocate_l2_extent(uint64_t length, uint64_t hint = no_hint,
+    uint64_t align = 0)
+  {
+    uint64_t d = CHILD_PER_SLOT;
+    ceph_assert(length <= l2_granularity);
+    ceph_assert(length && (length % l1.get_min_alloc_size()) == 0);
+    ceph_assert(align <= l2_granularity && isp2(align));
+    if (align <= l1.get_min_alloc_size()) {
+      align = 0;
+    }
+
+    interval_t res;
+    std::lock_guard<std::mutex> l(lock);
+
+    if (available < length) {
+      return res;
+    }
+    if (hint != no_hint) {
+      res = _allocate_l2_hinted(length, hint, align);
+      if (res.length) {
+	return res;
+      }
+    }
+    if ((align || length != l1.get_min_alloc_size()) &&
+	l1._has_free_index()) {
+      bool conclusive = true;
+      res = l1._allocate_indexed_extent(length, align ? align : length,
+	&conclusive, true);
+      if (res.length) {
+	_mark_l2_on_l1_extent(res.offset, res.length);
+	inc_counter(CNT_L2_ALLOCS);
+	counter_sub(available, res.length);
+	return res;
+      }
+      if (conclusive) {
+	return res;
+      }
+    }
+    uint64_t scan_pos = 0;
+    auto& cursor = Policy::resume_scan && hint == no_hint ?
+      last_pos : scan_pos;
+    if (hint != no_hint) {
+      auto hint_pos = hint / l2_granularity;
+      cursor = (hint_pos / d) < l2.size() ? p2align(hint_pos, d) : 0;
+    }
+    _scan_l2(cursor, [&](uint64_t l2_pos, bool* empty) {
+      res = _allocate_l2_entry(length, align, l2_pos, empty);
+      return res.length != 0;
+    });
+
+    inc_counter(CNT_L2_ALLOCS);
+    ceph_assert(available >= res.length);
+    counter_sub(available, res.length);
+    return res;
+  }
+
+  // single extent from the L2 entry holding 'hint' only, returns false
+  // if there is none
+  bool _allocate_l2_near(uint64_t length, uint64_t hint, uint64_t* offset)
+  {
+    ceph_assert(length <= l2_granularity);
+    ceph_assert(length && (length % l1.get_min_alloc_size()) == 0);
+    std::lock_guard<std::mutex> l(lock);
+    if (available < length) {
+      return false;
+    }
+    auto res = _allocate_l2_hinted(length, hint, 0);
+    *offset = res.offset;
+    return res.length != 0;
+  }
+
+  void _free_l2_extent(uint64_t offset, uint64_t length)
+  {
+    uint64_t l2_pos = offset / l2_granularity;
+    uint64_t l2_pos_end = p2roundup(int64_t(offset + length), int64_t(l2_granularity)) / l2_granularity;
+
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones(offset, length);
+    counter_add(available, l1._free_l1(offset, length));
+    _mark_l2_free(l2_pos, l2_pos_end);
+  }
+
+  // releases a batch of extents (reordering the container): adjacent
+  // ones are merged and all the levels are updated under a single lock
+  template <typename T>
+  void _free_l2_batch(T& rr)
+  {
+    std::sort(rr.begin(), rr.end(),
+      [](const auto& a, const auto& b) {
+	return a.offset < b.offset;
+      });
+    uint64_t released = 0;
+    int64_t l2_pos = 0;
+    int64_t l2_pos_end = 0;
+    bool l2_pending = false;
+
+    std::lock_guard<std::mutex> l(lock);
+    auto it = rr.begin();
+    while (it != rr.end()) {
+      uint64_t o = it->offset;
+      uint64_t len = it->length;
+      for (++it; it != rr.end() && it->offset == o + len; ++it) {
+	len += it->length;
+      }
+      _lf_retire_zones(o, len);
+      released += l1._free_l1(o, len);
+
+      int64_t pos = o / l2_granularity;
+      int64_t pos_end = p2roundup(int64_t(o + len), int64_t(l2_granularity)) / l2_granularity;
+      if (l2_pending && pos > l2_pos_end) {
+	_mark_l2_free(l2_pos, l2_pos_end);
+	l2_pending = false;
+      }
+      if (!l2_pending) {
+	l2_pos = pos;
+	l2_pending = true;
+      }
+      l2_pos_end = std::max(l2_pos_end, pos_end);
+    }
+    if (l2_pending) {
+      _mark_l2_free(l2_pos, l2_pos_end);
+    }
+    counter_add(available, released);
+  }
+
+#ifndef NON_CEPH_BUILD
+  // to provide compatibility with BlueStore's allocator interface
+  void _free_l2(const interval_set<uint64_t> & rr)
+  {
+    uint64_t released = 0;
+    std::lock_guard<std::mutex> l(lock);
+    for (auto r : rr) {
+      _lf_retire_zones(r.first, r.second);
+      released += l1._free_l1(r.first, r.second);
+      uint64_t l2_pos = r.first / l2_granularity;
+      uint64_t l2_pos_end = p2roundup(int64_t(r.first + r.second), int64_t(l2_granularity)) / l2_granularity;
+
+      _mark_l2_free(l2_pos, l2_pos_end);
+    }
+    counter_add(available, released);
+  }
+#endif
+
+  template <typename T>
+  void _free_l2(const T& rr)
+  {
+    uint64_t released = 0;
+    std::lock_guard<std::mutex> l(lock);
+    for (auto r : rr) {
+      _lf_retire_zones(r.offset, r.length);
+      released += l1._free_l1(r.offset, r.length);
+      uint64_t l2_pos = r.offset / l2_granularity;
+      uint64_t l2_pos_end = p2roundup(int64_t(r.offset + r.length), int64_t(l2_granularity)) / l2_granularity;
+
+      _mark_l2_free(l2_pos, l2_pos_end);
+    }
+    counter_add(available, released);
+  }
+
+  void _mark_allocated(uint64_t o, uint64_t len)
+  {
+    uint64_t l2_pos = o / l2_granularity;
+    uint64_t l2_pos_end = p2roundup(int64_t(o + len), int64_t(l2_granularity)) / l2_granularity;
+
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones(o, len);
+    auto allocated = l1._mark_alloc_l1(o, len);
+    ceph_assert(available >= allocated);
+    counter_sub(available, allocated);
+    _mark_l2_on_l1(l2_pos, l2_pos_end);
+  }
+
+  void _mark_free(uint64_t o, uint64_t len)
+  {
+    uint64_t l2_pos = o / l2_granularity;
+    uint64_t l2_pos_end = p2roundup(int64_t(o + len), int64_t(l2_granularity)) / l2_granularity;
+
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones(o, len);
+    counter_add(available, l1._free_l1(o, len));
+    _mark_l2_free(l2_pos, l2_pos_end);
+  }
+
+  // extends the space from 'capacity' up to 'new_capacity', both are
+  // multiples of alloc unit. The new part is free.
+  void _grow(uint64_t capacity, uint64_t new_capacity)
+  {
+    auto unit = l1.get_min_alloc_size();
+    ceph_assert(capacity <= new_capacity);
+    ceph_assert((capacity % unit) == 0 && (new_capacity % unit) == 0);
+
+    std::lock_guard<std::mutex> l(lock);
+    l1._grow(new_capacity);
+    auto aligned_capacity = p2roundup((int64_t)new_capacity,
+      (int64_t)l2_granularity * CHILD_PER_SLOT);
+    l2.resize(aligned_capacity / l2_granularity / CHILD_PER_SLOT,
+      all_slot_clear);
+    if (!l3.empty()) {
+      l3.resize(div_round_up(l2.size(), bits_per_slot), all_slot_clear);
+    }
+    if (lf_zone_count) {
+      auto l1_entries = l1.l1.size() * L1::_children_per_slot();
+      lf_zone_map.resize(div_round_up(l1_entries, bits_per_slot),
+	all_slot_clear);
+    }
+    if (capacity < new_capacity) {
+      counter_add(available,
+	l1._free_l1(capacity, new_capacity - capacity));
+      _mark_l2_free(capacity / l2_granularity,
+	p2roundup(new_capacity, l2_granularity) / l2_granularity);
+    }
+  }
+  // preallocates bitmaps for up to max_capacity, hence
+  // growth doesn't need to relocate them
+  void _reserve(uint64_t max_capacity)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    l1._reserve(max_capacity);
+    auto aligned_capacity = p2roundup((int64_t)max_capacity,
+      (int64_t)l2_granularity * CHILD_PER_SLOT);
+    l2.reserve(aligned_capacity / l2_granularity / CHILD_PER_SLOT);
+  }
+  magazine_t& _get_magazine()
+  {
+    return magazines[get_thread_hash() % magazine_count];
+  }
+
+  void _refill_magazine(magazine_t& m, uint64_t length)
+  {
+    auto c = length / l1.get_min_alloc_size() - 1;
+    ceph_assert(m.count[c] == 0);
+    interval_vector_t v;
+    uint64_t allocated = 0;
+    _allocate_l2(length * MAGAZINE_BATCH, length, length, no_hint,
+      &allocated, &v);
+    for (auto& e : v) {
+      ceph_assert(e.length == length);
+      m.offsets[c][m.count[c]++] = e.offset;
+    }
+    cached_bytes += allocated;
+  }
+
+  void _drain_magazine(magazine_t& m, interval_vector_t* res)
+  {
+    auto min_alloc = l1.get_min_alloc_size();
+    for (size_t c = 0; c < MAGAZINE_CLASSES; ++c) {
+      uint64_t length = min_alloc * (c + 1);
+      for (size_t i = 0; i < m.count[c]; ++i) {
+	res->emplace_back(m.offsets[c][i], length);
+      }
+      cached_bytes -= length * m.count[c];
+      m.count[c] = 0;
+    }
+  }
+
+  void _drain_magazines()
+  {
+    if (!magazine_count) {
+      return;
+    }
+    interval_vector_t v;
+    for (size_t i = 0; i < magazine_count; ++i) {
+      std::lock_guard<std::mutex> ml(magazines[i].lock);
+      _drain_magazine(magazines[i], &v);
+    }
+    if (!v.empty()) {
+      _free_l2(v);
+    }
+  }
+
+  // count == 0 disables caching and returns all the cached extents
+  void _enable_magazines(size_t count)
+  {
+    _drain_magazines();
+    magazines.reset(count ? new magazine_t[count] : nullptr);
+    magazine_count = count;
+  }
+
+  // returns false if request isn't cacheable or no space is available
+  bool _allocate_cached(uint64_t length, uint64_t* offset)
+  {
+    auto min_alloc = l1.get_min_alloc_size();
+    if (!magazine_count || !length || (length % min_alloc) != 0 ||
+        length > min_alloc * MAGAZINE_CLASSES) {
+      return false;
+    }
+    auto c = length / min_alloc - 1;
+    auto& m = _get_magazine();
+    std::lock_guard<std::mutex> ml(m.lock);
+    if (m.count[c] == 0) {
+      _refill_magazine(m, length);
+      if (m.count[c] == 0) {
+	return false;
+      }
+    }
+    *offset = m.offsets[c][--m.count[c]];
+    cached_bytes -= length;
+    return true;
+  }
+
+  // returns false if extent isn't cacheable, caller to release it directly
+  bool _free_cached(uint64_t offset, uint64_t length)
+  {
+    auto min_alloc = l1.get_min_alloc_size();
+    if (!magazine_count || !length || (length % min_alloc) != 0 ||
+        length > min_alloc * MAGAZINE_CLASSES) {
+      return false;
+    }
+    auto c = length / min_alloc - 1;
+    auto& m = _get_magazine();
+    std::lock_guard<std::mutex> ml(m.lock);
+    if (m.count[c] == MAGAZINE_SIZE) {
+      // return the coldest half
+      interval_vector_t v;
+      v.reserve(MAGAZINE_BATCH);
+      for (size_t i = 0; i < MAGAZINE_BATCH; ++i) {
+	v.emplace_back(m.offsets[c][i], length);
+      }
+      std::copy(&m.offsets[c][MAGAZINE_BATCH], &m.offsets[c][MAGAZINE_SIZE],
+	&m.offsets[c][0]);
+      m.count[c] -= MAGAZINE_BATCH;
+      cached_bytes -= length * MAGAZINE_BATCH;
+      _free_l2(v);
+    }
+    m.offsets[c][m.count[c]++] = offset;
+    cached_bytes += length;
+    return true;
+  }
+
+  // to be called under the lock
+  void _lf_retire_zone(lf_zone_t& z)
+  {
+    auto l1_pos = z.pos.exchange(LF_ZONE_NONE);
+    if (l1_pos == LF_ZONE_NONE) {
+      return;
+    }
+    while (z.refs.load() != 0) {
+      std::this_thread::yield();
+    }
+    auto l0_gran = l1.get_min_alloc_size();
+    auto free_bytes = l1._count_free_l0(l1_pos) * l0_gran;
+    lf_available -= free_bytes;
+    counter_add(available, free_bytes);
+    l1._unclaim_l1_entry(l1_pos);
+    lf_zone_map[l1_pos / bits_per_slot] &=
+      ~(slot_t(1) << (l1_pos % bits_per_slot));
+    constexpr uint64_t l1_w = slotset_width * L1::_children_per_slot();
+    _mark_l2_on_l1(l1_pos / l1_w, l1_pos / l1_w + 1);
+  }
+
+  // retires all the zones or the ones overlapping with the specified extent,
+  // to be called under the lock
+  void _lf_retire_zones(uint64_t offset = 0, uint64_t length = 0)
+  {
+    if (!lf_zone_count) {
+      return;
+    }
+    auto l1_gran = l1._level_granularity();
+    uint64_t pos = offset / l1_gran;
+    uint64_t pos_end = length ?
+      div_round_up(offset + length, l1_gran) :
+      lf_zone_map.size() * bits_per_slot;
+    while (pos < pos_end) {
+      slot_t v = lf_zone_map[pos / bits_per_slot] >> (pos % bits_per_slot);
+      if (v == all_slot_clear) {
+	pos = p2align(pos, uint64_t(bits_per_slot)) + bits_per_slot;
+	continue;
+      }
+      pos += __builtin_ctzll(v);
+      if (pos >= pos_end) {
+	break;
+      }
+      for (size_t i = 0; i < lf_zone_count; ++i) {
+	if (lf_zones[i].pos.load() == pos) {
+	  _lf_retire_zone(lf_zones[i]);
+	}
+      }
+      ++pos;
+    }
+  }
+
+  // to be called under the lock
+  bool _lf_acquire_zone(lf_zone_t& z)
+  {
+    ceph_assert(z.pos.load() == LF_ZONE_NONE);
+    uint64_t d = CHILD_PER_SLOT;
+    constexpr uint64_t l1_w = slotset_width * L1::_children_per_slot();
+    auto pos0 = last_pos / d;
+    for (size_t i = 0; i < l2.size(); ++i) {
+      auto pos = (pos0 + i) % l2.size();
+      while (l2[pos] != all_slot_clear) {
+	uint64_t l2_pos = pos * d + __builtin_ctzll(l2[pos]);
+	int64_t l1_pos =
+	  l1._claim_l1_entry(l2_pos * l1_w, (l2_pos + 1) * l1_w);
+	_mark_l2_on_l1(l2_pos, l2_pos + 1);
+	if (l1_pos >= 0) {
+	  auto free_bytes = l1._count_free_l0(l1_pos) * l1.get_min_alloc_size();
+	  ceph_assert(available >= free_bytes);
+	  counter_sub(available, free_bytes);
+	  lf_available += free_bytes;
+	  lf_zone_map[l1_pos / bits_per_slot] |=
+	    slot_t(1) << (l1_pos % bits_per_slot);
+	  z.pos.store(l1_pos);
+	  return true;
+	}
+      }
+    }
+    return false;
+  }
+
+  // index of free runs to serve contiguous allocations from
+  void _enable_free_index(bool enable)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    l1._enable_free_index(enable);
+  }
+  // cached longest free runs to skip L1 entries on partial scans
+  void _enable_run_cache(bool enable)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    l1._enable_run_cache(enable);
+  }
+
+  // L3 summary over L2 slots to speed up scans on huge pools
+  void _enable_l3(bool enable)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    l3.clear();
+    if (enable) {
+      l3.resize(div_round_up(l2.size(), bits_per_slot), all_slot_clear);
+      _mark_l3_on_l2(0, l2.size());
+    } else {
+      l3.shrink_to_fit();
+    }
+  }
+
+  // threads to restore full snapshots with, survives _shutdown/_init
+  void _set_apply_threads(size_t threads)
+  {
+    apply_threads = std::max<size_t>(threads, 1);
+  }
+
+  // count == 0 disables the lock-free path
+  void _enable_lockfree(size_t count)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    _lf_retire_zones();
+    lf_zones.reset(count ? new lf_zone_t[count] : nullptr);
+    lf_zone_count = count;
+    lf_zone_map.clear();
+    if (count) {
+      auto l1_entries = l1.l1.size() * L1::_children_per_slot();
+      lf_zone_map.resize(div_round_up(l1_entries, bits_per_slot),
+	all_slot_clear);
+    }
+  }
+
+  // returns false if request isn't a single alloc unit or no space is left
+  bool _allocate_lockfree(uint64_t length, uint64_t* offset)
+  {
+    auto l0_gran = l1.get_min_alloc_size();
+    if (!lf_zone_count || length != l0_gran) {
+      return false;
+    }
+    auto& z = lf_zones[get_thread_hash() % lf_zone_count];
+    while (true) {
+      ++z.refs;
+      auto l1_pos = z.pos.load();
+      uint64_t l0_pos;
+      if (l1_pos != LF_ZONE_NONE && l1._allocate_l0_atomic(l1_pos, &l0_pos)) {
+	--z.refs;
+	lf_available -= length;
+	*offset = l0_pos * l0_gran;
+	return true;
+      }
+      --z.refs;
+      // zone is missing or exhausted, replace it
+      std::lock_guard<std::mutex> l(lock);
+      if (z.pos.load() == l1_pos) {
+	_lf_retire_zone(z);
+	if (!_lf_acquire_zone(z)) {
+	  return false;
+	}
+      }
+    }
+  }
+
+  // serves the request lock-free if a zone covers 'hint', returns false
+  // otherwise
+  bool _allocate_lockfree_near(uint64_t length, uint64_t hint,
+    uint64_t* offset)
+  {
+    auto l0_gran = l1.get_min_alloc_size();
+    if (!lf_zone_count || length != l0_gran) {
+      return false;
+    }
+    uint64_t l1_pos = hint / l0_gran / bits_per_slotset;
+    for (size_t i = 0; i < lf_zone_count; ++i) {
+      auto& z = lf_zones[i];
+      if (z.pos.load(std::memory_order_relaxed) != l1_pos) {
+	continue;
+      }
+      ++z.refs;
+      uint64_t l0_pos;
+      bool res = z.pos.load() == l1_pos &&
+	l1._allocate_l0_atomic(l1_pos, &l0_pos);
+      --z.refs;
+      if (res) {
+	lf_available -= length;
+	*offset = l0_pos * l0_gran;
+      }
+      return res;
+    }
+    return false;
+  }
+
+  // returns false if extent doesn't belong to a lock-free zone
+  bool _free_lockfree(uint64_t offset, uint64_t length)
+  {
+    auto l0_gran = l1.get_min_alloc_size();
+    if (!lf_zone_count || length != l0_gran) {
+      return false;
+    }
+    uint64_t l0_pos = offset / l0_gran;
+    uint64_t l1_pos = l0_pos / bits_per_slotset;
+    for (size_t i = 0; i < lf_zone_count; ++i) {
+      auto& z = lf_zones[i];
+      if (z.pos.load(std::memory_order_relaxed) != l1_pos) {
+	continue;
+      }
+      ++z.refs;
+      if (z.pos.load() == l1_pos) {
+	l1._free_l0_atomic(l0_pos);
+	lf_available += length;
+	--z.refs;
+	return true;
+      }
+      --z.refs;
+    }
+    return false;
+  }
+
+  void _shutdown()
+  {
+    _enable_magazines(0);
+    _enable_lockfree(0);
+    std::lock_guard<std::mutex> l(lock);
+    l1._shutdown();
+    l2.clear();
+    l3.clear();
+    l2_granularity = 0; // space per entry
+    available = 0;
+    last_pos = 0;
+    alloc_cnt = 0;
+  }
+  double _get_fragmentation() {
+    if constexpr (L1::lockless_fragmentation) {
+      return l1.get_fragmentation();
+    }
+    std::lock_guard<std::mutex> l(lock);
+    return l1.get_fragmentation();
+  }
+};
+
+// Sharded flavor of AllocatorLevel02. L2 index space is split into
+// independent regions (shards), each one is a standalone AllocatorLevel02
+// instance with its own lock, cursor and available counter. Threads
+// allocate from their home shard and spill to the next ones only when it's
+// exhausted. Shard boundaries are aligned with L2 slots hence shards' L0
+// bitmaps concatenated in order are identical to the non-sharded layout,
+// and so are the snapshots.
+template <class L1, class Policy = placement_default>
+class AllocatorLevel02Sharded : public AllocatorLevel
+{
+  class shard_t : public AllocatorLevel02<L1, Policy>
+  {
+    typedef AllocatorLevel02<L1, Policy> base_t;
+  public:
+    uint64_t base = 0; // shard offset within the whole space
+
+    using base_t::_init;
+    using base_t::_shutdown;
+    using base_t::_allocate_l2;
+    using base_t::_free_l2;
+    using base_t::_allocate_l2_extent;
+    using base_t::_free_l2_extent;
+    using base_t::_free_l2_batch;
+    using base_t::_mark_allocated;
+    using base_t::_mark_free;
+    using base_t::_grow;
+    using base_t::_reserve;
+    using base_t::_get_fragmentation;
+    using base_t::_get_l2_slot_size;
+    using base_t::_enable_magazines;
+    using base_t::_allocate_cached;
+    using base_t::_free_cached;
+    using base_t::_enable_lockfree;
+    using base_t::_allocate_lockfree_near;
+    using base_t::_allocate_l2_near;
+    using base_t::_enable_free_index;
+    using base_t::_enable_run_cache;
+    using base_t::_enable_l3;
+    using base_t::_set_apply_threads;
+    using base_t::_allocate_lockfree;
+    using base_t::_free_lockfree;
+
+    uint64_t get_l2_granularity() const {
+      return base_t::l2_granularity;
+    }
+    // debug_get_free() positions covered
+    uint64_t get_debug_positions() const {
+      return div_round_up(base_t::l1.get_l1_bytes() / sizeof(slot_t),
+	bits_per_slot);
+    }
+  };
+
+public:
+  uint64_t debug_get_granularity() const
+  {
+    return shards.empty() ? 0 : shards[0]->debug_get_granularity();
+  }
+  uint64_t debug_get_free(uint64_t pos0 = 0, uint64_t pos1 = 0)
+  {
+    uint64_t res = 0;
+    uint64_t slot0 = 0;
+    for (auto& s : shards) {
+      uint64_t slot1 = slot0 + s->get_debug_positions();
+      if (pos1 == 0) {
+	res += s->debug_get_free();
+      } else if (pos0 < slot1 && pos1 > slot0) {
+	res += s->debug_get_free(std::max(pos0, slot0) - slot0,
+	  std::min(pos1, slot1) - slot0);
+      }
+      slot0 = slot1;
+    }
+    return res;
+  }
+  uint64_t debug_get_allocated(uint64_t pos0 = 0, uint64_t pos1 = 0)
+  {
+    uint64_t res = 0;
+    uint64_t slot0 = 0;
+    for (auto& s : shards) {
+      uint64_t slot1 = slot0 + s->get_debug_positions();
+      if (pos1 == 0) {
+	res += s->debug_get_allocated();
+      } else if (pos0 < slot1 && pos1 > slot0) {
+	res += s->debug_get_allocated(std::max(pos0, slot0) - slot0,
+	  std::min(pos1, slot1) - slot0);
+      }
+      slot0 = slot1;
+    }
+    return res;
+  }
+
+  uint64_t get_alloc_count()
+  {
+    return alloc_cnt;
+  }
+  uint64_t get_available()
+  {
+    uint64_t res = 0;
+    for (auto& s : shards) {
+      res += s->get_available();
+    }
+    return res;
+  }
+  inline granularity_t get_min_alloc_size() const
+  {
+    return shards.empty() ? granularity_t() :
+      shards[0]->get_min_alloc_size();
+  }
+  size_t get_shard_count() const
+  {
+    return shards.size();
+  }
+  // NB: free extents spanning shard boundaries are binned separately
+  void collect_stats(
+    std::map<size_t, size_t>& bins_overall) override {
+    for (auto& s : shards) {
+      s->collect_stats(bins_overall);
+    }
+  }
+  void collect_slotset_stats(std::map<size_t, size_t>& bins_overall) const {
+    for (auto& s : shards) {
+      s->collect_slotset_stats(bins_overall);
+    }
   }
-  void collect_stats(
-    std::map<size_t, size_t>& bins_overall) override {
-
-      std::lock_guard<std::mutex> l(lock);
-      l1.collect_stats(bins_overall);
+  void add_counters(stats_t* res) const override {
+    AllocatorLevel::add_counters(res);
+    for (auto& s : shards) {
+      s->add_counters(res);
+    }
   }
 
   uint64_t get_snapshot_size() {
-    return l1.get_snapshot_size();
+    uint64_t res = 0;
+    for (auto& s : shards) {
+      res += s->get_snapshot_size();
+    }
+    return res;
   }
   uint64_t take_snapshot(void* target, uint64_t size) {
-    std::lock_guard<std::mutex> l(lock);
-    return l1.take_snapshot(target, size);
+    uint64_t res = 0;
+    uint64_t offset = 0;
+    for (auto& s : shards) {
+      if (offset >= size) {
+	break;
+      }
+      res += s->take_snapshot((uint8_t*)target + offset, size - offset);
+      offset += s->get_snapshot_size();
+    }
+    return res;
   }
   void apply_snapshot(const void* from, uint64_t size, uint64_t _alloc_cnt) {
-    std::lock_guard<std::mutex> l(lock);
-    
-    uint64_t applied_capacity = l1.apply_snapshot(from, size);
-    auto aligned_capacity = get_aligned_capacity();
-    assert(applied_capacity == aligned_capacity);
+    uint64_t offset = 0;
+    for (auto& s : shards) {
+      s->apply_snapshot((const uint8_t*)from + offset, size - offset, 0);
+      offset += s->get_snapshot_size();
+    }
     alloc_cnt = _alloc_cnt;
-    _mark_l2_on_l1(0, aligned_capacity / l2_granularity);
   }
   uint64_t take_snapshot(bufferlist& target) {
-    std::lock_guard<std::mutex> l(lock);
-    return l1.take_snapshot(target);
+    uint64_t res = 0;
+    uint64_t offset = 0;
+    for (auto& s : shards) {
+      res += s->take_snapshot(target, offset);
+      offset += s->get_snapshot_size();
+    }
+    return res;
   }
   void apply_snapshot(const bufferlist& source, uint64_t _alloc_cnt) {
-    std::lock_guard<std::mutex> l(lock);
-    uint64_t applied_capacity = l1.apply_snapshot(source);
-    auto aligned_capacity = get_aligned_capacity();
-    assert(applied_capacity == aligned_capacity);
+    uint64_t offset = 0;
+    for (auto& s : shards) {
+      s->apply_snapshot(source, 0, offset);
+      offset += s->get_snapshot_size();
+    }
+    alloc_cnt = _alloc_cnt;
+  }
+  // shards' compressed snapshots go one after another
+  uint64_t get_compressed_snapshot_size() {
+    uint64_t res = 0;
+    for (auto& s : shards) {
+      res += s->get_compressed_snapshot_size();
+    }
+    return res;
+  }
+  uint64_t take_compressed_snapshot(bufferlist& target) {
+    uint64_t offset = 0;
+    for (auto& s : shards) {
+      offset += s->take_compressed_snapshot(target, offset);
+    }
+    return offset;
+  }
+  uint64_t apply_compressed_snapshot(const bufferlist& source,
+    uint64_t _alloc_cnt) {
+    uint64_t offset = 0;
+    for (auto& s : shards) {
+      offset += s->apply_compressed_snapshot(source, 0, offset);
+    }
+    alloc_cnt = _alloc_cnt;
+    return offset;
+  }
+
+  // page numbers are global, i.e. shards' pages go in order
+  uint64_t get_snapshot_page_count() {
+    uint64_t res = 0;
+    for (auto& s : shards) {
+      res += s->get_snapshot_page_count();
+    }
+    return res;
+  }
+  size_t get_dirty_page_count() {
+    size_t res = 0;
+    for (auto& s : shards) {
+      res += s->get_dirty_page_count();
+    }
+    return res;
+  }
+  size_t take_snapshot_pages(bufferlist& target, uint64_t* pages,
+    size_t max_pages) {
+    size_t res = 0;
+    uint64_t page_base = 0;
+    for (auto& s : shards) {
+      auto n = s->take_snapshot_pages(target, pages + res, max_pages - res,
+	res * snapshot_page_bytes);
+      for (size_t i = res; i < res + n; ++i) {
+	pages[i] += page_base;
+      }
+      res += n;
+      page_base += s->get_snapshot_page_count();
+    }
+    return res;
+  }
+  void apply_snapshot_pages(const bufferlist& source, const uint64_t* pages,
+    size_t count, uint64_t _alloc_cnt) {
+    size_t i = 0;
+    uint64_t page_base = 0;
+    std::vector<uint64_t> v;
+    for (auto& s : shards) {
+      auto page_end = page_base + s->get_snapshot_page_count();
+      auto i0 = i;
+      v.clear();
+      for (; i < count && pages[i] < page_end; ++i) {
+	v.push_back(pages[i] - page_base);
+      }
+      if (!v.empty()) {
+	s->apply_snapshot_pages(source, v.data(), v.size(), 0,
+	  i0 * snapshot_page_bytes);
+      }
+      page_base = page_end;
+    }
     alloc_cnt = _alloc_cnt;
-    _mark_l2_on_l1(0, aligned_capacity / l2_granularity);
   }
 
 protected:
-  L1 l1;
-  slot_vector_t l2;
-  uint64_t l2_granularity = 0; // space per entry
-  uint64_t available = 0;
-  uint64_t last_pos = 0;
-  uint64_t alloc_cnt = 0;
+  // Shards are appended by growth while other threads iterate them.
+  // New shards are completely set up before being published via
+  // the atomic count and the storage doesn't move as long as it has
+  // been reserved (see _reserve), growth past that must not race
+  // with other calls.
+  class shard_table_t
+  {
+    std::unique_ptr<std::unique_ptr<shard_t>[]> v;
+    size_t cap = 0;
+    std::atomic<size_t> cnt = { 0 };
+  public:
+    typedef std::unique_ptr<shard_t>* iterator;
+
+    iterator begin() const { return v.get(); }
+    iterator end() const { return v.get() + size(); }
+    size_t size() const { return cnt.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+    std::unique_ptr<shard_t>& operator[](size_t i) const { return v[i]; }
+    std::unique_ptr<shard_t>& back() const { return v[size() - 1]; }
+
+    void reserve(size_t n)
+    {
+      if (n <= cap) {
+	return;
+      }
+      std::unique_ptr<std::unique_ptr<shard_t>[]> nv(
+	new std::unique_ptr<shard_t>[n]);
+      std::move(begin(), end(), nv.get());
+      v = std::move(nv);
+      cap = n;
+    }
+    void publish(std::unique_ptr<shard_t> s)
+    {
+      auto n = size();
+      if (n == cap) {
+	reserve(std::max<size_t>(cap * 2, 1));
+      }
+      v[n] = std::move(s);
+      cnt.store(n + 1, std::memory_order_release);
+    }
+    void clear()
+    {
+      cnt = 0;
+      v.reset();
+      cap = 0;
+    }
+  };
+  shard_table_t shards;
+  std::mutex grow_lock; // serializes growth
+  uint64_t shard_size = 0;
+  size_t shard_count = 0; // requested amount, 0 - one per hardware thread
+  size_t apply_threads = 1;
+  // settings to apply to the shards added on growth
+  size_t magazine_count = 0;
+  size_t lf_zone_count = 0;
+  bool free_index = false;
+  bool run_cache = false;
+  bool l3_summary = false;
+  std::atomic<uint64_t> alloc_cnt = { 0 };
 
   enum {
     CHILD_PER_SLOT = bits_per_slot, // 64
   };
 
-  uint64_t _children_per_slot() const override
+  static constexpr uint64_t _children_per_slot()
   {
     return CHILD_PER_SLOT;
   }
-  uint64_t _level_granularity() const override
+  uint64_t _level_granularity() const
   {
-    return l2_granularity;
+    return shards.empty() ? 0 : shards[0]->get_l2_granularity();
   }
-  uint64_t get_aligned_capacity() const {
-    return l2.size() * (int64_t)l2_granularity * CHILD_PER_SLOT;
+
+  // to be called prior to _init
+  void _set_shard_count(size_t count)
+  {
+    ceph_assert(shards.empty());
+    shard_count = count;
   }
 
   void _init(uint64_t capacity, uint64_t _alloc_unit, bool mark_as_free = true)
   {
+    ceph_assert(shards.empty());
     ceph_assert(isp2(_alloc_unit));
-    l1._init(capacity, _alloc_unit, mark_as_free);
-
-    l2_granularity =
-      l1._level_granularity() * l1._children_per_slot() * slotset_width;
-
-    // capacity to have slot alignment at l2
-    auto aligned_capacity =
-      p2roundup((int64_t)capacity, (int64_t)l2_granularity * CHILD_PER_SLOT);
-    size_t elem_count = aligned_capacity / l2_granularity / CHILD_PER_SLOT;
-    // we use set bit(s) as a marker for (partially) free entry
-    l2.resize(elem_count, mark_as_free ? all_slot_set : all_slot_clear);
-
-    if (mark_as_free) {
-      // capacity to have slotset alignment at l1
-      auto l2_pos_no_use =
-	p2roundup((int64_t)capacity, (int64_t)l2_granularity) / l2_granularity;
-      _mark_l2_allocated(l2_pos_no_use, aligned_capacity / l2_granularity);
-      available = p2align(capacity, _alloc_unit);
-    } else {
-      available = 0;
+    size_t count = shard_count;
+    if (!count) {
+      count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::unique_ptr<shard_t> first(new shard_t);
+    auto slot_size = first->_get_l2_slot_size(_alloc_unit);
+    shard_size = p2roundup(div_round_up(capacity, count), slot_size);
+
+    shards.reserve(div_round_up(capacity, shard_size));
+    for (uint64_t base = 0; base < capacity; base += shard_size) {
+      std::unique_ptr<shard_t> s(base ? new shard_t : first.release());
+      s->base = base;
+      s->_init(std::min(shard_size, capacity - base), _alloc_unit,
+	mark_as_free);
+      s->_set_apply_threads(apply_threads);
+      shards.publish(std::move(s));
     }
     alloc_cnt = 0;
   }
 
-  void _mark_l2_allocated(int64_t l2_pos, int64_t l2_pos_end)
+  inline shard_t& _get_shard(uint64_t offset)
   {
-    auto d = CHILD_PER_SLOT;
-    ceph_assert(0 <= l2_pos_end);
-    ceph_assert((int64_t)l2.size() >= (l2_pos_end / d));
-
-    while (l2_pos < l2_pos_end) {
-      l2[l2_pos / d] &= ~(slot_t(1) << (l2_pos % d));
-      ++l2_pos;
-    }
+    ceph_assert(offset / shard_size < shards.size());
+    return *shards[offset / shard_size];
   }
 
-  void _mark_l2_free(int64_t l2_pos, int64_t l2_pos_end)
+  // invokes fn(shard, shard_offset, length) for every piece of the extent
+  // residing at distinct shards
+  template <typename F>
+  void _for_each_shard(uint64_t offset, uint64_t length, F fn)
   {
-    auto d = CHILD_PER_SLOT;
-    ceph_assert(0 <= l2_pos_end);
-    ceph_assert((int64_t)l2.size() >= (l2_pos_end / d));
-
-    while (l2_pos < l2_pos_end) {
-        l2[l2_pos / d] |= (slot_t(1) << (l2_pos % d));
-        ++l2_pos;
+    while (length) {
+      auto& s = _get_shard(offset);
+      auto l = std::min(length, s.base + shard_size - offset);
+      fn(s, offset - s.base, l);
+      offset += l;
+      length -= l;
     }
   }
 
-  void _mark_l2_on_l1(int64_t l2_pos, int64_t l2_pos_end)
+  // invokes fn(shard, shard_hint) for every shard starting at the one
+  // holding 'hint' or the thread's home one if none, until fn returns
+  // true. The first shard gets the hint rebased, the rest no hint.
+  template <typename F>
+  void _scan_shards(uint64_t hint, F fn)
   {
-    auto d = CHILD_PER_SLOT;
-    ceph_assert(0 <= l2_pos_end);
-    ceph_assert((int64_t)l2.size() >= (l2_pos_end / d));
-
-    auto idx = l2_pos * slotset_width;
-    auto idx_end = l2_pos_end * slotset_width;
-    bool all_allocated = true;
-    while (idx < idx_end) {
-      if (!l1._is_slot_fully_allocated(idx)) {
-        all_allocated = false;
-        idx = p2roundup(int64_t(++idx), int64_t(slotset_width));
-      }
-      else {
-        ++idx;
-      }
-      if ((idx % slotset_width) == 0) {
-        if (all_allocated) {
-          l2[l2_pos / d] &= ~(slot_t(1) << (l2_pos % d));
-        }
-        else {
-          l2[l2_pos / d] |= (slot_t(1) << (l2_pos % d));
-        }
-        all_allocated = true;
-        ++l2_pos;
+    size_t n = shards.size();
+    size_t home = get_thread_hash() % n;
+    if (hint != no_hint) {
+      home = std::min(size_t(hint / shard_size), n - 1);
+      hint -= home * shard_size;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      if (fn(*shards[(home + i) % n], i == 0 ? hint : no_hint)) {
+	return;
       }
     }
   }
@@ -729,157 +3209,265 @@ protected:
     uint64_t min_length,
     uint64_t max_length,
     uint64_t hint,
-    
     uint64_t* allocated,
     interval_vector_t* res)
   {
-    uint64_t prev_allocated = *allocated;
-    uint64_t d = CHILD_PER_SLOT;
-    //ceph_assert(isp2(min_length));
-    ceph_assert(min_length <= l2_granularity);
-    ceph_assert(max_length == 0 || max_length >= min_length);
-    ceph_assert(max_length == 0 || (max_length % min_length) == 0);
-    ceph_assert(length >= min_length);
-    ceph_assert((length % min_length) == 0);
-
-    uint64_t cap = 1ull << 31;
-    if (max_length == 0 || max_length >= cap) {
-      max_length = cap;
+    if (length <= *allocated) {
+      return;
     }
+    interval_vector_t v;
+    _scan_shards(hint, [&](shard_t& s, uint64_t shard_hint) {
+      uint64_t got = 0;
+      v.clear();
+      s._allocate_l2(length - *allocated, min_length, max_length,
+	shard_hint, &got, &v);
+      for (auto& e : v) {
+	res->emplace_back(e.offset + s.base, e.length);
+      }
+      *allocated += got;
+      return length <= *allocated;
+    });
+  }
 
-    uint64_t l1_w = slotset_width * l1._children_per_slot();
+  // shard boundaries are l2 aligned hence keep the alignment
+  interval_t _allocate_l2_extent(uint64_t length, uint64_t hint = no_hint,
+    uint64_t align = 0)
+  {
+    interval_t res;
+    _scan_shards(hint, [&](shard_t& s, uint64_t shard_hint) {
+      res = s._allocate_l2_extent(length, shard_hint, align);
+      if (res.length) {
+	res.offset += s.base;
+      }
+      return res.length != 0;
+    });
+    return res;
+  }
 
-    std::lock_guard<std::mutex> l(lock);
+  void _free_l2_extent(uint64_t offset, uint64_t length)
+  {
+    _for_each_shard(offset, length, [](shard_t& s, uint64_t o, uint64_t l) {
+      s._free_l2_extent(o, l);
+    });
+  }
 
-    if (available < min_length) {
-      return;
-    }
-    if (hint != 0) {
-      last_pos = (hint / d) < l2.size() ? p2align(hint, d) : 0;
-    }
-    auto l2_pos = last_pos;
-    auto last_pos0 = last_pos;
-    auto pos = last_pos / d;
-    auto pos_end = l2.size();
-    // outer loop below is intended to optimize the performance by
-    // avoiding 'modulo' operations inside the internal loop.
-    // Looks like they have negative impact on the performance
-    for (auto i = 0; i < 2; ++i) {
-      for(; length > *allocated && pos < pos_end; ++pos) {
-	slot_t& slot_val = l2[pos];
-	size_t free_pos = 0;
-	bool all_set = false;
-	if (slot_val == all_slot_clear) {
-	  l2_pos += d;
-	  last_pos = l2_pos;
-	  continue;
-	} else if (slot_val == all_slot_set) {
-	  free_pos = 0;
-	  all_set = true;
-	} else {
-	  free_pos = find_next_set_bit(slot_val, 0);
-	  ceph_assert(free_pos < bits_per_slot);
-	}
-	do {
-	  ceph_assert(length > *allocated);
-	  bool empty = l1._allocate_l1(length,
-	    min_length,
-	    max_length,
-	    (l2_pos + free_pos) * l1_w,
-	    (l2_pos + free_pos + 1) * l1_w,
-	    allocated,
-	    res);
-	  if (empty) {
-	    slot_val &= ~(slot_t(1) << free_pos);
-	  }
-	  if (length <= *allocated || slot_val == all_slot_clear) {
-	    break;
-	  }
-	  ++free_pos;
-	  if (!all_set) {
-	    free_pos = find_next_set_bit(slot_val, free_pos);
+  template <typename T>
+  void _free_l2_batch(T& rr)
+  {
+    std::sort(rr.begin(), rr.end(),
+      [](const auto& a, const auto& b) {
+	return a.offset < b.offset;
+      });
+    // hand over sorted runs belonging to the same shard
+    interval_vector_t v;
+    shard_t* cur = nullptr;
+    for (auto& r : rr) {
+      _for_each_shard(r.offset, r.length,
+	[&](shard_t& s, uint64_t o, uint64_t l) {
+	  if (&s != cur) {
+	    if (cur) {
+	      cur->_free_l2_batch(v);
+	    }
+	    v.clear();
+	    cur = &s;
 	  }
-	} while (free_pos < bits_per_slot);
-	last_pos = l2_pos;
-	l2_pos += d;
-      }
-      l2_pos = 0;
-      pos = 0;
-      pos_end = last_pos0 / d;
+	  v.emplace_back(o, l);
+	});
+    }
+    if (cur) {
+      cur->_free_l2_batch(v);
     }
-
-    ++l2_allocs;
-    auto allocated_here = *allocated - prev_allocated;
-    ceph_assert(available >= allocated_here);
-    available -= allocated_here;
   }
 
 #ifndef NON_CEPH_BUILD
   // to provide compatibility with BlueStore's allocator interface
   void _free_l2(const interval_set<uint64_t> & rr)
   {
-    uint64_t released = 0;
-    std::lock_guard<std::mutex> l(lock);
     for (auto r : rr) {
-      released += l1._free_l1(r.first, r.second);
-      uint64_t l2_pos = r.first / l2_granularity;
-      uint64_t l2_pos_end = p2roundup(int64_t(r.first + r.second), int64_t(l2_granularity)) / l2_granularity;
-
-      _mark_l2_free(l2_pos, l2_pos_end);
+      _mark_free(r.first, r.second);
     }
-    available += released;
   }
 #endif
 
   template <typename T>
   void _free_l2(const T& rr)
   {
-    uint64_t released = 0;
-    std::lock_guard<std::mutex> l(lock);
     for (auto r : rr) {
-      released += l1._free_l1(r.offset, r.length);
-      uint64_t l2_pos = r.offset / l2_granularity;
-      uint64_t l2_pos_end = p2roundup(int64_t(r.offset + r.length), int64_t(l2_granularity)) / l2_granularity;
-
-      _mark_l2_free(l2_pos, l2_pos_end);
+      _mark_free(r.offset, r.length);
     }
-    available += released;
   }
 
   void _mark_allocated(uint64_t o, uint64_t len)
   {
-    uint64_t l2_pos = o / l2_granularity;
-    uint64_t l2_pos_end = p2roundup(int64_t(o + len), int64_t(l2_granularity)) / l2_granularity;
-
-    std::lock_guard<std::mutex> l(lock);
-    auto allocated = l1._mark_alloc_l1(o, len);
-    ceph_assert(available >= allocated);
-    available -= allocated;
-    _mark_l2_on_l1(l2_pos, l2_pos_end);
+    _for_each_shard(o, len, [](shard_t& s, uint64_t o, uint64_t l) {
+      s._mark_allocated(o, l);
+    });
   }
 
   void _mark_free(uint64_t o, uint64_t len)
   {
-    uint64_t l2_pos = o / l2_granularity;
-    uint64_t l2_pos_end = p2roundup(int64_t(o + len), int64_t(l2_granularity)) / l2_granularity;
+    _for_each_shard(o, len, [](shard_t& s, uint64_t o, uint64_t l) {
+      s._mark_free(o, l);
+    });
+  }
 
-    std::lock_guard<std::mutex> l(lock);
-    available += l1._free_l1(o, len);
-    _mark_l2_free(l2_pos, l2_pos_end);
+  void _enable_magazines(size_t count)
+  {
+    magazine_count = count;
+    for (auto& s : shards) {
+      s->_enable_magazines(count);
+    }
+  }
+  void _enable_lockfree(size_t count)
+  {
+    lf_zone_count = count;
+    for (auto& s : shards) {
+      s->_enable_lockfree(count);
+    }
+  }
+  void _enable_free_index(bool enable)
+  {
+    free_index = enable;
+    for (auto& s : shards) {
+      s->_enable_free_index(enable);
+    }
+  }
+  void _enable_run_cache(bool enable)
+  {
+    run_cache = enable;
+    for (auto& s : shards) {
+      s->_enable_run_cache(enable);
+    }
+  }
+  void _enable_l3(bool enable)
+  {
+    l3_summary = enable;
+    for (auto& s : shards) {
+      s->_enable_l3(enable);
+    }
+  }
+
+  // the last shard is extended up to the shard size first,
+  // the rest of the space goes to new shards
+  void _grow(uint64_t capacity, uint64_t new_capacity)
+  {
+    std::lock_guard<std::mutex> l(grow_lock);
+    ceph_assert(!shards.empty());
+    auto alloc_unit = get_min_alloc_size();
+    auto& last = *shards.back();
+    last._grow(capacity - last.base,
+      std::min(shard_size, new_capacity - last.base));
+    for (auto base = last.base + shard_size; base < new_capacity;
+	 base += shard_size) {
+      std::unique_ptr<shard_t> s(new shard_t);
+      s->base = base;
+      s->_init(std::min(shard_size, new_capacity - base), alloc_unit);
+      s->_set_apply_threads(apply_threads);
+      s->_enable_magazines(magazine_count);
+      s->_enable_lockfree(lf_zone_count);
+      s->_enable_free_index(free_index);
+      s->_enable_run_cache(run_cache);
+      s->_enable_l3(l3_summary);
+      shards.publish(std::move(s));
+    }
+  }
+  void _reserve(uint64_t max_capacity)
+  {
+    std::lock_guard<std::mutex> l(grow_lock);
+    ceph_assert(!shards.empty());
+    shards.reserve(div_round_up(max_capacity, shard_size));
+    shards.back()->_reserve(shard_size);
+  }
+  // shards are restored one by one, each using that many threads
+  void _set_apply_threads(size_t threads)
+  {
+    apply_threads = std::max<size_t>(threads, 1);
+    for (auto& s : shards) {
+      s->_set_apply_threads(threads);
+    }
+  }
+  bool _allocate_lockfree(uint64_t length, uint64_t* offset)
+  {
+    if (shards.empty()) {
+      return false;
+    }
+    auto& s = *shards[get_thread_hash() % shards.size()];
+    if (!s._allocate_lockfree(length, offset)) {
+      return false;
+    }
+    *offset += s.base;
+    return true;
+  }
+  // the shard holding 'hint' serves the hinted requests
+  bool _allocate_lockfree_near(uint64_t length, uint64_t hint,
+    uint64_t* offset)
+  {
+    if (hint / shard_size >= shards.size()) {
+      return false;
+    }
+    auto& s = _get_shard(hint);
+    if (!s._allocate_lockfree_near(length, hint - s.base, offset)) {
+      return false;
+    }
+    *offset += s.base;
+    return true;
+  }
+  bool _allocate_l2_near(uint64_t length, uint64_t hint, uint64_t* offset)
+  {
+    if (hint / shard_size >= shards.size()) {
+      return false;
+    }
+    auto& s = _get_shard(hint);
+    if (!s._allocate_l2_near(length, hint - s.base, offset)) {
+      return false;
+    }
+    *offset += s.base;
+    return true;
+  }
+  bool _free_lockfree(uint64_t offset, uint64_t length)
+  {
+    auto& s = _get_shard(offset);
+    if (offset + length > s.base + shard_size) {
+      return false;
+    }
+    return s._free_lockfree(offset - s.base, length);
+  }
+  bool _allocate_cached(uint64_t length, uint64_t* offset)
+  {
+    if (shards.empty()) {
+      return false;
+    }
+    auto& s = *shards[get_thread_hash() % shards.size()];
+    if (!s._allocate_cached(length, offset)) {
+      return false;
+    }
+    *offset += s.base;
+    return true;
+  }
+  bool _free_cached(uint64_t offset, uint64_t length)
+  {
+    auto& s = _get_shard(offset);
+    if (offset + length > s.base + shard_size) {
+      return false;
+    }
+    return s._free_cached(offset - s.base, length);
   }
+
   void _shutdown()
   {
-    std::lock_guard<std::mutex> l(lock);
-    l1._shutdown();
-    l2.clear();
-    l2_granularity = 0; // space per entry
-    available = 0;
-    last_pos = 0;
+    for (auto& s : shards) {
+      s->_shutdown();
+    }
+    shards.clear();
+    shard_size = 0;
     alloc_cnt = 0;
   }
   double _get_fragmentation() {
-    std::lock_guard<std::mutex> l(lock);
-    return l1.get_fragmentation();
+    double res = 0.0;
+    for (auto& s : shards) {
+      res += s->_get_fragmentation();
+    }
+    return shards.empty() ? res : res / shards.size();
   }
 };
 
@@ -101,6 +101,386 @@ std::ostream& operator<<(std::ostream& out, const C& c)
     << ")";
 }
 
+// grows the pool online, fills it past the initial capacity and
+// checks the growth survives restart
+void grow_test()
+{
+  const uint64_t capacity = 64 * 1024 * 1024;
+  const uint64_t max_capacity = 4 * capacity;
+  const size_t chunk = 1024 * 1024;
+
+  TransactionRoot* tr_ptr = TransactionRoot::create(capacity, max_capacity);
+  TransactionRoot& tr = *tr_ptr;
+  tr.prepare(64 * 1024, 1024, 64 * 1024, capacity, MIN_OBJECT_SIZE,
+    max_capacity);
+  assert(tr.get_capacity() == capacity);
+  uint64_t available = tr.get_available();
+
+  tr.grow(2 * capacity);
+  assert(tr.get_capacity() == 2 * capacity);
+  assert(tr.get_available() == available + capacity);
+
+  std::vector<uint64_t> chunks;
+  uint64_t last = 0;
+  tr.start_transaction();
+  while (chunks.size() * chunk <= capacity) {
+    chunks.push_back(tr.alloc_persistent_raw(chunk));
+    last = std::max(last, chunks.back());
+  }
+  tr.commit_transaction();
+  assert(last >= capacity);
+  assert(tr.get_available() == available + capacity - chunks.size() * chunk);
+  available = tr.get_available();
+
+  // GROW_FLAG entry is replayed from the log
+  tr.shutdown();
+  root->restart();
+  tr.restart();
+  assert(tr.get_capacity() == 2 * capacity);
+  assert(tr.get_available() == available);
+
+  tr.grow(max_capacity);
+  assert(tr.get_capacity() == max_capacity);
+  assert(tr.get_available() == available + 2 * capacity);
+
+  tr.start_transaction();
+  for (auto offs : chunks) {
+    tr.free_persistent_raw(offs, chunk);
+  }
+  tr.commit_transaction();
+  assert(tr.get_available() ==
+    available + 2 * capacity + chunks.size() * chunk);
+
+  tr.shutdown();
+  root->restart();
+  tr.restart();
+  assert(tr.get_capacity() == max_capacity);
+  assert(tr.get_available() ==
+    available + 2 * capacity + chunks.size() * chunk);
+  TransactionRoot::destroy(tr_ptr);
+}
+
+// objects bump allocated from leases are accounted per object
+// on commit, rollback and after restart
+void lease_test()
+{
+  const uint64_t capacity = 64 * 1024 * 1024;
+  const uint64_t obj_size =
+    p2roundup<uint64_t>(sizeof(A), MIN_OBJECT_SIZE) +
+    p2roundup<uint64_t>(sizeof(PObj<A>), MIN_OBJECT_SIZE);
+
+  TransactionRoot* tr_ptr = TransactionRoot::create(capacity);
+  TransactionRoot& tr = *tr_ptr;
+  tr.prepare(64 * 1024, 1024, 64 * 1024, capacity, MIN_OBJECT_SIZE);
+  tr.enable_alloc_lease(64 * 1024);
+  const uint64_t available = tr.get_available();
+
+  // the lease entry is reverted with the rest of the log
+  tr.start_transaction();
+  for (int i = 0; i < 10; i++) {
+    APtr::alloc_persistent_obj<A>(tr, i);
+  }
+  assert(tr.get_object_count() == 20);
+  tr.rollback_transaction();
+  assert(tr.get_object_count() == 0);
+  assert(tr.get_available() == available);
+
+  // the lease is trimmed to the used part on commit, an object released
+  // by the same transaction is freed then as well
+  std::vector<APtr> objs;
+  auto log_size = tr.get_alog_size();
+  tr.start_transaction();
+  for (int i = 0; i < 11; i++) {
+    objs.push_back(APtr::alloc_persistent_obj<A>(tr, i));
+  }
+  objs.back()->die(tr);
+  objs.pop_back();
+  tr.commit_transaction();
+  // a single lease entry plus the released object and its wrapper
+  assert(tr.get_alog_size() == log_size + 3);
+  assert(tr.get_object_count() == 20);
+  assert(tr.get_available() == available - objs.size() * obj_size);
+
+  // lease entry counts are replayed
+  tr.shutdown();
+  root->restart();
+  tr.restart();
+  assert(tr.get_object_count() == 20);
+  assert(tr.get_available() == available - objs.size() * obj_size);
+  {
+    tr.start_read_access();
+    for (size_t i = 0; i < objs.size(); i++) {
+      assert(objs[i]->inspect()->n1 == int(i));
+    }
+    tr.stop_read_access();
+  }
+
+  tr.start_transaction();
+  for (auto& a : objs) {
+    a->die(tr);
+  }
+  tr.commit_transaction();
+  objs.clear();
+  assert(tr.get_object_count() == 0);
+  assert(tr.get_available() == available);
+
+  tr.shutdown();
+  root->restart();
+  tr.restart();
+  assert(tr.get_object_count() == 0);
+  assert(tr.get_available() == available);
+  TransactionRoot::destroy(tr_ptr);
+}
+
+// an object and its wrapper are placed near the hint, and so is
+// the copy made by access()
+void near_test()
+{
+  const uint64_t capacity = 64 * 1024 * 1024;
+  const uint64_t near = 2 * 1024 * 1024;
+  auto is_near = [&](uint64_t a, uint64_t b) {
+    return std::max(a, b) - std::min(a, b) < near;
+  };
+
+  TransactionRoot* tr_ptr = TransactionRoot::create(capacity);
+  TransactionRoot& tr = *tr_ptr;
+  tr.prepare(64 * 1024, 1024, 64 * 1024, capacity, MIN_OBJECT_SIZE);
+
+  tr.start_transaction();
+  APtr p = APtr::alloc_persistent_obj<A>(tr, 1);
+  // moves unhinted allocations away
+  std::vector<uint64_t> chunks;
+  for (int i = 0; i < 16; i++) {
+    chunks.push_back(tr.alloc_persistent_raw(near));
+  }
+  auto hint = ptr2poffs(p->inspect());
+  APtr q = APtr::alloc_persistent_obj_near<A>(tr, hint, 2);
+  assert(is_near(ptr2poffs(q.get()), hint));
+  assert(is_near(ptr2poffs(q->inspect()), hint));
+  tr.commit_transaction();
+
+  tr.start_transaction();
+  assert(is_near(ptr2poffs(p->access(tr)), hint));
+  p->die(tr);
+  q->die(tr);
+  for (auto offs : chunks) {
+    tr.free_persistent_raw(offs, near);
+  }
+  tr.commit_transaction();
+  assert(tr.get_object_count() == 0);
+  TransactionRoot::destroy(tr_ptr);
+}
+
+// small objects are carved out of slabs, slab state is reverted
+// on rollback and rebuilt after restart
+void slab_test()
+{
+  const uint64_t capacity = 64 * 1024 * 1024;
+
+  TransactionRoot* tr_ptr = TransactionRoot::create(capacity);
+  TransactionRoot& tr = *tr_ptr;
+  tr.prepare(64 * 1024, 1024, 64 * 1024, capacity, MIN_OBJECT_SIZE);
+  tr.enable_slab_alloc(true);
+  const uint64_t available = tr.get_available();
+
+  tr.start_transaction();
+  for (int i = 0; i < 10; i++) {
+    APtr::alloc_persistent_obj<A>(tr, i);
+  }
+  assert(tr.get_object_count() == 20);
+  tr.rollback_transaction();
+  assert(tr.get_object_count() == 0);
+  assert(tr.get_available() == available);
+
+  // enough objects to fill several slabs
+  std::vector<APtr> objs;
+  tr.start_transaction();
+  for (int i = 0; i < 1000; i++) {
+    objs.push_back(APtr::alloc_persistent_obj<A>(tr, i));
+  }
+  tr.commit_transaction();
+  assert(tr.get_object_count() == 2000);
+  assert((available - tr.get_available()) % SLAB_SIZE == 0);
+
+  // released slots are reused, slabs of the rolled back transaction
+  // aren't leaked
+  tr.start_transaction();
+  for (size_t i = 0; i < objs.size(); i += 2) {
+    objs[i]->die(tr);
+  }
+  for (int i = 0; i < 1000; i++) {
+    APtr::alloc_persistent_obj<A>(tr, i);
+  }
+  tr.rollback_transaction();
+  assert(tr.get_object_count() == 2000);
+  auto used = available - tr.get_available();
+
+  tr.shutdown();
+  root->restart();
+  tr.restart();
+  assert(tr.get_object_count() == 2000);
+  assert(tr.get_available() == available - used);
+  {
+    tr.start_read_access();
+    for (size_t i = 0; i < objs.size(); i++) {
+      assert(objs[i]->inspect()->n1 == int(i));
+    }
+    tr.stop_read_access();
+  }
+
+  tr.start_transaction();
+  for (auto& a : objs) {
+    a->die(tr);
+  }
+  tr.commit_transaction();
+  objs.clear();
+  assert(tr.get_object_count() == 0);
+  assert(tr.get_available() == available);
+
+  tr.shutdown();
+  root->restart();
+  tr.restart();
+  assert(tr.get_object_count() == 0);
+  assert(tr.get_available() == available);
+  TransactionRoot::destroy(tr_ptr);
+}
+
+template <class T>
+class TestAllocator : public T
+{
+public:
+  using T::_init;
+  using T::_allocate_l2;
+  using T::_allocate_l2_extent;
+  using T::_allocate_l2_near;
+  using T::_free_l2;
+  using T::_mark_allocated;
+  using T::_mark_free;
+  using T::_shutdown;
+};
+class TestPlainAllocator :
+  public TestAllocator<AllocatorLevel02<AllocatorLevel01Loose>>
+{
+public:
+  using AllocatorLevel02<AllocatorLevel01Loose>::_get_l2_slot_size;
+};
+class TestShardedAllocator :
+  public TestAllocator<AllocatorLevel02Sharded<AllocatorLevel01Loose>>
+{
+public:
+  using AllocatorLevel02Sharded<AllocatorLevel01Loose>::_set_shard_count;
+};
+
+// the space is free apart from the extents given, checked
+// at every debug_get_free() position and over position ranges
+template <class T>
+void check_free(T& a, uint64_t capacity, const interval_vector_t& allocated)
+{
+  const uint64_t g = a.debug_get_granularity();
+  const uint64_t positions = capacity / g;
+  for (uint64_t i = 0; i < positions; i++) {
+    uint64_t used = 0;
+    for (auto& e : allocated) {
+      auto b = std::max(e.offset, i * g);
+      auto end = std::min(e.offset + e.length, (i + 1) * g);
+      used += end > b ? end - b : 0;
+    }
+    assert(a.debug_get_free(i, i + 1) == g - used);
+  }
+  assert(a.debug_get_free(1, positions - 1) ==
+    a.debug_get_free() - a.debug_get_free(0, 1) -
+    a.debug_get_free(positions - 1, positions));
+}
+
+// sharded allocator is checked against the plain one: free space over
+// ranges spanning shards, extents crossing shard boundaries and hints
+// at the very beginning of shards
+void sharded_allocator_test()
+{
+  const uint64_t capacity = 1024 * 1024 * 1024;
+  const uint64_t unit = 16;
+  const size_t shards = 4;
+  const uint64_t shard_size = capacity / shards;
+  TestPlainAllocator plain;
+  TestShardedAllocator sharded;
+  plain._init(capacity, unit);
+  sharded._set_shard_count(shards);
+  sharded._init(capacity, unit);
+
+  assert(shard_size % plain._get_l2_slot_size(unit) == 0);
+  assert(sharded.debug_get_free() == capacity);
+  check_free(plain, capacity, {});
+  check_free(sharded, capacity, {});
+
+  // extent crossing shard boundaries
+  interval_vector_t marked;
+  marked.emplace_back(shard_size - 1024 * 1024, 3 * 1024 * 1024);
+  plain._mark_allocated(marked[0].offset, marked[0].length);
+  sharded._mark_allocated(marked[0].offset, marked[0].length);
+  assert(plain.get_available() == sharded.get_available());
+  check_free(plain, capacity, marked);
+  check_free(sharded, capacity, marked);
+
+  // hints at the shard start, position 0 included
+  for (size_t i = 0; i < shards; i++) {
+    uint64_t hint = i * shard_size;
+    uint64_t offset = 0;
+    if (hint > marked[0].offset &&
+	hint < marked[0].offset + marked[0].length) {
+      // the hinted L2 entry is full, the scan proceeds past it
+      auto next = marked[0].offset + marked[0].length;
+      assert(!sharded._allocate_l2_near(unit, hint, &offset));
+      assert(!plain._allocate_l2_near(unit, hint, &offset));
+      assert(sharded._allocate_l2_extent(unit, hint).offset == next);
+      assert(plain._allocate_l2_extent(unit, hint).offset == next);
+      marked.emplace_back(next, unit);
+      continue;
+    }
+    assert(sharded._allocate_l2_near(unit, hint, &offset));
+    assert(offset == hint);
+    assert(plain._allocate_l2_near(unit, hint, &offset));
+    assert(offset == hint);
+    assert(sharded._allocate_l2_extent(unit, hint).offset == hint + unit);
+    assert(plain._allocate_l2_extent(unit, hint).offset == hint + unit);
+    marked.emplace_back(hint, 2 * unit);
+  }
+  check_free(plain, capacity, marked);
+  check_free(sharded, capacity, marked);
+
+  // request exceeding a shard is served by several
+  interval_vector_t v1, v2;
+  uint64_t allocated1 = 0, allocated2 = 0;
+  const uint64_t length = shard_size * 3 / 2;
+  plain._allocate_l2(length, unit, 0, no_hint, &allocated1, &v1);
+  sharded._allocate_l2(length, unit, 0, no_hint, &allocated2, &v2);
+  assert(allocated1 == length && allocated2 == length);
+  assert(plain.get_available() == sharded.get_available());
+  v1.insert(v1.end(), marked.begin(), marked.end());
+  v2.insert(v2.end(), marked.begin(), marked.end());
+  check_free(plain, capacity, v1);
+  check_free(sharded, capacity, v2);
+
+  plain._free_l2(v1);
+  sharded._free_l2(v2);
+  assert(plain.debug_get_free() == capacity);
+  assert(sharded.debug_get_free() == capacity);
+  assert(sharded.get_available() == capacity);
+
+  // counters are per allocator
+  TestPlainAllocator idle;
+  idle._init(capacity, unit);
+  AllocatorLevel::stats_t s;
+  idle.collect_counters(&s);
+  assert(s[AllocatorLevel::CNT_L2_ALLOCS] == 0);
+  plain.collect_counters(&s);
+  assert(s[AllocatorLevel::CNT_L2_ALLOCS] != 0);
+  sharded.collect_counters(&s);
+  assert(s[AllocatorLevel::CNT_L2_ALLOCS] != 0);
+  idle._shutdown();
+  plain._shutdown();
+  sharded._shutdown();
+}
+
 /*void alloc_l1_test();
 void alloc_l2_test();
 void alloc_l2_huge_test();
@@ -660,5 +1040,11 @@ int main()
   std::cout << ">> Press 'Enter' to proceed..." << std::endl;
   getchar();
   TransactionRoot::destroy(tr_ptr);
+
+  grow_test();
+  lease_test();
+  near_test();
+  slab_test();
+  sharded_allocator_test();
   return 0;
 }
@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <iostream>
+#include <sys/mman.h>
 
 using namespace PersistentObjects;
 
@@ -18,32 +19,82 @@ PersistencyRoot rootInstance;
 // FIXME: in fact we need to obtain that root from persistent store(pool)
 PersistencyRoot* PersistentObjects::root = &rootInstance;
 
-AllocEntry TransactionAllocator::alloc(size_t uint8_ts)
+void* PersistentObjects::map_pool(uint64_t bytes)
 {
+  // no swap space is accounted for pools larger than RAM, pages are
+  // populated on first touch. Map an alignment unit more than needed
+  // and trim it to have the base aligned.
+  auto p = (uint8_t*)mmap(nullptr, bytes + POOL_BASE_ALIGNMENT,
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+    -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  auto res = (uint8_t*)p2roundup<uintptr_t>((uintptr_t)p, POOL_BASE_ALIGNMENT);
+  if (res != p) {
+    munmap(p, res - p);
+  }
+  munmap(res + bytes, p + POOL_BASE_ALIGNMENT - res);
+  return res;
+}
+
+void PersistentObjects::unmap_pool(void* p, uint64_t bytes)
+{
+  munmap(p, bytes);
+}
+
+AllocEntry TransactionAllocator::alloc(size_t uint8_ts, uint64_t hint)
+{
+  latency_timer_t t(*this, CNT_ALLOC_LATENCY);
   const auto min_alloc = get_min_alloc_size();
-  interval_vector_t v; // FIXME minor: introduce single interval alloc request to allocator and get rid off vector here
-  uint64_t allocated = 0;
   auto l = p2roundup<uint64_t>(uint8_ts, min_alloc); // FIXME we might waste some space by doing this but bmap allocator requires min_alloc_size to be power of 2
-  _allocate_l2(l, l, l, 0, &allocated, &v);
-  assert(v.size() == 1);
-  assert(allocated >= uint8_ts);
   AllocEntry e;
-  e.offset = (uint64_t)v[0].offset;
+  // hinted requests try a lock-free zone covering the hint, then the
+  // hinted L2 entry, and proceed as unhinted ones if both are full
+  bool hinted = hint != no_hint &&
+    (_allocate_lockfree_near(l, hint, &e.offset) ||
+     _allocate_l2_near(l, hint, &e.offset));
+  if (!hinted &&
+      !_allocate_lockfree(l, &e.offset) && !_allocate_cached(l, &e.offset)) {
+    interval_t i = _allocate_l2_extent(l);
+    assert(i.length >= uint8_ts);
+    e.offset = i.offset;
+  }
   e.length = (uint32_t)l; 
 
-  alloc_cnt++;
+  _add_alloc_count(1);
   return e;
 }
 
+AllocEntry TransactionAllocator::alloc_aligned(size_t uint8_ts, size_t align,
+  uint64_t hint)
+{
+  const auto min_alloc = get_min_alloc_size();
+  if (align <= min_alloc) {
+    return alloc(uint8_ts, hint);
+  }
+  latency_timer_t t(*this, CNT_ALLOC_LATENCY);
+  auto l = p2roundup<uint64_t>(uint8_ts, min_alloc);
+  assert(l <= get_max_extent_size() && align <= get_max_extent_size());
+  interval_t i = _allocate_l2_extent(l, hint, align);
+  assert(i.length >= uint8_ts);
+  assert((i.offset % align) == 0);
+
+  _add_alloc_count(1);
+  return AllocEntry(i.offset, (uint32_t)l);
+}
+
 uint64_t TransactionAllocator::alloc(
   size_t uint8_ts,
   size_t min_size,
   bufferlist& res) {
+  latency_timer_t t(*this, CNT_ALLOC_LATENCY);
   uint64_t ret = 0;
 
   interval_vector_t intervals;
   uint64_t allocated = 0;
-  _allocate_l2(uint8_ts, min_size, uint8_ts, 0, &allocated, &intervals);
+  _allocate_l2(uint8_ts, min_size, uint8_ts, no_hint, &allocated,
+    &intervals);
 
   assert(allocated >= uint8_ts);
   res.resize(intervals.size());
@@ -53,23 +104,36 @@ uint64_t TransactionAllocator::alloc(
     res[i++].second = iv.length;
   }
 
-  alloc_cnt += intervals.size();
+  _add_alloc_count(intervals.size());
   return allocated;
 }
 
 void TransactionAllocator::free(const AllocEntry& e)
 {
+  latency_timer_t t(*this, CNT_FREE_LATENCY);
   const auto min_alloc = get_min_alloc_size();
-  interval_vector_t v(1); // FIXME minor: introduce single interval release request to allocator and get rid off vector here
-  v[0].offset = e.offset;
-  v[0].length = p2roundup<uint64_t>(e.length, min_alloc);
-  _free_l2(v);
+  auto l = p2roundup<uint64_t>(e.length, min_alloc);
+  if (!_free_lockfree(e.offset, l) && !_free_cached(e.offset, l)) {
+    _free_l2_extent(e.offset, l);
+  }
+
+  _add_alloc_count(-1);
+}
 
-  alloc_cnt--;
+void TransactionAllocator::free_batch(std::vector<AllocEntry>& entries)
+{
+  latency_timer_t t(*this, CNT_FREE_LATENCY);
+  const auto min_alloc = get_min_alloc_size();
+  for (auto& e : entries) {
+    e.length = (uint32_t)p2roundup<uint64_t>(e.length, min_alloc);
+  }
+  _free_l2_batch(entries);
+  _add_alloc_count(-int64_t(entries.size()));
 }
 
 void TransactionAllocator::free(const bufferlist& to_rel)
 {
+  latency_timer_t t(*this, CNT_FREE_LATENCY);
   interval_vector_t intervals(to_rel.size());
 
   size_t i = 0;
@@ -79,15 +143,15 @@ void TransactionAllocator::free(const bufferlist& to_rel)
     iv.length = to_rel[i].second;
   }
   _free_l2(intervals);
-  alloc_cnt += intervals.size();
+  _add_alloc_count(intervals.size());
 }
 
-void TransactionAllocator::note_alloc(const AllocEntry& e)
+void TransactionAllocator::note_alloc(const AllocEntry& e, size_t count)
 {
   assert(initialized());
   const auto min_alloc = get_min_alloc_size();
   _mark_allocated(e.offset, p2roundup<uint64_t>(e.length, min_alloc));
-  alloc_cnt++;
+  _add_alloc_count(count);
 }
 
 void TransactionAllocator::apply_release(const AllocEntry& e)
@@ -95,7 +159,21 @@ void TransactionAllocator::apply_release(const AllocEntry& e)
   assert(initialized());
   const auto min_alloc = get_min_alloc_size();
   _mark_free(e.offset, p2roundup<uint64_t>(e.length, min_alloc));
-  alloc_cnt--;
+  _add_alloc_count(-1);
+}
+
+void TransactionAllocator::trim(const AllocEntry& e, uint64_t used,
+  size_t count)
+{
+  latency_timer_t t(*this, CNT_FREE_LATENCY);
+  const auto min_alloc = get_min_alloc_size();
+  auto l = p2roundup<uint64_t>(e.length, min_alloc);
+  assert(count != 0);
+  assert(used <= l && (used % min_alloc) == 0);
+  if (used < l) {
+    _free_l2_extent(e.offset + used, l - used);
+  }
+  _add_alloc_count(count - 1);
 }
 
 void PBuffer::setup_new(TransactionRoot& t, uint64_t _offs, size_t new_size) {
@@ -126,19 +204,29 @@ void PBuffer::die(TransactionRoot& t) {
   }
 }
 
-void TransactionRoot::AllocationLog::die(TransactionRoot& t)
+void TransactionRoot::AllocationLog::release_buffers(TransactionRoot& t,
+  PBuffer& blist,
+  size_t count)
 {
-  if (snapshot_bufferlist.is_null())
+  if (blist.is_null())
     return;
 
   const AllocEntry* buf_entry =
-    reinterpret_cast<AllocEntry*>(snapshot_bufferlist.get());
-  for (auto i = 0; i < snapshot_blist_size; i++) {
+    reinterpret_cast<AllocEntry*>(blist.get());
+  for (auto i = 0; i < count; i++) {
     t.queue_for_release(buf_entry->offset, buf_entry->length);
     ++buf_entry;
   }
 
-  snapshot_bufferlist.die(t);
+  blist.die(t);
+}
+
+void TransactionRoot::AllocationLog::die(TransactionRoot& t)
+{
+  if (!snapshot_inherited) {
+    release_buffers(t, snapshot_bufferlist, snapshot_blist_size);
+  }
+  release_buffers(t, delta_bufferlist, delta_blist_size);
 }
 
 void TransactionRoot::AllocationLog::apply_allocator_snapshot(
@@ -155,33 +243,59 @@ void TransactionRoot::AllocationLog::apply_allocator_snapshot(
     snapshot_buffers[i].second = buf_entry->length;
     ++buf_entry;
   }
-  alloc.apply_snapshot(snapshot_buffers, snapshot_alloc_cnt);
-}
-
-AllocEntry TransactionRoot::AllocationLog::squeeze(TransactionRoot& t, TransactionAllocator& alloc) {
-  AllocLogEntry first = at(0);
-  assert(first.is_init());
-  
-  auto alloc_cnt0 = alloc.get_alloc_count();
+  if (snapshot_format != SNAPSHOT_FORMAT_RLE) {
+    std::cerr << "unsupported allocator snapshot format "
+              << snapshot_format << std::endl;
+    abort();
+  }
+  alloc.apply_compressed_snapshot(snapshot_buffers, snapshot_alloc_cnt);
 
-  auto need_size = sizeof(AllocationLog);
-  // NB: adjust by - 1 as sizeof(AllocationLog) takes one into account
-  need_size += sizeof(AllocLogEntry) * (alloc_log_size - 1);
+  if (delta_bufferlist.is_null())
+    return;
 
-  AllocEntry self = alloc.alloc(need_size);
-  assert(self.length >= need_size);
+  bufferlist delta_buffers(delta_blist_size);
+  buf_entry = reinterpret_cast<AllocEntry*>(delta_bufferlist.get());
+  for (size_t i = 0; i < delta_blist_size; i++) {
+    delta_buffers[i].first = poffs2ptr<uint8_t>(buf_entry->offset);
+    delta_buffers[i].second = buf_entry->length;
+    ++buf_entry;
+  }
+  // page numbers follow the buffer entries
+  const uint64_t* pages = reinterpret_cast<const uint64_t*>(buf_entry);
+  alloc.apply_snapshot_pages(delta_buffers, pages, delta_pages,
+    delta_alloc_cnt);
+}
 
-  AllocationLog* alog = poffs2ptr<AllocationLog>(self.offset);
-  alog->alloc_log_size = alloc_log_size;
-  alog->alloc_log_start = alog->alloc_log_cur = alog->alloc_log_next = 0;
+void TransactionRoot::AllocationLog::free_buffers(TransactionAllocator& alloc,
+  const bufferlist& buffers) {
+  for (auto i : buffers) {
+    alloc.free(AllocEntry(ptr2poffs(i.first), (uint32_t)i.second));
+  }
+}
 
-  need_size = alloc.get_snapshot_size();
+void TransactionRoot::AllocationLog::take_full_snapshot(TransactionRoot& t,
+  TransactionAllocator& alloc,
+  AllocationLog* alog) {
   bufferlist new_buffers;
-  auto allocated = alloc.alloc(need_size, ALLOC_SNAPSHOT_PAGE, new_buffers);
-  assert(allocated >= need_size);
-
-  need_size = new_buffers.size() * sizeof(AllocEntry);
-  AllocEntry snapshot_bufferlist = alloc.alloc(need_size);
+  AllocEntry snapshot_bufferlist;
+  uint64_t allocated;
+  while (true) {
+    // snapshot buffers allocation below might grow the compressed size
+    auto need_size = p2roundup<uint64_t>(
+      alloc.get_compressed_snapshot_size() + ALLOC_SNAPSHOT_PAGE,
+      ALLOC_SNAPSHOT_PAGE);
+    new_buffers.clear();
+    allocated = alloc.alloc(need_size, ALLOC_SNAPSHOT_PAGE, new_buffers);
+    assert(allocated >= need_size);
+
+    need_size = new_buffers.size() * sizeof(AllocEntry);
+    snapshot_bufferlist = alloc.alloc(need_size);
+    if (alloc.get_compressed_snapshot_size() <= allocated) {
+      break;
+    }
+    free_buffers(alloc, new_buffers);
+    alloc.free(snapshot_bufferlist);
+  }
   alog->snapshot_bufferlist.setup_initial(
     t.get_effective_id(),
     snapshot_bufferlist.offset,
@@ -196,11 +310,110 @@ AllocEntry TransactionRoot::AllocationLog::squeeze(TransactionRoot& t, Transacti
   }
   alog->snapshot_blist_size = j;
   alog->snapshot_alloc_cnt = alloc.get_alloc_count();
+  alog->snapshot_capacity = alloc.get_capacity();
+  alog->snapshot_format = SNAPSHOT_FORMAT_RLE;
+
+  auto captured = alloc.take_compressed_snapshot(new_buffers);
+  assert(captured <= allocated);
+  alog->snapshot_bytes = captured;
+}
+
+void TransactionRoot::AllocationLog::take_delta_snapshot(TransactionRoot& t,
+  TransactionAllocator& alloc,
+  AllocationLog* alog) {
+  // the snapshot is handed over to the new log as is
+  snapshot_inherited = true;
+  alog->snapshot_alloc_cnt = snapshot_alloc_cnt;
+  alog->snapshot_capacity = snapshot_capacity;
+  alog->snapshot_format = snapshot_format;
+  alog->snapshot_bytes = snapshot_bytes;
+  alog->snapshot_blist_size = snapshot_blist_size;
+  alog->snapshot_bufferlist = snapshot_bufferlist;
+
+  bufferlist new_buffers;
+  AllocEntry delta_bufferlist;
+  size_t page_cap;
+  while (true) {
+    page_cap = alloc.get_dirty_page_count() + ALLOC_SNAPSHOT_DELTA_SLACK;
+    auto need_size = page_cap * snapshot_page_bytes;
+    new_buffers.clear();
+    auto allocated = alloc.alloc(need_size, ALLOC_SNAPSHOT_PAGE, new_buffers);
+    assert(allocated >= need_size);
+
+    need_size = new_buffers.size() * sizeof(AllocEntry) +
+      page_cap * sizeof(uint64_t);
+    delta_bufferlist = alloc.alloc(need_size);
+    // allocations above might have dirtied more pages than we have room for
+    if (alloc.get_dirty_page_count() <= page_cap) {
+      break;
+    }
+    free_buffers(alloc, new_buffers);
+    alloc.free(delta_bufferlist);
+  }
+  alog->delta_bufferlist.setup_initial(
+    t.get_effective_id(),
+    delta_bufferlist.offset,
+    delta_bufferlist.length);
+
+  size_t j = 0;
+  AllocEntry* entries = reinterpret_cast<AllocEntry*>(alog->delta_bufferlist.get());
+  for (auto i : new_buffers) {
+    entries[j].offset = ptr2poffs(i.first);
+    entries[j].length = (uint32_t)i.second;
+    ++j;
+  }
+  alog->delta_blist_size = j;
+  alog->delta_alloc_cnt = alloc.get_alloc_count();
+
+  uint64_t* pages = reinterpret_cast<uint64_t*>(entries + j);
+  alog->delta_pages = alloc.take_snapshot_pages(new_buffers, pages, page_cap);
+  assert(alog->delta_pages == alloc.get_dirty_page_count());
+}
+
+AllocEntry TransactionRoot::AllocationLog::squeeze(TransactionRoot& t, TransactionAllocator& alloc) {
+  AllocLogEntry first = at(0);
+  assert(first.is_init());
+  // the pool might have grown since, the new log starts with
+  // the current capacity
+  first.offset = alloc.get_capacity();
+  
+  auto alloc_cnt0 = alloc.get_alloc_count();
+
+  auto need_size = sizeof(AllocationLog);
+  // NB: adjust by - 1 as sizeof(AllocationLog) takes one into account
+  need_size += sizeof(AllocLogEntry) * (alloc_log_size - 1);
+
+  AllocEntry self = alloc.alloc(need_size);
+  assert(self.length >= need_size);
+
+  AllocationLog* alog = poffs2ptr<AllocationLog>(self.offset);
+  alog->alloc_log_size = alloc_log_size;
+  alog->alloc_log_start = alog->alloc_log_cur = alog->alloc_log_next = 0;
+  alog->delta_alloc_cnt = 0;
+  alog->delta_blist_size = 0;
+  alog->delta_pages = 0;
+  alog->delta_bufferlist.setup_initial(t.get_effective_id(), 0, 0);
+  alog->snapshot_inherited = false;
   alog->next() = first;
 
-  auto captured_capacity = alloc.take_snapshot(new_buffers);
-  assert(captured_capacity >= alloc.get_capacity());
-  alog->alloc_log_base_cnt = alloc.get_alloc_count() - alloc_cnt0;
+  // squeeze cost is proportional to the allocator churn since
+  // the last full snapshot until the dirty pages are to be folded.
+  // The full snapshot size is the one captured rather than a fresh
+  // get_compressed_snapshot_size() which would scan the whole bitmap.
+  size_t inherited_cnt = 0;
+  auto delta_bytes = alloc.get_dirty_page_count() *
+    (snapshot_page_bytes + sizeof(uint64_t));
+  if (!snapshot_bufferlist.is_null() &&
+      snapshot_capacity == alloc.get_capacity() &&
+      delta_bytes * ALLOC_SNAPSHOT_FOLD < snapshot_bytes) {
+    take_delta_snapshot(t, alloc, alog);
+    // snapshot buffers and their list
+    inherited_cnt = snapshot_blist_size + 1;
+  } else {
+    take_full_snapshot(t, alloc, alog);
+  }
+  alog->alloc_log_base_cnt =
+    alloc.get_alloc_count() - alloc_cnt0 + inherited_cnt;
   return self;
 }
 
@@ -233,23 +446,30 @@ void TransactionRoot::replay()
     obj_log.reset();
   }
   AllocationLog& alog = alloc_log;
+  alog.reclaim_snapshot();
   auto i = alog.start();
   while (i != alog.cur()) {
     if (i->is_init()) {
       // [ab]use alloc log entry members as capacity/min_alloc_unit
-      allocator->init(i->offset, i->length, TR_ROOT_PREALLOC_SIZE);
+      allocator->init(i->offset, i->length, TR_ROOT_PREALLOC_SIZE,
+        max_capacity);
       //FIXME: we'll need to init root base here once real PM is used 
       //assert(root->base == 0);
       //root->base = allocator.get_capacity(); // FIXME: access and allocate PMem. Do mmap?
       alog.apply_allocator_snapshot(*allocator);
+    } else if (i->is_grow()) {
+      allocator->grow(i->offset);
     } else if (i->is_release()) {
       allocator->apply_release(*i);
+    } else if (i->is_lease()) {
+      allocator->note_alloc(*i, i->get_lease_count());
     } else {
       allocator->note_alloc(*i);
     }
     ++i;
   }
   assert(allocator->initialized());
+  replay_slabs();
   in_transaction = false;
   set_Transaction_root(nullptr);
 }
@@ -285,6 +505,7 @@ int TransactionRoot::commit_transaction()
 {
   assert(idPrev < idNext);
 
+  finalize_leases();
   if (((AllocationLog&)alloc_log).get_log_size() > alog_squeeze_threshold) {
     std::cerr << "doing log squeeze" << std::endl;
     AllocEntry e = ((AllocationLog&)alloc_log).squeeze(*this, *allocator);
@@ -292,6 +513,8 @@ int TransactionRoot::commit_transaction()
     alloc_log.setup(*this, e);
   }
 
+  std::vector<AllocEntry> released;
+  release_batch = &released;
   // NB: objects2release might grow during the enumeration
   for (size_t pos = 0; pos < objects2release->size(); pos++) {
 
@@ -304,6 +527,9 @@ int TransactionRoot::commit_transaction()
     }
   }
   objects2release->clear();
+  commit_slabs();
+  release_batch = nullptr;
+  allocator->free_batch(released);
   in_transaction = false;
   set_Transaction_root(nullptr);
 
@@ -318,6 +544,7 @@ int TransactionRoot::commit_transaction()
   // the same handling as above here - ignore the diff if no transaction
   // is in progress
   obj_log.reset();
+  finalize_slabs();
 
   UNLOCK;
   return 0;
@@ -328,15 +555,20 @@ int TransactionRoot::rollback_transaction()
   assert(idPrev < idNext);
 
   objects2release->clear();
+  rollback_slabs();
+  // leases are released along with the rest of alloc log
+  leases->clear();
 
   // revert allocations
+  std::vector<AllocEntry> allocated;
   auto i = ((AllocationLog&)alloc_log).cur();
   while (i != ((AllocationLog&)alloc_log).end()) {
     if (!i->is_release()) {
-      allocator->free(*i);
+      allocated.emplace_back(i->offset, i->length);
     }
     ++i;
   }
+  allocator->free_batch(allocated);
   ((AllocationLog&)alloc_log).rollback();
   {
     auto i = obj_log.start();
@@ -355,6 +587,22 @@ int TransactionRoot::rollback_transaction()
   return 0;
 }
 
+void TransactionRoot::grow(uint64_t new_capacity)
+{
+  assert(!in_transaction);
+  assert(new_capacity <= max_capacity);
+  start_transaction();
+  if (new_capacity > allocator->get_capacity()) {
+    // bitmaps are preallocated hence this takes time proportional
+    // to the growth only
+    AllocLogEntry& e = ((AllocationLog&)alloc_log).next();
+    e.set(new_capacity, 0, AllocLogEntry::GROW_FLAG);
+    allocator->grow(new_capacity);
+    slabs->index.resize(new_capacity / SLAB_SIZE);
+  }
+  commit_transaction();
+}
+
 void TransactionRoot::queue_in_progress(
   PObjRecoverable* obj,
   TransactionId tid,
@@ -363,9 +611,274 @@ void TransactionRoot::queue_in_progress(
   obj_log.push_back(ObjLogEntry(ptr2poffs(obj), tid, offs)); // FIXME minor: implement as emplace_back?
 }
 
-void* PObjBase::operator new(size_t sz, TransactionRoot& tr, size_t dummy)
+uint64_t TransactionRoot::alloc_leased_raw(size_t uint8_ts)
+{
+  auto l = p2roundup<uint64_t>(uint8_ts, allocator->get_min_alloc_size());
+  auto& active = leases->active;
+  if (active.empty() ||
+      active.back().used + l > active.back().length ||
+      active.back().count == AllocLogEntry::LEASE_COUNT_MAX) {
+    // the tail of the previous lease is kept till commit
+    Lease n;
+    n.entry = &((AllocationLog&)alloc_log).next();
+    auto e = allocator->alloc(lease_size);
+    n.entry->set(e, AllocLogEntry::LEASE_FLAG);
+    n.offset = e.offset;
+    n.length = e.length;
+    active.push_back(std::move(n));
+  }
+  auto& lease = active.back();
+  auto res = lease.offset + lease.used;
+  lease.used += l;
+  // the first object is accounted by the lease entry itself
+  if (lease.count++) {
+    leases->extra.fetch_add(1, std::memory_order_relaxed);
+  }
+  return res;
+}
+
+bool TransactionRoot::free_leased_raw(uint64_t offs, size_t len)
+{
+  for (auto& lease : leases->active) {
+    if (lease.owns(offs)) {
+      // lease entry accounts the object until commit
+      lease.released.emplace_back(offs, (uint32_t)len);
+      return true;
+    }
+  }
+  return false;
+}
+
+void TransactionRoot::finalize_leases()
+{
+  for (auto& lease : leases->active) {
+    // the entry isn't committed yet hence is safe to update in place
+    lease.entry->set(lease.offset, (uint32_t)lease.used,
+      AllocLogEntry::LEASE_FLAG |
+        (uint32_t(lease.count) << AllocLogEntry::LEASE_COUNT_SHIFT));
+    allocator->trim(AllocEntry(lease.offset, (uint32_t)lease.length),
+      lease.used, lease.count);
+    // the allocator accounts the objects from now on
+    leases->extra.fetch_sub(lease.count - 1, std::memory_order_relaxed);
+    for (auto& e : lease.released) {
+      free_persistent_extent(e.offset, e.length);
+    }
+  }
+  leases->clear();
+}
+
+uint64_t TransactionRoot::alloc_slab_raw(size_t uint8_ts, uint64_t hint)
+{
+  auto c = SlabHeader::get_class(uint8_ts);
+  auto& partial = slabs->partial[c];
+  SlabHeader* s = nullptr;
+  if (hint != no_hint && slabs->owns(hint)) {
+    // hinted slab is used regardless of being listed as partial
+    s = poffs2ptr<SlabHeader>(p2align(hint, SLAB_SIZE));
+    if (s->size_class != c || slabs->get(ptr2poffs(s)).full(s)) {
+      s = nullptr;
+    }
+  }
+  while (!s && !partial.empty()) {
+    s = poffs2ptr<SlabHeader>(partial.back());
+    auto& slab = slabs->get(partial.back());
+    if (!slab.full(s)) {
+      break;
+    }
+    slab.listed = false;
+    partial.pop_back();
+    s = nullptr;
+  }
+  if (!s) {
+    s = create_slab(c, hint);
+  }
+  touch_slab(s);
+  ++slabs->get(ptr2poffs(s)).used;
+  slabs->object_count.fetch_add(1, std::memory_order_relaxed);
+  return ptr2poffs(s) + s->alloc_slot() * s->slot_size();
+}
+
+void TransactionRoot::free_slab_raw(uint64_t offs)
+{
+  auto slab_offs = p2align(offs, SLAB_SIZE);
+  SlabHeader* s = poffs2ptr<SlabHeader>(slab_offs);
+  auto& slab = slabs->get(slab_offs);
+  touch_slab(s);
+  s->free_slot(uint32_t((offs - slab_offs) / s->slot_size()));
+  --slab.used;
+  slabs->object_count.fetch_sub(1, std::memory_order_relaxed);
+  if (!slab.listed) {
+    slab.listed = true;
+    slabs->partial[s->size_class].push_back(slab_offs);
+  }
+}
+
+SlabHeader* TransactionRoot::create_slab(size_t size_class, uint64_t hint)
+{
+  auto offs = alloc_persistent_extent(SLAB_SIZE, SLAB_SIZE, hint);
+  SlabHeader* s = new (poffs2ptr<void>(offs)) SlabHeader(size_class);
+  auto tid = get_effective_id();
+  s->tid = s->created_tid = tid;
+  s->next = slab_heads[size_class];
+  if (s->next) {
+    poffs2ptr<SlabHeader>(s->next)->prev = offs;
+  }
+  slab_heads[size_class] = offs;
+
+  auto& slab = slabs->get(offs);
+  slab.owned = true;
+  slab.listed = true;
+  slab.used = s->first_slot();
+  slabs->slab_count.fetch_add(1, std::memory_order_relaxed);
+  slabs->touched.push_back(offs);
+  slabs->partial[size_class].push_back(offs);
+  return s;
+}
+
+void TransactionRoot::touch_slab(SlabHeader* s)
+{
+  auto tid = get_effective_id();
+  if (s->tid != tid) {
+    // the previous modifier is either committed or has been reverted
+    memcpy(s->committed, s->working, sizeof(s->committed));
+    s->tid = tid;
+    slabs->touched.push_back(ptr2poffs(s));
+  }
+}
+
+void TransactionRoot::unlink_slab(SlabHeader* s)
+{
+  auto offs = ptr2poffs(s);
+  if (s->prev) {
+    poffs2ptr<SlabHeader>(s->prev)->next = s->next;
+  } else {
+    assert(slab_heads[s->size_class] == offs);
+    slab_heads[s->size_class] = s->next;
+  }
+  if (s->next) {
+    poffs2ptr<SlabHeader>(s->next)->prev = s->prev;
+  }
+  auto& slab = slabs->get(offs);
+  if (slab.listed) {
+    auto& partial = slabs->partial[s->size_class];
+    partial.erase(std::find(partial.begin(), partial.end(), offs));
+  }
+  slab = SlabState::Slab();
+  slabs->slab_count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void TransactionRoot::commit_slabs()
+{
+  // release empty slabs, they're unlinked once the transaction is committed
+  auto tid = get_effective_id();
+  for (auto offs : slabs->touched) {
+    SlabHeader* s = poffs2ptr<SlabHeader>(offs);
+    if (slabs->get(offs).empty(s)) {
+      s->dead_tid = tid;
+      free_persistent_extent(offs, SLAB_SIZE);
+    }
+  }
+}
+
+void TransactionRoot::finalize_slabs()
+{
+  for (auto offs : slabs->touched) {
+    SlabHeader* s = poffs2ptr<SlabHeader>(offs);
+    if (s->dead_tid) {
+      unlink_slab(s);
+    }
+  }
+  slabs->touched.clear();
+}
+
+void TransactionRoot::rollback_slabs()
+{
+  auto tid = get_effective_id();
+  for (auto offs : slabs->touched) {
+    SlabHeader* s = poffs2ptr<SlabHeader>(offs);
+    auto& slab = slabs->get(offs);
+    slabs->object_count.fetch_sub(slab.get_object_count(s),
+      std::memory_order_relaxed);
+    if (s->created_tid == tid) {
+      // slab extent is released along with the rest of alloc log
+      unlink_slab(s);
+      continue;
+    }
+    s->revert();
+    slab.used = s->count_used();
+    // transaction id is reused after rollback
+    s->tid = 0;
+    slabs->object_count.fetch_add(slab.get_object_count(s),
+      std::memory_order_relaxed);
+    if (!slab.listed && !slab.full(s)) {
+      slab.listed = true;
+      slabs->partial[s->size_class].push_back(offs);
+    }
+  }
+  slabs->touched.clear();
+}
+
+void TransactionRoot::replay_slabs()
+{
+  delete slabs;
+  slabs = new SlabState(allocator->get_capacity());
+  TransactionId stable_id = idPrev;
+  for (size_t c = 0; c < SLAB_CLASSES; c++) {
+    uint64_t prev = 0;
+    uint64_t* link = &slab_heads[c];
+    uint64_t offs = *link;
+    while (offs) {
+      SlabHeader* s = poffs2ptr<SlabHeader>(offs);
+      auto next = s->next;
+      // drop slabs either created by uncommitted transaction or
+      // released by committed one
+      if (s->created_tid <= stable_id &&
+          (s->dead_tid == 0 || s->dead_tid > stable_id)) {
+        if (s->tid <= stable_id) {
+          memcpy(s->committed, s->working, sizeof(s->committed));
+        }
+        s->revert();
+        s->tid = 0;
+        s->dead_tid = 0;
+        auto& slab = slabs->get(offs);
+        slab.owned = true;
+        slab.used = s->count_used();
+        slab.listed = !slab.full(s);
+        if (slab.listed) {
+          slabs->partial[c].push_back(offs);
+        }
+        slabs->slab_count.fetch_add(1, std::memory_order_relaxed);
+        slabs->object_count.fetch_add(slab.get_object_count(s),
+      std::memory_order_relaxed);
+
+        *link = offs;
+        s->prev = prev;
+        prev = offs;
+        link = &s->next;
+      }
+      offs = next;
+    }
+    *link = 0;
+  }
+}
+
+void* PObjBase::operator new(size_t sz, TransactionRoot& tr, uint64_t hint)
+{
+  return reinterpret_cast<void*>(
+    tr.alloc_persistent_raw(sz, 0, hint) + root->base);
+}
+void* PObjBase::operator new(size_t sz, std::align_val_t al,
+  TransactionRoot& tr, uint64_t hint)
+{
+  // persistent offsets are aligned as long as the base is
+  assert((root->base % size_t(al)) == 0);
+  return reinterpret_cast<void*>(
+    tr.alloc_persistent_raw(sz, size_t(al), hint) + root->base);
+}
+void PObjBase::operator delete(void* ptr, std::align_val_t,
+  TransactionRoot& tr, size_t len)
 {
-  return reinterpret_cast<void*>(tr.alloc_persistent_raw(sz) + root->base);
+  operator delete(ptr, tr, len);
 }
 void PObjBase::operator delete(void* ptr, TransactionRoot& tr, size_t len)
 {
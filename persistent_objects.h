@@ -10,6 +10,9 @@
 #include <assert.h>
 #include <limits>
 #include <shared_mutex>
+#include <cstring>
+#include <cstdlib>
+#include <new>
 
 #include <iostream>
 
@@ -29,17 +32,50 @@ namespace PersistentObjects
     AllocEntry() {}
     AllocEntry(uint64_t o, uint32_t l) : offset(o), length(l) {}
   };
-  class TransactionAllocator : public AllocatorLevel02<AllocatorLevel01Loose>
+#ifdef PMEM_COMPACT_L1
+  // halves L1 memory footprint at some allocation speed cost
+  typedef AllocatorLevel01Compact TransactionAllocatorL1;
+#else
+  typedef AllocatorLevel01Loose TransactionAllocatorL1;
+#endif
+#if defined(PMEM_NEXT_FIT_ALLOCATOR)
+  typedef placement_next_fit TransactionAllocatorPlacement;
+#elif defined(PMEM_FIRST_FIT_ALLOCATOR)
+  typedef placement_first_fit TransactionAllocatorPlacement;
+#elif defined(PMEM_BEST_FIT_ALLOCATOR)
+  typedef placement_best_fit TransactionAllocatorPlacement;
+#else
+  typedef placement_default TransactionAllocatorPlacement;
+#endif
+#ifdef PMEM_SHARDED_ALLOCATOR
+  typedef AllocatorLevel02Sharded<TransactionAllocatorL1,
+    TransactionAllocatorPlacement> TransactionAllocatorBase;
+#else
+  typedef AllocatorLevel02<TransactionAllocatorL1,
+    TransactionAllocatorPlacement> TransactionAllocatorBase;
+#endif
+  class TransactionAllocator : public TransactionAllocatorBase
   {
     uint64_t capacity = 0;
+
+    // allocations are counted outside the allocator lock, concurrently
+    // with the lock-free and cached paths
+    void _add_alloc_count(int64_t delta) {
+      alloc_cnt.fetch_add(delta, std::memory_order_relaxed);
+    }
   public:
     bool initialized() const {
       return capacity != 0;
     }
-    void init(uint64_t size, uint32_t alloc_unit, uint32_t prealloc_size) {
+    // non-zero 'max_size' preallocates the bitmaps to grow up to that size
+    void init(uint64_t size, uint32_t alloc_unit, uint32_t prealloc_size,
+      uint64_t max_size = 0) {
       assert(!initialized()); // duplicate init check
       assert(prealloc_size % alloc_unit == 0);
      _init(size, alloc_unit);
+     if (max_size > size) {
+       _reserve(max_size);
+     }
      capacity = size;
      AllocEntry first(0, prealloc_size);
      note_alloc(first);
@@ -48,17 +84,65 @@ namespace PersistentObjects
       capacity = 0;
       _shutdown();
     }
+    // per-thread caches of small extents, count == 0 turns them off
+    void enable_magazines(size_t count) {
+      _enable_magazines(count);
+    }
+    // lock-free path for single alloc unit requests
+    // using count zones, count == 0 turns it off
+    void enable_lockfree(size_t count) {
+      _enable_lockfree(count);
+    }
+    // index of free extents for contiguous allocations
+    void enable_free_index(bool enable) {
+      _enable_free_index(enable);
+    }
+    // cached longest free run per L1 entry for contiguous allocations
+    void enable_run_cache(bool enable) {
+      _enable_run_cache(enable);
+    }
+    // summary level above L2 for free space search on huge pools
+    void enable_l3_summary(bool enable) {
+      _enable_l3(enable);
+    }
+    // threads to restore allocator snapshot with
+    void enable_parallel_apply(size_t threads) {
+      _set_apply_threads(threads);
+    }
 
-    AllocEntry alloc(size_t uint8_ts);
+    // 'hint' is a persistent offset to place the extent near (no_hint if
+    // none). It's served by a lock-free zone or the allocator entry
+    // covering it if possible, as unhinted requests otherwise.
+    AllocEntry alloc(size_t uint8_ts, uint64_t hint = no_hint);
+    // the extent starts at a multiple of 'align' (power of 2).
+    // Both the length and the alignment are limited by the space covered
+    // by a single L2 entry (get_max_extent_size()), larger requests abort.
+    AllocEntry alloc_aligned(size_t uint8_ts, size_t align,
+      uint64_t hint = no_hint);
+    uint64_t get_max_extent_size() const {
+      return _level_granularity();
+    }
     uint64_t alloc(size_t uint8_ts, size_t min_size, bufferlist& res);
     void free(const AllocEntry& e);
     void free(const bufferlist& to_release);
-    void note_alloc(const AllocEntry& e);
+    // releases all the entries at once, reorders the vector
+    void free_batch(std::vector<AllocEntry>& entries);
+    // 'count' allocations packed into the extent
+    void note_alloc(const AllocEntry& e, size_t count = 1);
     void apply_release(const AllocEntry& e);
+    // releases the extent tail past 'used' bytes, the rest is accounted
+    // as 'count' allocations from now on
+    void trim(const AllocEntry& e, uint64_t used, size_t count);
 
     uint64_t get_capacity() const {
       return capacity;
     }
+    // the space added is free
+    void grow(uint64_t new_size) {
+      assert(initialized());
+      _grow(capacity, new_size);
+      capacity = new_size;
+    }
   };
 
   typedef uint64_t TransactionId;
@@ -68,8 +152,14 @@ namespace PersistentObjects
 
   struct PObjBase
   {
-    void* operator new(size_t sz, TransactionRoot& tr, size_t dummy);
+    // 'hint' is a persistent offset to place the object near, no_hint if none
+    void* operator new(size_t sz, TransactionRoot& tr, uint64_t hint);
     void operator delete(void* p, TransactionRoot&, size_t len);
+    // picked by the compiler for over-aligned types, e.g. alignas(64)
+    void* operator new(size_t sz, std::align_val_t al, TransactionRoot& tr,
+      uint64_t hint);
+    void operator delete(void* p, std::align_val_t al, TransactionRoot& tr,
+      size_t len);
     void destroy(TransactionRoot& tr, size_t len, dtor destroy_fn);
   };
   struct PObjBaseDestructor
@@ -100,7 +190,97 @@ namespace PersistentObjects
 
   const uint64_t MIN_OBJECT_SIZE = sizeof(PObjRecoverable);
   const size_t ALLOC_SNAPSHOT_PAGE = 4096;
+  // squeeze persists allocator pages modified since the last full snapshot
+  // only, and takes a new full one when they reach 1/ALLOC_SNAPSHOT_FOLD
+  // of its (compressed) size
+  const size_t ALLOC_SNAPSHOT_FOLD = 4;
+  // spare room for pages dirtied by allocating the delta buffers themselves
+  const size_t ALLOC_SNAPSHOT_DELTA_SLACK = 4;
   const uint32_t TR_ROOT_PREALLOC_SIZE = 64 * 1024;
+  // pool mapping alignment, allocations aligned up to that value
+  // are aligned in memory as well
+  const uint64_t POOL_BASE_ALIGNMENT = 2 * 1024 * 1024;
+
+  // Slab layer: objects up to SLAB_MAX_OBJECT_SIZE are carved out of
+  // SLAB_SIZE extents, the latter are the only ones going through
+  // the alloc log.
+  const uint64_t SLAB_SIZE = 64 * 1024;
+  const size_t SLAB_CLASSES = 7; // 16, 32, ..., 1024 bytes
+  const size_t SLAB_MAX_OBJECT_SIZE = MIN_OBJECT_SIZE << (SLAB_CLASSES - 1);
+
+  // Persistent slab header, placed at the beginning of slab extent.
+  // 'working' bitmap tracks slots in use, 'committed' one keeps the state
+  // as of the last committed transaction prior to 'tid'. Volatile state
+  // is kept apart, see TransactionRoot::SlabState.
+  struct SlabHeader
+  {
+    enum {
+      BITMAP_WORDS = SLAB_SIZE / MIN_OBJECT_SIZE / 64,
+    };
+    TransactionId tid = 0; // the last transaction modified 'working'
+    TransactionId created_tid = 0;
+    TransactionId dead_tid = 0; // the transaction released the slab
+    uint64_t next = 0;
+    uint64_t prev = 0;
+    uint32_t size_class = 0;
+
+    uint64_t committed[BITMAP_WORDS];
+    uint64_t working[BITMAP_WORDS];
+
+    SlabHeader(uint32_t _size_class) : size_class(_size_class) {
+      memset(committed, 0, sizeof(committed));
+      memset(working, 0, sizeof(working));
+      // slots occupied by the header are permanently in use
+      for (uint32_t i = 0; i < first_slot(); i++) {
+        working[i / 64] |= 1ull << (i % 64);
+      }
+      memcpy(committed, working, sizeof(committed));
+    }
+    static size_t get_class(size_t len) {
+      size_t c = 0;
+      while ((MIN_OBJECT_SIZE << c) < len) {
+        ++c;
+      }
+      return c;
+    }
+    uint64_t slot_size() const {
+      return MIN_OBJECT_SIZE << size_class;
+    }
+    uint32_t slot_count() const {
+      return uint32_t(SLAB_SIZE / slot_size());
+    }
+    uint32_t first_slot() const {
+      return uint32_t((sizeof(SlabHeader) + slot_size() - 1) / slot_size());
+    }
+    // slots in use, header's ones included
+    uint32_t count_used() const {
+      uint32_t res = 0;
+      for (size_t i = 0; i < slot_count() / 64; i++) {
+        res += __builtin_popcountll(working[i]);
+      }
+      return res;
+    }
+    uint32_t alloc_slot() {
+      for (size_t i = 0; i < slot_count() / 64; i++) {
+        if (~working[i]) {
+          auto bit = __builtin_ctzll(~working[i]);
+          working[i] |= 1ull << bit;
+          return uint32_t(i * 64 + bit);
+        }
+      }
+      assert(false);
+      return 0;
+    }
+    void free_slot(uint32_t pos) {
+      assert(pos >= first_slot() && pos < slot_count());
+      assert(working[pos / 64] & (1ull << (pos % 64)));
+      working[pos / 64] &= ~(1ull << (pos % 64));
+    }
+    // brings 'working' back to the committed state
+    void revert() {
+      memcpy(working, committed, sizeof(working));
+    }
+  };
   /*template <class T>
   T* alloc_persistent(size_t size = 1) {
     return new T[size];
@@ -115,6 +295,7 @@ namespace PersistentObjects
   {
     uint64_t runId = 1;
     uint64_t base = 0;
+    uint64_t size = 0; // mapped at base
     void init()
     {
       // FIXME: this should be mapped to mmap result?
@@ -130,6 +311,10 @@ namespace PersistentObjects
 
   // FIXME: in fact we need to obtain that root from persistent store(pool)
   extern PersistencyRoot* root;
+  // pool memory is reserved rather than committed upfront, 'bytes' is
+  // a multiple of POOL_BASE_ALIGNMENT
+  void* map_pool(uint64_t bytes);
+  void unmap_pool(void* p, uint64_t bytes);
   template <class T>
   uint64_t ptr2poffs(T* ptr) {
     uint64_t offs = reinterpret_cast<uint64_t>(ptr);
@@ -313,6 +498,10 @@ namespace PersistentObjects
       enum {
         RELEASE_FLAG = 1,
         INIT_FLAG = 2,
+        LEASE_FLAG = 4, // objects count is kept in the upper bits
+        GROW_FLAG = 8, // offset is the new capacity
+        LEASE_COUNT_SHIFT = 8,
+        LEASE_COUNT_MAX = (1 << (32 - LEASE_COUNT_SHIFT)) - 1,
       };
       uint32_t flags;
       inline bool is_release() const {
@@ -321,6 +510,15 @@ namespace PersistentObjects
       inline bool is_init() const {
         return flags & INIT_FLAG;
       }
+      inline bool is_lease() const {
+        return flags & LEASE_FLAG;
+      }
+      inline bool is_grow() const {
+        return flags & GROW_FLAG;
+      }
+      inline size_t get_lease_count() const {
+        return flags >> LEASE_COUNT_SHIFT;
+      }
       void set(const AllocEntry& e, uint32_t _flags) {
         offset = e.offset;
         length = e.length;
@@ -355,15 +553,43 @@ namespace PersistentObjects
     };
 
     class AllocationLog : public PObjBase {
+    public:
+      // full snapshot encoding, recorded to reject unknown ones on replay.
+      // Zero is left unused, the log layout differs from the one before
+      // compression anyway.
+      enum {
+        SNAPSHOT_FORMAT_RLE = 1,
+      };
+    private:
       size_t alloc_log_size = 0;
       size_t alloc_log_start = 0; // needful?
       size_t alloc_log_cur = 0;
       size_t alloc_log_next = 0;
       size_t alloc_log_base_cnt = 0;
       uint64_t snapshot_alloc_cnt = 0;
+      uint64_t snapshot_capacity = 0;
       size_t snapshot_blist_size = 0;
-      PBuffer snapshot_bufferlist;
+      uint32_t snapshot_format = SNAPSHOT_FORMAT_RLE;
+      uint64_t snapshot_bytes = 0; // encoded size
+      PBuffer snapshot_bufferlist; // encoded as per snapshot_format
+      // pages modified since the snapshot above:
+      // AllocEntry[delta_blist_size] followed by uint64_t[delta_pages]
+      uint64_t delta_alloc_cnt = 0;
+      size_t delta_blist_size = 0;
+      size_t delta_pages = 0;
+      PBuffer delta_bufferlist;
+      bool snapshot_inherited = false; // the successor owns the snapshot
       AllocLogEntry log[1];
+
+      void release_buffers(TransactionRoot& t, PBuffer& blist, size_t count);
+      static void free_buffers(TransactionAllocator& alloc,
+                               const bufferlist& buffers);
+      void take_full_snapshot(TransactionRoot& t,
+                              TransactionAllocator& alloc,
+                              AllocationLog* alog);
+      void take_delta_snapshot(TransactionRoot& t,
+                               TransactionAllocator& alloc,
+                               AllocationLog* alog);
     public:
       typedef LogIteratorProto<AllocationLog, AllocLogEntry> Iterator;
       Iterator start() {
@@ -392,7 +618,15 @@ namespace PersistentObjects
         alog->alloc_log_base_cnt = alloc.get_alloc_count() - alloc_cnt0;
         alog->snapshot_blist_size = 0;
         alog->snapshot_alloc_cnt = 0;
+        alog->snapshot_capacity = 0;
+        alog->snapshot_format = SNAPSHOT_FORMAT_RLE;
+        alog->snapshot_bytes = 0;
         alog->snapshot_bufferlist.setup_initial(tid, 0, 0);
+        alog->delta_alloc_cnt = 0;
+        alog->delta_blist_size = 0;
+        alog->delta_pages = 0;
+        alog->delta_bufferlist.setup_initial(tid, 0, 0);
+        alog->snapshot_inherited = false;
         alog->next() = first;
         alog->next().set(self, 0);
         alog->commit();
@@ -425,10 +659,25 @@ namespace PersistentObjects
       size_t get_base_cnt() const {
         return alloc_log_base_cnt;
       }
+      // the current log always owns its snapshot, this undoes
+      // the handover done by a squeeze which hasn't been committed
+      void reclaim_snapshot() {
+        snapshot_inherited = false;
+      }
     };
     PUniquePtr <AllocationLog> alloc_log;
     size_t alloc_base_cnt = 0;
     size_t alog_squeeze_threshold = 0;
+    size_t alloc_magazines = 0;
+    size_t alloc_lockfree_zones = 0;
+    bool slab_alloc = false;
+    size_t lease_size = 0;
+    bool alloc_free_index = false;
+    bool alloc_run_cache = false;
+    bool alloc_l3_summary = false;
+    size_t restart_threads = 0;
+    uint64_t max_capacity = 0; // pool space reserved for growth
+    uint64_t slab_heads[SLAB_CLASSES] = { 0 }; // per size class slab lists
     VPtr<TransactionAllocator> allocator;
 
     std::atomic<int> readers_count; // debug only
@@ -500,6 +749,113 @@ namespace PersistentObjects
 
     std::vector<PObjBaseDestructor>* objects2release = nullptr;
     std::shared_mutex* lock = nullptr;
+    // collects extents released during commit to free them at once
+    std::vector<AllocEntry>* release_batch = nullptr;
+
+    // volatile slab state, rebuilt on replay
+    struct SlabState
+    {
+      // per SLAB_SIZE chunk of the pool
+      struct Slab
+      {
+        bool owned = false; // the chunk is occupied by a slab
+        bool listed = false; // the slab is in the partial list
+        uint32_t used = 0; // slots in use, header's ones included
+
+        bool full(const SlabHeader* s) const {
+          return used == s->slot_count();
+        }
+        bool empty(const SlabHeader* s) const {
+          return used == s->first_slot();
+        }
+        uint32_t get_object_count(const SlabHeader* s) const {
+          return used - s->first_slot();
+        }
+      };
+      std::vector<uint64_t> partial[SLAB_CLASSES]; // slabs with free slots
+      std::vector<uint64_t> touched; // slabs modified by the transaction
+      std::vector<Slab> index;
+      // read by get_object_count() without the transaction lock
+      std::atomic<size_t> slab_count = { 0 };
+      std::atomic<size_t> object_count = { 0 };
+
+      SlabState(uint64_t capacity) : index(capacity / SLAB_SIZE) {
+      }
+      bool owns(uint64_t offs) const {
+        auto i = offs / SLAB_SIZE;
+        return i < index.size() && index[i].owned;
+      }
+      Slab& get(uint64_t offs) {
+        return index[offs / SLAB_SIZE];
+      }
+    };
+    SlabState* slabs = nullptr;
+
+    // volatile state of extents leased by the transaction, objects are
+    // bump allocated from them while the log gets a single entry per lease.
+    // The entry is trimmed down to the used part on commit.
+    struct Lease
+    {
+      AllocLogEntry* entry = nullptr;
+      uint64_t offset = 0;
+      uint64_t length = 0;
+      uint64_t used = 0;
+      size_t count = 0; // objects allocated
+      std::vector<AllocEntry> released; // objects released meanwhile
+
+      bool owns(uint64_t offs) const {
+        return offs >= offset && offs < offset + used;
+      }
+    };
+    struct LeaseState
+    {
+      std::vector<Lease> active;
+      // objects past the first one of each lease, get_object_count()
+      // reads it without the transaction lock
+      std::atomic<size_t> extra = { 0 };
+
+      void clear() {
+        active.clear();
+        extra.store(0, std::memory_order_relaxed);
+      }
+    };
+    LeaseState* leases = nullptr;
+
+    uint64_t alloc_leased_raw(size_t uint8_ts);
+    bool free_leased_raw(uint64_t offs, size_t len);
+    void finalize_leases();
+
+    uint64_t alloc_slab_raw(size_t uint8_ts, uint64_t hint = no_hint);
+    void free_slab_raw(uint64_t offs);
+    SlabHeader* create_slab(size_t size_class, uint64_t hint = no_hint);
+    void touch_slab(SlabHeader* s);
+    void unlink_slab(SlabHeader* s);
+    void commit_slabs();
+    void finalize_slabs();
+    void rollback_slabs();
+    void replay_slabs();
+
+    uint64_t alloc_persistent_extent(size_t uint8_ts, size_t align = 0,
+      uint64_t hint = no_hint)
+    {
+      AllocLogEntry& e = ((AllocationLog&)alloc_log).next();
+      e.set(align ?
+        allocator->alloc_aligned(uint8_ts, align, hint) :
+        allocator->alloc(uint8_ts, hint), 0);
+      return e.offset;
+    }
+    void free_persistent_extent(uint64_t offs, size_t len)
+    {
+      AllocLogEntry& e = ((AllocationLog&)alloc_log).next();
+      e.set(offs,
+            (uint32_t)len,
+            AllocLogEntry::RELEASE_FLAG);
+      if (release_batch) {
+        release_batch->emplace_back(e.offset, e.length);
+      } else {
+        allocator->free(e);
+      }
+    }
 
 #define LOCK lock->lock()
 #define UNLOCK lock->unlock();
@@ -516,12 +872,20 @@ namespace PersistentObjects
       //root->base = 0;
       delete objects2release;
       delete lock;
+      delete slabs;
+      delete leases;
     }
 
-    static TransactionRoot* create(uint64_t capacity)
+    // the pool space is reserved up to max_capacity to permit
+    // growth without relocation
+    static TransactionRoot* create(uint64_t capacity,
+      uint64_t max_capacity = 0)
     {
       assert(root->base == 0);
-      root->base = (uint64_t)malloc(capacity); // FIXME: access and allocate PMem. Do mmap?
+      // FIXME: access and allocate PMem
+      root->size = p2roundup<uint64_t>(std::max(capacity, max_capacity),
+        POOL_BASE_ALIGNMENT);
+      root->base = (uint64_t)map_pool(root->size);
       assert(root->base != 0);
       TransactionRoot* res = new ((void*)root->base) TransactionRoot;
       return res;
@@ -530,15 +894,19 @@ namespace PersistentObjects
     {
       assert(root->base != 0);
       tr->~TransactionRoot();
-      free((void*)root->base);
+      unmap_pool((void*)root->base, root->size);
       root->base = 0;
+      root->size = 0;
     }
 
+    // non-zero '_max_capacity' is the limit for online growth,
+    // see grow() and create()
     void prepare(size_t _alloc_log_size,
       size_t _alog_squeeze_threshold,
       size_t _obj_log_size,
       uint64_t capacity,
-      uint32_t min_alloc_unit)
+      uint32_t min_alloc_unit,
+      uint64_t _max_capacity = 0)
     {
       assert(idNext == 0);
       assert(idNext == idPrev);
@@ -547,8 +915,12 @@ namespace PersistentObjects
       objects2release = new std::remove_pointer<decltype(objects2release)>::type;
       lock = new std::shared_mutex();
 
+      max_capacity = std::max(capacity, _max_capacity);
       allocator = new TransactionAllocator();
-      allocator->init(capacity, min_alloc_unit, TR_ROOT_PREALLOC_SIZE);
+      allocator->init(capacity, min_alloc_unit, TR_ROOT_PREALLOC_SIZE,
+        max_capacity);
+      slabs = new SlabState(capacity);
+      leases = new std::remove_pointer<decltype(leases)>::type;
       alloc_base_cnt = allocator->get_alloc_count();
       alog_squeeze_threshold = _alog_squeeze_threshold;
 
@@ -571,6 +943,10 @@ namespace PersistentObjects
       objects2release = nullptr;
       delete lock;
       lock = nullptr;
+      delete slabs;
+      slabs = nullptr;
+      delete leases;
+      leases = nullptr;
       if (allocator) {
         allocator->shutdown();
         delete (TransactionAllocator*)allocator;
@@ -589,12 +965,88 @@ namespace PersistentObjects
       shutdown();
       objects2release = new std::remove_pointer<decltype(objects2release)>::type;
       lock = new std::shared_mutex();
+      leases = new std::remove_pointer<decltype(leases)>::type;
       allocator = new TransactionAllocator;
+      if (restart_threads) {
+        allocator->enable_parallel_apply(restart_threads);
+      }
 
       replay();
+      if (alloc_magazines) {
+        allocator->enable_magazines(alloc_magazines);
+      }
+      if (alloc_lockfree_zones) {
+        allocator->enable_lockfree(alloc_lockfree_zones);
+      }
+      if (alloc_free_index) {
+        allocator->enable_free_index(true);
+      }
+      if (alloc_run_cache) {
+        allocator->enable_run_cache(true);
+      }
+      if (alloc_l3_summary) {
+        allocator->enable_l3_summary(true);
+      }
 
       assert(root->base != 0);
     }
+    // enables per-thread allocation caches, count == 0 disables them.
+    // Setting is volatile and reapplied on restart.
+    void enable_alloc_cache(size_t count) {
+      alloc_magazines = count;
+      allocator->enable_magazines(count);
+    }
+    // enables free extents index to serve contiguous allocations
+    // (e.g. logs and large buffers) without scanning the bitmap.
+    // Setting is volatile and reapplied on restart.
+    void enable_free_index(bool enable) {
+      alloc_free_index = enable;
+      allocator->enable_free_index(enable);
+    }
+    // caches the longest free run per allocator slotset hence
+    // contiguous allocations on a fragmented pool skip the ones
+    // which can't fit. Setting is volatile and reapplied on restart.
+    void enable_run_cache(bool enable) {
+      alloc_run_cache = enable;
+      allocator->enable_run_cache(enable);
+    }
+    // maintains an extra allocator level summarizing fully allocated
+    // regions hence free space search stays short on multi-TB and
+    // mostly full pools. Setting is volatile and reapplied on restart.
+    void enable_alloc_summary(bool enable) {
+      alloc_l3_summary = enable;
+      allocator->enable_l3_summary(enable);
+    }
+    // restores allocator state on restart using that many threads,
+    // 0 or 1 keeps it single threaded. Setting is volatile.
+    void enable_parallel_restart(size_t threads) {
+      restart_threads = threads;
+    }
+    // serves objects up to SLAB_MAX_OBJECT_SIZE from slabs, hence
+    // logging slab extents only. Objects allocated from slabs are
+    // still released properly when disabled.
+    void enable_slab_alloc(bool enable) {
+      slab_alloc = enable;
+    }
+    // bump allocates transaction's objects up to a quarter of 'bytes'
+    // from extents of that size leased at once, hence logging a single
+    // entry per lease. Unused lease tail is released on commit.
+    // 0 disables that.
+    void enable_alloc_lease(size_t bytes) {
+      assert((bytes % allocator->get_min_alloc_size()) == 0);
+      lease_size = bytes;
+    }
+    // enables lock-free allocation of MIN_OBJECT_SIZE-sized objects
+    // using count zones, count == 0 disables that.
+    // Setting is volatile and reapplied on restart.
+    void enable_lockfree_alloc(size_t count) {
+      alloc_lockfree_zones = count;
+      allocator->enable_lockfree(count);
+    }
+
+    // extends the pool up to new_capacity (within the limit given
+    // to prepare) as a standalone transaction
+    void grow(uint64_t new_capacity);
 
     inline TransactionId get_effective_id() const {
       return idNext;
@@ -604,23 +1056,39 @@ namespace PersistentObjects
     }
     void replay();
 
-    uint64_t alloc_persistent_raw(size_t uint8_ts)
+    // non-zero 'align' (power of 2) makes the result its multiple,
+    // 'hint' is a persistent offset (e.g. of the parent object)
+    // to place the result near
+    uint64_t alloc_persistent_raw(size_t uint8_ts, size_t align = 0,
+      uint64_t hint = no_hint)
     {
       // permit within transaction scope only
       assert(in_transaction);
-      AllocLogEntry& e = ((AllocationLog&)alloc_log).next();
-      e.set(allocator->alloc(uint8_ts), 0);
-      return e.offset;
+      // slab slots are aligned to their size
+      auto slab_size = std::max(uint8_ts, align);
+      if (slab_alloc && slab_size <= SLAB_MAX_OBJECT_SIZE) {
+        return alloc_slab_raw(slab_size, hint);
+      }
+      // the hint is of little use for leased objects as the lease
+      // keeps the transaction's objects together anyway
+      if (lease_size && uint8_ts <= lease_size / 4 &&
+          align <= allocator->get_min_alloc_size()) {
+        return alloc_leased_raw(uint8_ts);
+      }
+      return alloc_persistent_extent(uint8_ts, align, hint);
     }
     void free_persistent_raw(uint64_t offs, size_t len)
     {
       // permit within transaction scope only
       assert(in_transaction);
-      AllocLogEntry& e = ((AllocationLog&)alloc_log).next();
-      e.set(offs,
-            (uint32_t)len,
-            AllocLogEntry::RELEASE_FLAG);
-      allocator->free(e);
+      if (slabs->owns(offs)) {
+        free_slab_raw(offs);
+        return;
+      }
+      if (free_leased_raw(offs, len)) {
+        return;
+      }
+      free_persistent_extent(offs, len);
     }
 
     int start_read_access();
@@ -642,14 +1110,33 @@ namespace PersistentObjects
     void queue_in_progress(PObjRecoverable* obj, TransactionId tid, uint64_t offs);
     size_t get_object_count()
     {
-      return allocator->get_alloc_count() -
+      // leases are accounted as a single allocation till commit
+      return allocator->get_alloc_count() +
+        leases->extra.load(std::memory_order_relaxed) -
         ((const AllocationLog&)alloc_log).get_base_cnt() -
         obj_log.get_base_cnt() - 
-        alloc_base_cnt;
+        alloc_base_cnt -
+        slabs->slab_count.load(std::memory_order_relaxed) +
+        slabs->object_count.load(std::memory_order_relaxed);
     }
     uint64_t get_available() {
       return allocator->get_available();
     }
+    uint64_t get_capacity() const {
+      return allocator->get_capacity();
+    }
+    // power-of-two free run histogram, cheap enough for periodic sampling
+    void collect_free_stats(std::map<size_t, size_t>& bins) const {
+      allocator->collect_slotset_stats(bins);
+    }
+    // counters and alloc/free latencies of this pool's allocator
+    void collect_alloc_stats(AllocatorLevel::stats_t* stats) const {
+      allocator->collect_counters(stats);
+    }
+    // starts timing this pool's allocator calls
+    void enable_alloc_latency_stats(bool enable) {
+      allocator->latency_stats = enable;
+    }
     size_t get_alog_size() const {
       return ((const AllocationLog&)alloc_log).get_log_size();
     }
@@ -676,7 +1163,8 @@ namespace PersistentObjects
       static_cast<const T*>(x)->~T(); });
 
     tid = _tid;
-    T* ptr = new (t, 0) T(*_get());
+    // the copy is placed near the original
+    T* ptr = new (t, offs) T(*_get());
     offs = ptr2poffs<T>(ptr);
     return ptr;
   }
@@ -723,7 +1211,7 @@ namespace PersistentObjects
   template <class T>
   template <typename... Args>
   void PUniquePtr<T>::allocate_obj(TransactionRoot& tr, Args&&... args) {
-    T* t = new (tr, 0) T(args...);
+    T* t = new (tr, no_hint) T(args...);
     PObj<T>::tid = tr.get_effective_id();
     PObj<T>::offs = ptr2poffs(t);
   }
@@ -829,8 +1317,14 @@ namespace PersistentObjects
 
     template <class U, typename... Args>
     static PPtrRootOffset<PObj<U>> alloc_persistent_obj(TransactionRoot& tr, Args&&... args) {
-      U* t = new (tr, 0) U(args...);
-      return new (tr, 0) PObj<U>(tr.get_effective_id(), t);
+      return alloc_persistent_obj_near<U>(tr, no_hint, args...);
+    }
+    // places the object near persistent offset 'hint', e.g. its parent's
+    template <class U, typename... Args>
+    static PPtrRootOffset<PObj<U>> alloc_persistent_obj_near(TransactionRoot& tr,
+      uint64_t hint, Args&&... args) {
+      U* t = new (tr, hint) U(args...);
+      return new (tr, hint) PObj<U>(tr.get_effective_id(), t);
     }
   };
 
@@ -937,8 +1431,14 @@ namespace PersistentObjects
 
     template <class U, typename... Args>
     static PPtrThisOffset<PObj<U>> alloc_persistent_obj(TransactionRoot& tr, Args&&... args) {
-      U* t = new (tr) U(args...);
-      return new (tr) PObj<U>(tr.get_effective_id(), t);
+      return alloc_persistent_obj_near<U>(tr, no_hint, args...);
+    }
+    // places the object near persistent offset 'hint', e.g. its parent's
+    template <class U, typename... Args>
+    static PPtrThisOffset<PObj<U>> alloc_persistent_obj_near(TransactionRoot& tr,
+      uint64_t hint, Args&&... args) {
+      U* t = new (tr, hint) U(args...);
+      return new (tr, hint) PObj<U>(tr.get_effective_id(), t);
     }
   };
 
@@ -1042,8 +1542,14 @@ namespace PersistentObjects
 
     template <class U, typename... Args>
     static PBoostOffsetPtr<PObj<U>> alloc_persistent_obj(TransactionRoot& tr, Args&&... args) {
-      U* t = new (tr, 0) U(args...);
-      return new (tr, 0) PObj<U>(tr.get_effective_id(), t);
+      return alloc_persistent_obj_near<U>(tr, no_hint, args...);
+    }
+    // places the object near persistent offset 'hint', e.g. its parent's
+    template <class U, typename... Args>
+    static PBoostOffsetPtr<PObj<U>> alloc_persistent_obj_near(TransactionRoot& tr,
+      uint64_t hint, Args&&... args) {
+      U* t = new (tr, hint) U(args...);
+      return new (tr, hint) PObj<U>(tr.get_effective_id(), t);
     }
   };
   template <typename T>